@@ -0,0 +1,38 @@
+#include "../include/helpers.hpp"
+#include <cstdio>
+#include <sys/time.h>
+
+// normalize_path() on a typical request path and on the adversarial
+// inputs that were quadratic with the old decode_url() + clean_path()
+
+static double now_ms() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static volatile size_t sink;
+
+static void run(const char *name, const std::string &path, int iterations) {
+  double start = now_ms();
+  for (int i = 0; i < iterations; i++)
+    sink += normalize_path(path).size();
+  double elapsed = now_ms() - start;
+  std::printf("%-16s %7lu bytes  %10.4fms per path\n", name,
+              static_cast<unsigned long>(path.size()), elapsed / iterations);
+}
+
+int main() {
+  std::string dots;
+  for (int i = 0; i < 50000; i++)
+    dots += "/a/./..";
+  std::string encoded;
+  for (int i = 0; i < 50000; i++)
+    encoded += "%2F";
+
+  run("typical", "/static/css/../img/%20logo.png", 1000000);
+  run("200k slashes", std::string(200000, '/'), 100);
+  run("dot segments", dots, 100);
+  run("encoded slashes", encoded, 100);
+  return 0;
+}
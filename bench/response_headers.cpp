@@ -0,0 +1,46 @@
+#include "../include/webserv.hpp"
+#include <cstdio>
+#include <sys/time.h>
+
+// serialization of the header block of a 200 file response with
+// validators, the way the static file path builds it
+
+#define ITERATIONS 1000000
+
+static double now_ms() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+int main() {
+  const char *files[] = {"index.html", "style.css", "app.js", "logo.png",
+                         "notes.txt", "archive.tar.gz", "data.json"};
+  size_t count = sizeof(files) / sizeof(*files);
+  std::vector<std::string> names(files, files + count);
+  time_t mtime = 1700000000;
+  unsigned long total = 0;
+
+  double start = now_ms();
+  for (int i = 0; i < ITERATIONS; i++) {
+    off_t size = 1000 + i % 50000;
+    std::string headers;
+    headers.reserve(HEADER_RESERVE);
+    append_status_line(headers, 200);
+    headers += get_server_header();
+    headers += get_date_header();
+    headers += "Connection: keep-alive" CRLF;
+    append_content_type(headers, names[i % count]);
+    headers += get_validator_headers(make_etag(i, size, mtime, false), mtime);
+    append_header(headers, "Content-Length", size);
+    headers += CRLF;
+    total += headers.size();
+  }
+  double elapsed = now_ms() - start;
+
+  std::printf("%d header blocks in %.1fms: %.2fM headers/s "
+              "(%lu bytes average)\n",
+              ITERATIONS, elapsed, ITERATIONS / elapsed / 1000.0,
+              total / ITERATIONS);
+  return 0;
+}
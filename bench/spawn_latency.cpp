@@ -0,0 +1,91 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <spawn.h>
+#include <string>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// spawn latency of /bin/true by fork+execve and by posix_spawn, with the
+// given amounts of touched heap (in MB) resident in the spawning process
+
+#define SPAWNS 200
+
+extern char **environ;
+
+static double now_ms() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static bool fork_exec(char **argv) {
+  pid_t pid = fork();
+  if (pid == -1)
+    return false;
+  if (pid == 0) {
+    execve(argv[0], argv, environ);
+    _exit(127);
+  }
+  int status;
+  return waitpid(pid, &status, 0) == pid;
+}
+
+static bool spawn(char **argv) {
+  pid_t pid;
+  if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0)
+    return false;
+  int status;
+  return waitpid(pid, &status, 0) == pid;
+}
+
+static double mean_ms(bool (*run)(char **), char **argv) {
+  double start = now_ms();
+  for (int i = 0; i < SPAWNS; i++) {
+    if (!run(argv)) {
+      std::perror("spawn");
+      std::exit(1);
+    }
+  }
+  return (now_ms() - start) / SPAWNS;
+}
+
+static std::string format_size(size_t mb) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%luMB",
+                static_cast<unsigned long>(mb));
+  return buffer;
+}
+
+int main(int argc, char **argv) {
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; i++)
+    sizes.push_back(std::strtoul(argv[i], NULL, 10));
+  if (sizes.empty()) {
+    sizes.push_back(0);
+    sizes.push_back(64);
+    sizes.push_back(256);
+    sizes.push_back(1024);
+  }
+
+  char path[] = "/bin/true";
+  char *child_argv[] = {path, NULL};
+  std::printf("%-9s %-13s %s\n", "RSS", "fork+execve", "posix_spawn");
+  for (size_t i = 0; i < sizes.size(); i++) {
+    size_t bytes = sizes[i] * 1024 * 1024;
+    char *heap = static_cast<char *>(std::malloc(bytes ? bytes : 1));
+    if (!heap) {
+      std::perror("malloc");
+      return 1;
+    }
+    std::memset(heap, 1, bytes);
+    double forked = mean_ms(fork_exec, child_argv);
+    double spawned = mean_ms(spawn, child_argv);
+    std::printf("%-9s %-13.2f %.2f\n", format_size(sizes[i]).c_str(),
+                forked, spawned);
+    std::free(heap);
+  }
+  return 0;
+}
@@ -0,0 +1,226 @@
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// TCP segments sent on loopback per batch of keep-alive requests, with
+// tcp_nopush on and off. the server is started on a temporary config and
+// TcpOutSegs is read from /proc/net/snmp around each batch, so both
+// directions count, as does any other traffic in the network namespace.
+// the server binary can be given, ./webserv by default. it listens on
+// ports 18480 and 18481
+
+#define REQUESTS 200
+#define PORT_NOPUSH 18480
+#define PORT_PUSH 18481
+
+static long out_segments() {
+  std::ifstream snmp("/proc/net/snmp");
+  std::string names;
+  std::string values;
+
+  while (std::getline(snmp, names) && std::getline(snmp, values)) {
+    if (names.compare(0, 4, "Tcp:"))
+      continue;
+    std::istringstream name_fields(names);
+    std::istringstream value_fields(values);
+    std::string name;
+    std::string value;
+    while (name_fields >> name && value_fields >> value) {
+      if (name == "OutSegs")
+        return std::atol(value.c_str());
+    }
+  }
+  return -1;
+}
+
+static bool write_file(const std::string &path, const std::string &data) {
+  std::ofstream file(path.c_str(), std::ios::binary);
+  file << data;
+  return file.good();
+}
+
+static int connect_to(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+      return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      return fd;
+    }
+    close(fd);
+    usleep(20000);
+  }
+  return -1;
+}
+
+// reads more of the response into buffer, false once the connection ends
+static bool fill(int fd, std::string &buffer) {
+  char chunk[65536];
+  ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+  if (n <= 0)
+    return false;
+  buffer.append(chunk, n);
+  return true;
+}
+
+// reads one whole response, framed by Content-Length or chunked encoding
+static bool read_response(int fd, std::string &buffer) {
+  size_t head_end;
+  while ((head_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+    if (!fill(fd, buffer))
+      return false;
+  }
+  std::string head = buffer.substr(0, head_end);
+  buffer.erase(0, head_end + 4);
+
+  size_t pos = head.find("Content-Length: ");
+  if (pos != std::string::npos) {
+    size_t length = std::strtoul(head.c_str() + pos + 16, NULL, 10);
+    while (buffer.size() < length) {
+      if (!fill(fd, buffer))
+        return false;
+    }
+    buffer.erase(0, length);
+    return true;
+  }
+  for (;;) {
+    size_t line_end;
+    while ((line_end = buffer.find("\r\n")) == std::string::npos) {
+      if (!fill(fd, buffer))
+        return false;
+    }
+    size_t size = std::strtoul(buffer.c_str(), NULL, 16);
+    while (buffer.size() < line_end + 2 + size + 2) {
+      if (!fill(fd, buffer))
+        return false;
+    }
+    buffer.erase(0, line_end + 2 + size + 2);
+    if (size == 0)
+      return true;
+  }
+}
+
+static long run(int port, const std::string &request) {
+  int fd = connect_to(port);
+  if (fd == -1)
+    return -1;
+  std::string buffer;
+  long before = out_segments();
+  for (int i = 0; i < REQUESTS; i++) {
+    if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) !=
+            (ssize_t)request.size() ||
+        !read_response(fd, buffer)) {
+      close(fd);
+      return -1;
+    }
+  }
+  long segments = out_segments() - before;
+  close(fd);
+  return segments;
+}
+
+static std::string server_block(int port, const std::string &dir,
+                                const char *nopush) {
+  std::ostringstream listen;
+  listen << port;
+  std::string conf = "server {\n    listen " + listen.str() +
+                     ";\n    server_name localhost;\n    root " + dir +
+                     ";\n";
+  const char *locations[][2] = {
+      {"/pread", "sendfile off;\n"},
+      {"/sendfile", "sendfile on;\n"},
+      {"/gzip", "sendfile off;\n        gzip on;\n"
+                "        gzip_types text/plain;\n"}};
+  for (size_t i = 0; i < 3; i++)
+    conf += "    location " + std::string(locations[i][0]) +
+            " {\n        allow GET;\n        alias " + dir +
+            ";\n        " + locations[i][1] + "        tcp_nopush " +
+            nopush + ";\n    }\n";
+  return conf + "}\n";
+}
+
+int main(int argc, char **argv) {
+  const char *server = argc > 1 ? argv[1] : "./webserv";
+  char dir_template[] = "/tmp/webserv_bench.XXXXXX";
+  if (!mkdtemp(dir_template)) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string dir = dir_template;
+  std::string text;
+  while (text.size() < 20 * 1024)
+    text += "the quick brown fox jumps over the lazy dog 0123456789\n";
+  text.resize(20 * 1024);
+  std::string conf_path = dir + "/webserv.conf";
+  if (!write_file(dir + "/small.txt", "abc") ||
+      !write_file(dir + "/big.txt", text) ||
+      !write_file(conf_path, server_block(PORT_NOPUSH, dir, "on") +
+                                 server_block(PORT_PUSH, dir, "off"))) {
+    std::fprintf(stderr, "can't write to %s\n", dir.c_str());
+    return 1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    dup2(null, 2);
+    execl(server, server, conf_path.c_str(), (char *)NULL);
+    _exit(127);
+  }
+
+  const char *cases[][2] = {
+      {"3 byte file", "/pread/small.txt"},
+      {"20KB via pread", "/pread/big.txt"},
+      {"20KB sendfile", "/sendfile/big.txt"},
+      {"gzip chunked 20KB", "/gzip/big.txt"},
+      {"3 ranges", "/pread/big.txt"},
+  };
+  int status = 0;
+  std::printf("%d keep-alive requests, TcpOutSegs\n", REQUESTS);
+  std::printf("%-20s %12s %12s\n", "response", "nopush off", "nopush on");
+  for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+    std::string request = std::string("GET ") + cases[i][1] +
+                          " HTTP/1.1\r\nHost: localhost\r\n"
+                          "Accept-Encoding: gzip\r\n";
+    if (i == 4)
+      request += "Range: bytes=0-99,1000-1099,5000-5099\r\n";
+    request += "\r\n";
+    long off = run(PORT_PUSH, request);
+    long on = run(PORT_NOPUSH, request);
+    if (off < 0 || on < 0) {
+      std::fprintf(stderr, "%s: request failed\n", cases[i][0]);
+      status = 1;
+      break;
+    }
+    std::printf("%-20s %12ld %12ld\n", cases[i][0], off, on);
+  }
+
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  unlink((dir + "/small.txt").c_str());
+  unlink((dir + "/big.txt").c_str());
+  unlink(conf_path.c_str());
+  rmdir(dir.c_str());
+  return status;
+}
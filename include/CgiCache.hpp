@@ -0,0 +1,102 @@
+#ifndef CGICACHE_HPP
+#define CGICACHE_HPP
+
+#include "ContentCache.hpp"
+#include "parser.hpp"
+
+// a script's response being kept while it is sent, stored once complete
+struct CgiCacheFill {
+  std::string key;
+  bool cacheable;      // cgi_cache is on for the location
+  time_t valid;        // cgi_cache_valid of the location
+  bool leader;         // other requests wait on this one's response
+  time_t ttl;          // decided once the header block is read
+  bool shared;         // the response may be copied to the waiting requests
+  std::string status;  // of the Status header, "200 OK" without one
+  std::string headers; // the script's, minus Status and Content-Length
+  std::string body;    // while it fits the memory tier
+  int fd;              // disk tier file once the body outgrew memory
+  size_t size;
+
+  CgiCacheFill();
+  ~CgiCacheFill();
+};
+
+// identical requests waiting on the one running the script
+struct CgiCacheFlight {
+  std::string key;
+  std::vector<Client *> waiters;
+  time_t start;
+  time_t timeout; // cgi_cache_lock_timeout of the location
+};
+
+// Micro-cache of script responses keyed by the location's cgi_cache_key.
+// GETs are answered from it before a script is started. Entries live for
+// the script's Cache-Control max-age, or cgi_cache_valid without one.
+// Small bodies are kept in memory, larger ones in unlinked files of the
+// cgi_cache_path directory when it is set.
+// With cgi_cache_lock, a GET whose key already has a script running waits
+// for that script's response and gets a copy of it, cached or not.
+// Requests with Cookie or Authorization are neither answered from the
+// cache nor collapsed, unless the key includes those headers.
+class CgiCache {
+private:
+  struct Entry {
+    std::string status;
+    std::string headers;
+    SharedBuffer *body;    // memory tier
+    SharedBuffer *gzipped; // body compressed, made on the first gzip hit
+    int fd;                // disk tier
+    size_t size;
+    time_t expires;
+    std::list<std::string>::iterator lru;
+  };
+
+  std::map<std::string, Entry> entries;
+  std::list<std::string> lru;
+  std::map<std::string, CgiCacheFlight *> flights;
+  std::vector<int> finished; // sockets of waiters given their response
+  std::vector<int> retries;  // sockets of waiters to run their own script
+  size_t memory_used;
+  size_t memory_budget;
+  std::string disk_path;
+  size_t disk_used;
+  size_t disk_budget;
+  time_t last_expire;
+  size_t hits;
+  size_t misses;
+  size_t bypasses;
+  size_t stores;
+  size_t evictions;
+  size_t collapsed;
+  size_t lock_timeouts;
+
+  void take_fill(CgiCacheFill *fill, Entry &entry);
+  void release_entry(Entry &entry);
+  void erase(std::map<std::string, Entry>::iterator it);
+  bool make_room(size_t size, bool on_disk);
+  bool serve(Client &client, Entry &entry);
+  bool join_flight(Client &client, const std::string &key);
+  bool start_flight(const std::string &key, time_t timeout);
+  void end_flight(const std::string &key, Entry *entry);
+
+public:
+  CgiCache();
+  ~CgiCache();
+
+  void configure(std::vector<ServerConfig> &servers_conf);
+  bool lookup(Client &client, const LocationConfig *location);
+  void check_headers(Client &client, const std::string &cgi_headers);
+  void append(Client &client, const char *data, size_t len);
+  void store(Client &client);
+  void drop(Client &client);
+  void leave(Client &client);
+  void expire();
+  void take_finished(std::vector<int> &fds);
+  void take_retries(std::vector<int> &fds);
+  std::string status() const;
+};
+
+extern CgiCache cgi_cache;
+
+#endif
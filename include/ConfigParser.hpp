@@ -28,6 +28,34 @@ const long MAX_BODY_SIZE = 1073741824L;
 typedef enum { GET, POST, OPTIONS, DELETE, NONE } HTTP_METHOD;
 
 #define DEFAULT_MAX_BODY_SIZE (2 * 1024 * 1024) // 2MB default
+#define DEFAULT_OPEN_FILE_CACHE_INACTIVE 60      // seconds
+#define DEFAULT_CONTENT_CACHE_SIZE (16 * 1024 * 1024) // 16MB
+#define DEFAULT_CONTENT_CACHE_MAX_FILE (256 * 1024)   // 256KB
+#define DEFAULT_CGI_CACHE_SIZE (16 * 1024 * 1024)      // 16MB
+#define DEFAULT_CGI_CACHE_DISK_SIZE (256 * 1024 * 1024) // 256MB
+#define DEFAULT_CGI_CACHE_KEY "$request_method $host$uri$args"
+#define DEFAULT_CGI_CACHE_LOCK_TIMEOUT 5 // seconds
+#define DEFAULT_KEEPALIVE_TIMEOUT 75            // seconds
+#define DEFAULT_KEEPALIVE_REQUESTS 1000
+#define DEFAULT_WRITE_QUANTUM (64 * 1024)      // 64KB
+#define DEFAULT_GZIP_COMP_LEVEL 1
+#define DEFAULT_GZIP_MIN_LENGTH 20
+// expires values besides a number of seconds
+#define EXPIRES_OFF -1
+#define EXPIRES_EPOCH -2
+#define EXPIRES_MAX -3
+
+// on the fly compression settings, set per server and per location
+struct GzipConfig {
+  bool enabled;
+  int comp_level;
+  size_t min_length;
+  std::vector<std::string> types; // "*" matches any type
+
+  GzipConfig()
+      : enabled(false), comp_level(DEFAULT_GZIP_COMP_LEVEL),
+        min_length(DEFAULT_GZIP_MIN_LENGTH), types(1, "text/html") {}
+};
 
 struct LocationConfig {
   std::string path;
@@ -41,11 +69,38 @@ struct LocationConfig {
   bool autoindex;
   std::string upload_store;
   std::map<std::string, std::string> cgi_ext;
+  std::string fastcgi_pass; // unix:/path or host:port of an application
+  size_t client_max_body_size;
+  bool sendfile;
+  bool tcp_nopush;
+  bool tcp_nodelay;
+  bool content_cache;
+  bool cgi_cache;
+  std::string cgi_cache_key;
+  time_t cgi_cache_valid; // without a Cache-Control max-age, 0 for none
+  bool cgi_cache_lock;     // identical GETs wait on the one running
+  time_t cgi_cache_lock_timeout;
+  size_t limit_rate;       // bytes per second, 0 for no limit
+  size_t limit_rate_after; // sent at full speed before the limit applies
+  bool stub_status;
+  bool internal; // only reached through a script's X-Accel-Redirect
+  bool gzip_static;
+  bool brotli_static;
+  GzipConfig gzip;
+  time_t expires;
+  std::string cache_control;
 
   LocationConfig()
       : path(""), allowed_methods(), root(""), alias(""), index(),
-        redirect_code(0), redirect_url(""), autoindex(false), upload_store("") {
-  }
+        redirect_code(0), redirect_url(""), autoindex(false), upload_store(""),
+        client_max_body_size(DEFAULT_MAX_BODY_SIZE), sendfile(true),
+        tcp_nopush(false), tcp_nodelay(true), content_cache(false),
+        cgi_cache(false), cgi_cache_key(DEFAULT_CGI_CACHE_KEY),
+        cgi_cache_valid(0), cgi_cache_lock(false),
+        cgi_cache_lock_timeout(DEFAULT_CGI_CACHE_LOCK_TIMEOUT), limit_rate(0),
+        limit_rate_after(0),
+        stub_status(false), internal(false), gzip_static(false),
+        brotli_static(false), expires(EXPIRES_OFF) {}
 };
 
 class ServerConfig {
@@ -59,13 +114,39 @@ private:
   std::vector<std::string> index;
   std::vector<LocationConfig> locations;
   bool autoindex;
+  bool sendfile;
+  bool tcp_nopush;
+  bool tcp_nodelay;
+  size_t open_file_cache_max;
+  time_t open_file_cache_inactive;
+  bool open_file_cache_errors;
+  bool content_cache;
+  size_t content_cache_size;
+  size_t content_cache_max_file;
+  size_t cgi_cache_size;
+  std::string cgi_cache_path; // directory of the disk tier, "" for none
+  size_t cgi_cache_disk_size;
+  GzipConfig gzip;
+  time_t keepalive_timeout;
+  size_t keepalive_requests;
+  size_t write_quantum;
   bool has_listen;
   bool has_root;
 
 public:
   ServerConfig()
       : client_max_body_size(DEFAULT_MAX_BODY_SIZE), autoindex(false),
-        has_listen(false), has_root(false) {}
+        sendfile(true), tcp_nopush(false), tcp_nodelay(true),
+        open_file_cache_max(0),
+        open_file_cache_inactive(DEFAULT_OPEN_FILE_CACHE_INACTIVE),
+        open_file_cache_errors(true), content_cache(false),
+        content_cache_size(DEFAULT_CONTENT_CACHE_SIZE),
+        content_cache_max_file(DEFAULT_CONTENT_CACHE_MAX_FILE),
+        cgi_cache_size(DEFAULT_CGI_CACHE_SIZE),
+        cgi_cache_disk_size(DEFAULT_CGI_CACHE_DISK_SIZE),
+        keepalive_timeout(DEFAULT_KEEPALIVE_TIMEOUT),
+        keepalive_requests(DEFAULT_KEEPALIVE_REQUESTS),
+        write_quantum(DEFAULT_WRITE_QUANTUM), has_listen(false), has_root(false) {}
   ~ServerConfig() {
     for (int i = 0; i < (int)fds.size(); i++)
       close(this->fds[i]);
@@ -85,6 +166,22 @@ public:
   const std::vector<std::string> &getIndex() const { return index; }
   std::vector<LocationConfig> &getLocations() { return locations; }
   bool isAutoindex() const { return autoindex; }
+  bool isSendfile() const { return sendfile; }
+  bool isTcpNopush() const { return tcp_nopush; }
+  bool isTcpNodelay() const { return tcp_nodelay; }
+  time_t getKeepaliveTimeout() const { return keepalive_timeout; }
+  size_t getKeepaliveRequests() const { return keepalive_requests; }
+  size_t getWriteQuantum() const { return write_quantum; }
+  size_t getOpenFileCacheMax() const { return open_file_cache_max; }
+  time_t getOpenFileCacheInactive() const { return open_file_cache_inactive; }
+  bool isOpenFileCacheErrors() const { return open_file_cache_errors; }
+  bool isContentCache() const { return content_cache; }
+  size_t getContentCacheSize() const { return content_cache_size; }
+  size_t getContentCacheMaxFile() const { return content_cache_max_file; }
+  size_t getCgiCacheSize() const { return cgi_cache_size; }
+  const std::string &getCgiCachePath() const { return cgi_cache_path; }
+  size_t getCgiCacheDiskSize() const { return cgi_cache_disk_size; }
+  const GzipConfig &getGzip() const { return gzip; }
   bool hasListen() const { return has_listen; }
   bool hasRoot() const { return has_root; }
 
@@ -109,6 +206,26 @@ public:
     locations = locs;
   }
   void setAutoindex(bool ai) { autoindex = ai; }
+  void setSendfile(bool on) { sendfile = on; }
+  void setTcpNopush(bool on) { tcp_nopush = on; }
+  void setTcpNodelay(bool on) { tcp_nodelay = on; }
+  void setKeepaliveTimeout(time_t timeout) { keepalive_timeout = timeout; }
+  void setKeepaliveRequests(size_t requests) { keepalive_requests = requests; }
+  void setWriteQuantum(size_t quantum) { write_quantum = quantum; }
+  void setOpenFileCache(size_t max, time_t inactive) {
+    open_file_cache_max = max;
+    open_file_cache_inactive = inactive;
+  }
+  void setOpenFileCacheErrors(bool on) { open_file_cache_errors = on; }
+  void setContentCache(bool on) { content_cache = on; }
+  void setContentCacheSize(size_t size) { content_cache_size = size; }
+  void setContentCacheMaxFile(size_t size) { content_cache_max_file = size; }
+  void setCgiCacheSize(size_t size) { cgi_cache_size = size; }
+  void setCgiCachePath(const std::string &path, size_t size) {
+    cgi_cache_path = path;
+    cgi_cache_disk_size = size;
+  }
+  GzipConfig &getGzip() { return gzip; }
 
   void addServerName(const std::string &name) { server_names.push_back(name); }
   void addErrorPage(int code, const std::string &path) {
@@ -124,6 +241,9 @@ public:
 };
 
 bool safeAtoi(const std::string &str, long &result);
+bool isGzipDirective(const std::string &directive);
+void parseGzipDirective(GzipConfig &gzip, const std::vector<std::string> &tokens);
+bool parseTime(const std::string &str, long &seconds);
 std::vector<ServerConfig> parseConfig(const std::string &file);
 bool isPathCompatible(const std::string &locationPath,
                       const std::string &requestedPath);
@@ -0,0 +1,61 @@
+#ifndef CONTENTCACHE_HPP
+#define CONTENTCACHE_HPP
+
+#include "OpenFileCache.hpp"
+
+// immutable buffer shared by the cache and the clients still sending it,
+// freed when the last reference is released
+struct SharedBuffer {
+  std::string data;
+  size_t refs;
+};
+
+SharedBuffer *new_shared_buffer(const std::string &data);
+SharedBuffer *retain_buffer(SharedBuffer *buffer);
+void release_buffer(SharedBuffer *buffer);
+
+// Byte budgeted LRU cache of small files, each entry holding the body and
+// its serialized 200 header block. Entries are validated against the
+// file's size, inode and mtime on every hit.
+class ContentCache {
+private:
+  struct Entry {
+    SharedBuffer *body;
+    std::string type_path;
+    std::string extra_headers;
+    std::string headers;
+    time_t headers_date;
+    FileInfo info;
+    std::list<std::string>::iterator lru;
+  };
+
+  std::map<std::string, Entry> entries;
+  std::list<std::string> lru;
+  size_t used;
+  size_t budget;
+  size_t max_file;
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+
+  void erase(std::map<std::string, Entry>::iterator it);
+  void refresh_headers(Entry &entry);
+
+public:
+  ContentCache();
+  ~ContentCache();
+
+  void configure(std::vector<ServerConfig> &servers_conf);
+  bool lookup(const std::string &path, const std::string &type_path,
+              const std::string &extra_headers, const FileInfo &info,
+              std::string &headers, SharedBuffer *&body);
+  bool store(const std::string &path, const std::string &type_path,
+             const std::string &extra_headers, const FileInfo &info, int fd,
+             std::string &headers, SharedBuffer *&body);
+  void invalidate(const std::string &path);
+  std::string status() const;
+};
+
+extern ContentCache content_cache;
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef DIRLISTING_HPP
+#define DIRLISTING_HPP
+
+#include "ContentCache.hpp"
+
+enum ListingSort { SORT_NONE, SORT_NAME, SORT_SIZE, SORT_TIME };
+
+// the sort, order, page and per_page query parameters of an autoindex
+struct ListingOptions {
+  ListingSort sort;
+  bool desc;
+  size_t page;     // starting at 1
+  size_t per_page; // 0 lists everything on one page
+
+  ListingOptions() : sort(SORT_NONE), desc(false), page(1), per_page(0) {}
+};
+
+struct ListingEntry {
+  std::string name;
+  bool is_dir;
+  off_t size;
+  time_t mtime;
+};
+
+ListingOptions parse_listing_options(const std::string &query);
+std::string listing_cache_key(const std::string &path,
+                              const ListingOptions &options);
+
+// Directory index rendered a batch of entries at a time, so a large
+// directory is streamed out while it is being read. Entries come from
+// getdents64 and are stat'ed relative to the directory fd. Unsorted
+// listings are rendered in directory order as they are read, only the
+// entries of the requested page stat'ed, sorted ones once the whole
+// directory is read.
+class DirListing {
+private:
+  int dir_fd;
+  std::string title;
+  ListingOptions options;
+  std::vector<char> buffer;
+  std::vector<ListingEntry> entries;
+  size_t seen;         // entries read so far, for paging
+  size_t render_index; // next entry to render once sorted
+  bool started;
+  bool read_done;
+  bool has_next;
+  time_t minute; // of time_str, consecutive entries often share it
+  std::string time_str;
+  std::string cache_key;
+  FileInfo dir_info;
+  std::string rendered; // whole page, kept for the cache
+  bool cacheable;
+
+  bool read_batch(std::string &out);
+  void render(const ListingEntry &entry, std::string &out);
+  void render_tail(std::string &out);
+
+public:
+  DirListing(int dir_fd, const std::string &title,
+             const ListingOptions &options, const std::string &cache_key,
+             const FileInfo &dir_info);
+  ~DirListing();
+
+  bool next(std::string &out);
+};
+
+// Rendered listings keyed by directory and query, valid as long as the
+// directory's inode and mtime are unchanged
+class DirListingCache {
+private:
+  struct Entry {
+    SharedBuffer *body;
+    FileInfo info;
+    std::list<std::string>::iterator lru;
+  };
+
+  std::map<std::string, Entry> entries;
+  std::list<std::string> lru;
+  size_t used;
+  size_t hits;
+  size_t misses;
+
+  void erase(std::map<std::string, Entry>::iterator it);
+
+public:
+  DirListingCache();
+  ~DirListingCache();
+
+  bool lookup(const std::string &key, const FileInfo &info,
+              SharedBuffer *&body);
+  void store(const std::string &key, const FileInfo &info,
+             const std::string &html);
+  std::string status() const;
+};
+
+extern DirListingCache dir_listing_cache;
+
+#endif
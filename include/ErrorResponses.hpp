@@ -0,0 +1,43 @@
+#ifndef ERRORRESPONSES_HPP
+#define ERRORRESPONSES_HPP
+
+#include "ContentCache.hpp"
+
+// seconds a custom error_page is used before it is checked on disk again
+#define ERROR_PAGE_CHECK_INTERVAL 1
+
+// a rendered error or redirect page
+struct ErrorPage {
+  SharedBuffer *body; // NULL when the custom page is missing without a
+                      // built-in one to stand in for it
+  std::map<int, SharedBuffer *> gzip_bodies; // by level, made on first use
+  std::string mime;
+  std::string file; // custom error_page, "" for the built-in page
+  bool missing;     // the custom page couldn't be read
+  FileInfo info;    // of the custom page when it was read
+  time_t checked;   // when the custom page was last compared with the disk
+};
+
+// Error and redirect pages of every server, rendered when the config is
+// loaded so answering an error costs no disk I/O. Custom error_page files
+// are checked on disk at most once per ERROR_PAGE_CHECK_INTERVAL and
+// rendered again when they changed. A missing one is answered with the
+// built-in page until it shows up.
+class ErrorResponses {
+private:
+  std::map<const ServerConfig *, std::map<int, ErrorPage> > pages;
+
+  bool render(const ServerConfig *server_conf, int code, ErrorPage &page);
+  void release(ErrorPage &page);
+
+public:
+  ~ErrorResponses();
+
+  void configure(std::vector<ServerConfig> &servers_conf);
+  ErrorPage *find(const ServerConfig *server_conf, int code);
+  void clear();
+};
+
+extern ErrorResponses error_responses;
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef FASTCGI_HPP
+#define FASTCGI_HPP
+
+#include "parser.hpp"
+#include <list>
+
+class FastCGIUpstream;
+struct FastCGIConnection;
+
+// a request handed to an application. it lives until the application
+// ends it, the client may be gone before that
+struct FastCGIRequest {
+  Client *client;           // NULL once the client is gone
+  FastCGIUpstream *upstream;
+  FastCGIConnection *conn;  // NULL while waiting for a connection
+  unsigned short id;
+  std::string params;       // encoded FCGI_PARAMS stream, kept for a retry
+  int body_fd;              // request body, sent as FCGI_STDIN
+  std::string output;       // FCGI_STDOUT received so far
+  time_t start;             // or of the abort once the client is gone
+  int attempts;
+};
+
+// connection to an application, kept open between requests. several
+// requests share it when the application multiplexes
+struct FastCGIConnection {
+  int fd;
+  FastCGIUpstream *upstream;
+  bool connecting;
+  bool writing;     // registered for EPOLLOUT
+  bool reused;      // a request already completed on it
+  bool mpxs;        // FCGI_MPXS_CONNS reported by the application
+  size_t max_reqs;  // requests it takes at once
+  std::string in;   // received bytes, up to a partial record
+  std::string out;  // records waiting to be written
+  std::map<unsigned short, FastCGIRequest *> requests;
+  std::deque<FastCGIRequest *> uploading; // FCGI_STDIN streams, in order
+  unsigned short next_id;
+};
+
+// an application address with its connections and the requests waiting
+// for one of them
+class FastCGIUpstream {
+public:
+  std::string address;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  std::list<FastCGIConnection *> conns;
+  std::deque<FastCGIRequest *> waiting;
+
+  explicit FastCGIUpstream(const std::string &address);
+  bool resolve();
+};
+
+// FastCGI client for the locations with fastcgi_pass. Connections to an
+// application are reused across requests (FCGI_KEEP_CONN) and carry
+// several requests at once when the application reports FCGI_MPXS_CONNS.
+// Everything is non-blocking and driven by the server's epoll loop.
+class FastCGIPool {
+private:
+  std::map<std::string, FastCGIUpstream *> upstreams;
+  std::map<int, FastCGIConnection *> connections; // by fd
+  std::vector<int> finished; // sockets of clients whose response is ready
+  int epoll_fd;
+  time_t last_expire;
+  size_t requests;
+  size_t connects;
+  size_t reuses;
+  size_t multiplexed;
+
+  FastCGIConnection *connect(FastCGIUpstream *upstream);
+  void close_connection(FastCGIConnection *conn, bool retry);
+  void set_writing(FastCGIConnection *conn, bool on);
+  void dispatch(FastCGIUpstream *upstream);
+  void assign(FastCGIConnection *conn, FastCGIRequest *request);
+  bool fill_stdin(FastCGIConnection *conn);
+  bool flush(FastCGIConnection *conn);
+  bool read_records(FastCGIConnection *conn);
+  bool handle_record(FastCGIConnection *conn, unsigned char type,
+                     unsigned short id, const std::string &content);
+  void send_abort(FastCGIConnection *conn, FastCGIRequest *request);
+  void finish(FastCGIRequest *request, int status);
+  void release(FastCGIRequest *request);
+
+public:
+  FastCGIPool();
+  ~FastCGIPool();
+
+  void init(int epoll_fd);
+  bool owns(int fd) const;
+  int start(Client &client, const ServerConfig &server_conf,
+            const LocationConfig *location, const std::string &path);
+  void handle_event(int fd, uint32_t events);
+  void abort(FastCGIRequest *request);
+  void expire();
+  void take_finished(std::vector<int> &fds);
+  std::string status() const;
+};
+
+extern FastCGIPool fastcgi_pool;
+
+#endif
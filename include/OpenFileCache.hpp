@@ -0,0 +1,67 @@
+#ifndef OPENFILECACHE_HPP
+#define OPENFILECACHE_HPP
+
+#include "ConfigParser.hpp"
+#include <list>
+
+// what a lookup learned about a path
+struct FileInfo {
+  int error; // errno of the failed lookup, 0 when the path exists
+  mode_t mode;
+  off_t size;
+  time_t mtime;
+  long mtime_nsec;
+  ino_t ino;
+};
+
+// Cache of open descriptors and metadata keyed by resolved path,
+// including negative entries for missing paths. Entries are dropped when
+// inotify reports a change in their directory, when they stay unused for
+// the inactive timeout, or when the cache is full (least recently used).
+class OpenFileCache {
+private:
+  struct Entry {
+    int fd; // -1 for negative entries
+    FileInfo info;
+    int wd;
+    time_t last_used;
+    std::list<std::string>::iterator lru;
+  };
+
+  std::map<std::string, Entry> entries;
+  std::list<std::string> lru;
+  std::map<std::string, int> dir_to_wd;
+  std::map<int, std::pair<std::string, size_t> > watches;
+  size_t max_entries;
+  time_t inactive;
+  int inotify_fd;
+
+  int watch_dir(const std::string &dir);
+  void erase(std::map<std::string, Entry>::iterator it);
+  void erase_dir(int wd);
+  void invalidate_tree(const std::string &dir);
+  const Entry *find(const std::string &key);
+  const Entry *load(const std::string &key, bool cache_errors, int &fd,
+                    FileInfo &info);
+
+public:
+  OpenFileCache();
+  ~OpenFileCache();
+
+  void configure(std::vector<ServerConfig> &servers_conf);
+  int init(int epoll_fd);
+  int get_fd() const { return inotify_fd; }
+  bool is_active() const { return inotify_fd != -1; }
+
+  bool stat(const ServerConfig *server_conf, const std::string &path,
+            FileInfo &info);
+  int open(const ServerConfig *server_conf, const std::string &path);
+  void invalidate(const std::string &path);
+  void handle_events();
+  void expire();
+  void clear();
+};
+
+extern OpenFileCache open_file_cache;
+
+#endif
@@ -11,6 +11,7 @@ enum PARSING_ERROR {
   LENGTH_REQUIRED = 411,
   PAYLOAD_TOO_LARGE = 413,
   URL_TOO_LONG = 414,
+  EXPECTATION_FAILED = 417,
   METHOD_NOT_IMPLEMENTED = 501,
   LONG_HEADER = 431,
   HTTP_VERSION_NOT_SUPPORTED = 505,
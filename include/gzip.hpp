@@ -0,0 +1,43 @@
+#ifndef GZIP_HPP
+#define GZIP_HPP
+
+#include "libs.hpp"
+#include <stdint.h>
+
+// Incremental gzip (RFC 1952) encoder. Input is matched against a 32KB
+// sliding window (LZ77 with hash chains) and coded with the fixed Huffman
+// codes of RFC 1951, so its state stays bounded whatever the body size.
+// The level (1-9) sets how far the hash chains are searched.
+class GzipStream {
+private:
+  std::string window; // history followed by the input being coded
+  std::vector<unsigned short> head;
+  std::vector<unsigned short> prev;
+  size_t base; // stream offset of window[0]
+  size_t max_chain;
+  unsigned long bit_buffer;
+  int bit_count;
+  uint32_t crc;
+  uint32_t total_in;
+  bool started;
+
+  void start(std::string &out);
+  void put_bits(unsigned long value, int count, std::string &out);
+  void put_code(unsigned code, int len, std::string &out);
+  void put_symbol(unsigned symbol, std::string &out);
+  void put_match(size_t length, size_t distance, std::string &out);
+  void insert(size_t pos);
+  size_t longest_match(size_t pos, size_t &distance);
+  void deflate_slice(size_t start, std::string &out);
+  void slide();
+
+public:
+  GzipStream(int level);
+
+  void compress(const char *data, size_t len, std::string &out);
+  void finish(std::string &out);
+};
+
+std::string gzip_string(const std::string &data, int level);
+
+#endif
@@ -23,9 +23,7 @@ void catch_setup_serverconf(Client *client,
                             std::vector<ServerConfig> &servers_conf);
 
 std::string decode_url(const std::string &encoded);
-std::string replace_first(const std::string &str, const std::string &old_sub,
-                          const std::string &new_sub);
-std::string clean_path(const std::string url);
+std::string normalize_path(const std::string &raw);
 
 std::string bufferToHexString(const uint8_t *buffer, size_t length);
 
@@ -0,0 +1,65 @@
+#ifndef MULTIPART_HPP
+#define MULTIPART_HPP
+
+#include "libs.hpp"
+
+#define MULTIPART_MAX_HEADER_SIZE 8192
+#define MULTIPART_MAX_BOUNDARY 70
+// part bytes are written once this much is pending
+#define MULTIPART_WRITE_SIZE (64 * 1024)
+
+// Boyer-Moore-Horspool matcher for a fixed pattern
+class BMHMatcher {
+private:
+  std::string pattern;
+  size_t skip[256];
+
+public:
+  BMHMatcher();
+  explicit BMHMatcher(const std::string &pattern);
+
+  size_t find(const char *data, size_t len) const;
+  size_t size() const { return pattern.size(); }
+};
+
+// Incremental multipart/form-data parser.
+// Bytes are fed in arbitrary slices as the request body is received, file
+// parts are written to upload_store as soon as they can't be part of a
+// delimiter, so memory stays bounded by MULTIPART_WRITE_SIZE plus the
+// slice size and the delimiter length. Files of an upload that doesn't
+// finish are removed.
+class MultipartParser {
+private:
+  enum State { PREAMBLE, AFTER_DELIMITER, HEADERS, BODY, DONE };
+
+  State state;
+  BMHMatcher delimiter;
+  std::string upload_store;
+  std::string carry;
+  int out_fd;
+  std::string pending; // part bytes not written yet
+  size_t part_index;
+  std::vector<std::string> saved;
+  bool complete;
+
+  void parse_part_headers(const std::string &headers);
+  void open_part_file(const std::string &filename);
+  void write_part(const char *data, size_t len);
+  void flush_part();
+  void close_part();
+
+public:
+  MultipartParser(const std::string &boundary,
+                  const std::string &upload_store);
+  ~MultipartParser();
+
+  void feed(const char *data, size_t len);
+  void finish();
+  void discard();
+
+  const std::vector<std::string> &files() const { return saved; }
+};
+
+std::string get_multipart_boundary(const std::string &content_type);
+
+#endif
@@ -5,8 +5,17 @@
 
 typedef enum {
   HTTP1,
+  HTTP10,
 } HTTP_VERSION;
 
+struct SharedBuffer;
+class GzipStream;
+class DirListing;
+struct FastCGIRequest;
+struct CgiCacheFill;
+struct CgiCacheFlight;
+class MultipartParser;
+
 class HttpHeader {
   public:
     std::string key;
@@ -17,13 +26,34 @@ typedef struct {
   pid_t pid;
   int pipe_fd;
   int in_pipe_fd;
-  bool data_received;
-  int output_fd;
-  std::string output_file;
-  std::time_t start; 
+  std::string input;  // request body bytes the script hasn't taken yet
+  bool input_blocked; // its stdin is full, registered for EPOLLOUT
+  bool input_paused;  // the socket isn't read until the script catches up
+  bool splice_full;   // splice found no room, the body goes through input
+  std::string header; // script output up to the end of its header block
+  bool streaming;     // header block sent, the body follows as it is read
+  bool chunked;       // the script gave no Content-Length
+  bool paused;        // pipe out of epoll until the client catches up
+  std::time_t start;  // of the script, then of its last output
   int body_fd;
 } CGI;
 
+// one buffer of the outgoing response, owned bytes or a shared body.
+// offset counts the bytes already sent
+struct OutSegment {
+  std::string data;
+  SharedBuffer *shared;
+  size_t offset;
+};
+
+// one part of a multipart/byteranges body, its header then [start, end)
+// of the file
+struct RangePart {
+  std::string head;
+  off_t start;
+  off_t end;
+};
+
 class URL {
   private:
     std::string path;
@@ -70,6 +100,8 @@ class HttpRequest {
   public:
     bool head_parsed;
     ServerConfig *server_conf;
+    LocationConfig *location;
+    size_t max_body_size;
     std::vector<std::string> allowed_methods;
     HttpRequest();
     ~HttpRequest();
@@ -80,6 +112,10 @@ class HttpRequest {
     size_t max;
 
     bool body_created;
+    // when set, body bytes go there instead of the tmp file
+    std::string *body_sink;
+    // when set, body bytes are parsed into upload_store as they arrive
+    MultipartParser *multipart;
 
     int parse_raw(std::string &raw_data);
     int parse_first_line(std::string line); // method + path
@@ -93,6 +129,7 @@ class HttpRequest {
     FILE *get_body_fd(std::string perm);
     ssize_t get_content_len();
     HttpHeader *get_header_by_key(std::string key);
+    const std::vector<HttpHeader> &get_headers() const;
 
 
     bool read_body_loop(std::string &raw_data);
@@ -100,12 +137,14 @@ class HttpRequest {
     bool use_transfer_encoding();
     bool handle_transfer_encoded_body(std::string &raw_data);
     size_t push_to_body(std::string &raw_data, size_t max);
+    void body_spliced(size_t bytes);
 
     bool request_is_ready();
 
     std::fstream& get_body_tmpfile();
 
     void setup_serverconf(std::vector<ServerConfig> &servers_conf, std::string port);
+    void setup_body_limit();
     size_t get_body_len();
 };
 
@@ -121,14 +160,35 @@ class Client {
     std::string port;
     std::string addr;
     //ServerConfig *server_conf;
-    std::string response;
-    size_t write_offset;
-    bool chunk;
+    // response bytes waiting to be sent, flushed with one sendmsg
+    std::deque<OutSegment> out;
     int response_fd;
-    std::string current_chunk;
-    size_t chunk_offset;
-    bool final_chunk_sent;
+    off_t file_offset;
+    off_t file_end;
+    bool use_sendfile;
+    bool corked;
+    bool nodelay;
+    GzipStream *gzip;
+    bool chunked;        // the body of unknown length is sent in chunks
+    DirListing *listing; // autoindex being streamed
+    FastCGIRequest *fastcgi; // waiting on a FastCGI application
+    CgiCacheFill *cache_fill; // script response to keep in cgi_cache
+    CgiCacheFlight *cache_flight; // waiting on an identical request
+    bool cache_unlocked; // runs its script, the wait on another failed
+    std::vector<RangePart> ranges;
+    size_t range_index;
     std::time_t last_time;
+    bool keep_alive;           // decided by the Connection header sent
+    size_t requests;           // answered on this connection
+    time_t keepalive_timeout;  // idle limit once a response is sent
+    size_t bytes_sent;         // total written to the socket
+    bool blocked;              // the last send hit a full socket buffer
+    size_t send_limit;         // most the next send may write
+    size_t limit_rate;         // of the location answering, 0 for none
+    size_t limit_rate_after;
+    size_t rate_start_bytes;   // bytes_sent when the response started
+    long rate_start;           // ms, when the response started
+    long throttled_until;      // ms, 0 unless waiting on limit_rate
     bool connected;
     bool error_code;
     bool free_client;
@@ -152,13 +212,14 @@ class Client {
     }
 
     bool parse_loop(int a);
-    std::string get_response(){
-      return this->response;
-    }
-
-    void fill_response(std::string response){
-      this->response = response;
-    }
+    void queue(const std::string &data);
+    void queue_swap(std::string &data);
+    void queue_shared(SharedBuffer *buffer);
+    void clear_output();
+    void compact();
+    bool is_idle();
+    size_t memory_usage();
+    size_t pending_bytes();
 
     void clear_request(){
       delete this->request;
@@ -170,11 +231,15 @@ class Client {
     this->cgi.pipe_fd = -1;
     this->cgi.body_fd = -1;
     this->cgi.pid = -1;
-    this->cgi.data_received = false;
-    this->cgi.output_fd = -1;
-    this->cgi.body_fd = -1;
+    std::string().swap(this->cgi.input);
+    this->cgi.input_blocked = false;
+    this->cgi.input_paused = false;
+    this->cgi.splice_full = false;
+    this->cgi.header.clear();
+    this->cgi.streaming = false;
+    this->cgi.chunked = false;
+    this->cgi.paused = false;
     this->cgi.start = -1;
-    this->cgi.output_file.clear();
   }
 };
 
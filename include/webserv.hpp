@@ -13,39 +13,106 @@
 #define MAX_EVENTS 100
 #define CLIENT_TIMEOUT 100
 #define CGI_TIMEOUT 5
+// script output queued for a slow client before its pipe is no longer read
+#define CGI_OUTPUT_BUFFERED (64 * 1024)
+// request body received ahead of the script before the socket isn't read
+#define CGI_INPUT_BUFFERED (64 * 1024)
+#define MAX_RANGES 16
+// what a streamed body of unknown length counts as when writes are ordered
+#define STREAMED_BODY_SIZE (1024 * 1024)
+// enough digits for any unsigned long in base 2 or more
+#define NUMBER_BUFFER_SIZE 64
+// initial capacity of a response header block
+#define HEADER_RESERVE 512
 
 
 extern std::map<int, Client *> cgi_to_client;
 
+// CGI meta-variables in the order they are set
+typedef std::vector<std::pair<std::string, std::string> > CgiParams;
+
 int start_server(std::vector<ServerConfig> &servers_conf);
 int executeCGI(int epoll_fd, const ServerConfig &server_conf, const std::string &script_path,
                const LocationConfig *location, Client *client);
 LocationConfig *get_location(std::vector<LocationConfig> &locations,
                              const std::string &path);
-int handle_cgi(int epoll_fd, Client *client, uint32_t actions);
+int handle_cgi(int epoll_fd, Client *client, int fd, uint32_t actions);
+bool write_cgi_input(int epoll_fd, Client *client);
+bool can_splice_cgi_input(Client *client);
+void splice_cgi_input(int epoll_fd, Client *client);
 void wait_for_child();
 void cgi_cleanup(int epoll_fd, Client *client);
+void stop_cgi(int epoll_fd, Client *client);
+void resume_cgi(int epoll_fd, Client *client);
+bool receiving_script_body(Client *client);
+size_t sendable_output(Client *client);
+void watch_script_client(int epoll_fd, Client *client);
+void cut_cgi_response(Client *client);
+CgiParams cgi_params(Client *client, const ServerConfig &server_conf,
+                     const LocationConfig *location,
+                     const std::string &script_name,
+                     const std::string &path_info);
+int cgi_output_response(Client *client, std::string &cgi_content);
 
 // response
 void process_request(int epoll_fd, Client &client);
+bool answer_from_head(Client &client);
+void start_script_early(int epoll_fd, Client &client);
+void start_upload_early(Client &client);
+int serve_internal_redirect(Client &client, const std::string &cgi_headers);
 void send_special_response(Client &client, int status_code,
                            std::string info = "");
 std::string special_response(int status_code);
+const std::vector<int> &special_response_codes();
 bool handle_write(Client &client);
+void reset_body(Client &client);
+std::string get_header_value(HttpRequest *request, const std::string &key);
+std::string get_connection_header(Client &client);
+bool frame_unknown_length(Client &client, std::string &headers);
+std::string get_connections_status();
+bool use_gzip(HttpRequest *request, const std::string &content_type,
+              size_t length, std::string &headers);
+
+// http tables
+const std::string &get_status_line(int status_code);
+const char *get_status_code_phrase(int code);
+const char *find_mime_type(const std::string &filepath);
 
 // response utils
-const std::string &get_status_code_phrase(int code);
 std::string get_file_path(const std::string &root,
                           const std::vector<std::string> &index,
                           const std::string &path);
-std::string get_date_header();
-std::string get_server_header();
-std::string get_content_type(std::string file);
-std::string get_content_length(int size);
+std::string format_http_date(time_t t);
+const std::string &get_date_header();
+const std::string &get_server_header();
+char *format_number(char *end, unsigned long value, unsigned base = 10,
+                    bool upper = false);
+void append_number(std::string &out, unsigned long value, unsigned base = 10,
+                   bool upper = false);
+void append_header(std::string &out, const char *name,
+                   const std::string &value);
+void append_header(std::string &out, const char *name, unsigned long value);
+std::string get_mime_type(const std::string &filepath);
+std::string get_content_type(const std::string &file);
+void append_content_type(std::string &out, const std::string &file);
+std::string get_content_length(size_t size);
 std::string get_transfer_encoding(const std::string &encoding);
+std::string get_content_range(off_t start, off_t end, off_t size);
+std::string make_etag(ino_t ino, off_t size, time_t mtime, bool weak);
+std::string get_validator_headers(const std::string &etag, time_t mtime);
+std::string get_cache_headers(const LocationConfig *location);
+bool etag_matches(const std::string &list, const std::string &etag);
+bool parse_http_date(const std::string &str, time_t &t);
+int parse_range_header(const std::string &value, off_t size,
+                       std::vector<std::pair<off_t, off_t> > &ranges);
 std::string generate_status_line(int status_code);
+void append_status_line(std::string &out, int status_code);
 std::string get_allow_header(std::string allowed_methods);
 std::string get_location_header(std::string location);
+std::string get_content_encoding(const std::string &encoding);
+std::string get_vary_header(const std::string &value);
+bool accepts_encoding(const std::string &accept_encoding,
+                      const std::string &coding);
 std::string int_to_hex(int value);
 std::string join_paths(const std::string &path1, const std::string &path2);
 std::string random_string();
@@ -66,6 +133,7 @@ bool is_dir(const std::string &path);
 std::string join_vec(const std::vector<std::string> &vec);
 std::string decode_url(const std::string &encoded);
 void discard_socket_buffer(int client_fd);
+long monotonic_ms();
 template <typename T>
 int find_in_vec(const std::vector<T> &vec, const T &target) {
   typename std::vector<T>::const_iterator it =
@@ -0,0 +1,537 @@
+#include "../include/CgiCache.hpp"
+#include "../include/gzip.hpp"
+#include "../include/webserv.hpp"
+
+// larger bodies go to the disk tier, or aren't kept without one
+#define CGI_CACHE_MEMORY_ENTRY (256 * 1024) // 256KB
+
+CgiCache cgi_cache;
+
+CgiCacheFill::CgiCacheFill()
+    : cacheable(false), valid(0), leader(false), ttl(0), shared(false),
+      fd(-1), size(0) {}
+
+CgiCacheFill::~CgiCacheFill() {
+  if (fd != -1)
+    close(fd);
+}
+
+CgiCache::CgiCache()
+    : memory_used(0), memory_budget(0), disk_used(0), disk_budget(0),
+      last_expire(0), hits(0), misses(0), bypasses(0), stores(0),
+      evictions(0), collapsed(0), lock_timeouts(0) {}
+
+CgiCache::~CgiCache() {
+  while (!entries.empty())
+    erase(entries.begin());
+  for (std::map<std::string, CgiCacheFlight *>::iterator it = flights.begin();
+       it != flights.end(); ++it)
+    delete it->second;
+}
+
+// the cache is shared by all servers, it gets the largest budgets among
+// the servers having a location that enables it, and the first disk path
+void CgiCache::configure(std::vector<ServerConfig> &servers_conf) {
+  memory_budget = 0;
+  disk_budget = 0;
+  disk_path.clear();
+  for (size_t i = 0; i < servers_conf.size(); ++i) {
+    std::vector<LocationConfig> &locations = servers_conf[i].getLocations();
+    for (size_t j = 0; j < locations.size(); ++j) {
+      if (!locations[j].cgi_cache)
+        continue;
+      memory_budget =
+          std::max(memory_budget, servers_conf[i].getCgiCacheSize());
+      if (servers_conf[i].getCgiCachePath().empty())
+        continue;
+      if (disk_path.empty())
+        disk_path = servers_conf[i].getCgiCachePath();
+      disk_budget =
+          std::max(disk_budget, servers_conf[i].getCgiCacheDiskSize());
+    }
+  }
+}
+
+// moves the response of a complete fill into entry, its bytes count
+// against the budget of their tier until release_entry
+void CgiCache::take_fill(CgiCacheFill *fill, Entry &entry) {
+  entry.status = fill->status;
+  entry.headers = fill->headers;
+  entry.body = NULL;
+  entry.gzipped = NULL;
+  entry.fd = fill->fd;
+  entry.size = fill->size;
+  entry.expires = 0;
+  if (entry.fd != -1) {
+    fill->fd = -1;
+    disk_used += entry.size;
+  } else {
+    entry.body = new_shared_buffer("");
+    entry.body->data.swap(fill->body);
+    memory_used += entry.size;
+  }
+}
+
+void CgiCache::release_entry(Entry &entry) {
+  if (entry.fd != -1) {
+    close(entry.fd);
+    disk_used -= entry.size;
+  } else {
+    memory_used -= entry.size;
+  }
+  if (entry.gzipped)
+    memory_used -= entry.gzipped->data.size();
+  release_buffer(entry.body);
+  release_buffer(entry.gzipped);
+}
+
+void CgiCache::erase(std::map<std::string, Entry>::iterator it) {
+  release_entry(it->second);
+  lru.erase(it->second.lru);
+  entries.erase(it);
+}
+
+// evicts the least recently used entries of a tier until size fits in it
+bool CgiCache::make_room(size_t size, bool on_disk) {
+  size_t &used = on_disk ? disk_used : memory_used;
+  size_t budget = on_disk ? disk_budget : memory_budget;
+
+  if (size > budget)
+    return false;
+  std::list<std::string>::iterator it = lru.end();
+  while (used + size > budget && it != lru.begin()) {
+    --it;
+    std::map<std::string, Entry>::iterator entry = entries.find(*it);
+    if ((entry->second.fd != -1) != on_disk)
+      continue;
+    std::list<std::string>::iterator next = it;
+    ++next;
+    erase(entry);
+    evictions++;
+    it = next;
+  }
+  return used + size <= budget;
+}
+
+// expands $request_method, $host, $uri, $args (the query with its ?),
+// $server_port and $http_<name> in the location's cgi_cache_key
+static std::string make_key(Client &client, const std::string &pattern) {
+  HttpRequest *request = client.get_request();
+  std::string key;
+
+  for (size_t i = 0; i < pattern.size();) {
+    if (pattern[i] != '$') {
+      key += pattern[i++];
+      continue;
+    }
+    size_t end = ++i;
+    while (end < pattern.size() &&
+           (std::isalnum(static_cast<unsigned char>(pattern[end])) ||
+            pattern[end] == '_'))
+      end++;
+    std::string name = pattern.substr(i, end - i);
+    i = end;
+    if (name == "request_method")
+      key += method_to_string(request->get_method());
+    else if (name == "host")
+      key += to_lower(get_header_value(request, "host"));
+    else if (name == "uri")
+      key += request->get_path().get_path();
+    else if (name == "args")
+      key += request->get_path().get_coded_queries();
+    else if (name == "server_port")
+      key += client.port;
+    else if (name.compare(0, 5, "http_") == 0) {
+      std::string header = to_lower(name.substr(5));
+      std::replace(header.begin(), header.end(), '_', '-');
+      key += get_header_value(request, header);
+    }
+  }
+  return key;
+}
+
+// whether the request carries credentials its response may depend on,
+// Cookie or Authorization, without the key telling them apart with
+// $http_cookie or $http_authorization
+static bool has_credentials(HttpRequest *request, const std::string &pattern) {
+  static const char *names[] = {"authorization", "cookie"};
+
+  for (size_t i = 0; i < sizeof(names) / sizeof(*names); ++i) {
+    if (get_header_value(request, names[i]).empty())
+      continue;
+    std::string var = std::string("$http_") + names[i];
+    size_t pos = pattern.find(var);
+    while (pos != std::string::npos) {
+      size_t end = pos + var.size();
+      if (end == pattern.size() ||
+          (!std::isalnum(static_cast<unsigned char>(pattern[end])) &&
+           pattern[end] != '_'))
+        break;
+      pos = pattern.find(var, end);
+    }
+    if (pos == std::string::npos)
+      return true;
+  }
+  return false;
+}
+
+// answers the request from the cache when the location enables it and a
+// fresh entry exists, or with cgi_cache_lock makes it wait on the same
+// request already running. otherwise the client gets a fill, for the
+// script's response to be stored or shared once complete
+bool CgiCache::lookup(Client &client, const LocationConfig *location) {
+  bool unlocked = client.cache_unlocked;
+
+  drop(client);
+  client.cache_unlocked = false;
+  if (!location->cgi_cache && !location->cgi_cache_lock)
+    return false;
+  HttpRequest *request = client.get_request();
+  // only plain GETs are shared, not those carrying a body or credentials
+  if (request->get_method() != GET || !request->request_is_ready() ||
+      request->get_body_len() > 0 ||
+      has_credentials(request, location->cgi_cache_key)) {
+    bypasses++;
+    return false;
+  }
+
+  std::string key = make_key(client, location->cgi_cache_key);
+  std::string cache_control =
+      to_lower(get_header_value(request, "cache-control"));
+  bool reload =
+      cache_control.find("no-cache") != std::string::npos ||
+      to_lower(get_header_value(request, "pragma")).find("no-cache") !=
+          std::string::npos;
+  // a reload asks for a fresh response, which then replaces the entry
+  if (location->cgi_cache && reload) {
+    bypasses++;
+  } else if (location->cgi_cache) {
+    std::map<std::string, Entry>::iterator it = entries.find(key);
+    if (it != entries.end() && it->second.expires > std::time(NULL) &&
+        serve(client, it->second)) {
+      hits++;
+      lru.splice(lru.begin(), lru, it->second.lru);
+      return true;
+    }
+    if (it != entries.end())
+      erase(it);
+    misses++;
+  }
+
+  bool leader = false;
+  if (location->cgi_cache_lock && !unlocked) {
+    if (join_flight(client, key))
+      return true;
+    leader = start_flight(key, location->cgi_cache_lock_timeout);
+  }
+  if (!location->cgi_cache && !leader)
+    return false;
+  client.cache_fill = new CgiCacheFill();
+  client.cache_fill->key = key;
+  client.cache_fill->cacheable = location->cgi_cache;
+  client.cache_fill->valid = location->cgi_cache_valid;
+  client.cache_fill->leader = leader;
+  return false;
+}
+
+// makes the client wait on the script already running for key, unless
+// that one is older than its cgi_cache_lock_timeout
+bool CgiCache::join_flight(Client &client, const std::string &key) {
+  std::map<std::string, CgiCacheFlight *>::iterator it = flights.find(key);
+  if (it == flights.end())
+    return false;
+  CgiCacheFlight *flight = it->second;
+  if (std::time(NULL) - flight->start >= flight->timeout)
+    return false;
+  flight->waiters.push_back(&client);
+  client.cache_flight = flight;
+  return true;
+}
+
+// whether the request becomes the one the next identical ones wait on
+bool CgiCache::start_flight(const std::string &key, time_t timeout) {
+  if (flights.count(key))
+    return false;
+  CgiCacheFlight *flight = new CgiCacheFlight();
+  flight->key = key;
+  flight->start = std::time(NULL);
+  flight->timeout = timeout;
+  flights[key] = flight;
+  return true;
+}
+
+// hands a copy of the leader's response to the requests waiting on it.
+// without one, each of them runs the script itself
+void CgiCache::end_flight(const std::string &key, Entry *entry) {
+  std::map<std::string, CgiCacheFlight *>::iterator it = flights.find(key);
+  if (it == flights.end())
+    return;
+  CgiCacheFlight *flight = it->second;
+  flights.erase(it);
+  for (size_t i = 0; i < flight->waiters.size(); ++i) {
+    Client *waiter = flight->waiters[i];
+    waiter->cache_flight = NULL;
+    if (entry && serve(*waiter, *entry)) {
+      collapsed++;
+      finished.push_back(waiter->get_socket());
+    } else {
+      waiter->cache_unlocked = true;
+      retries.push_back(waiter->get_socket());
+    }
+  }
+  delete flight;
+}
+
+// queues the entry's response. false when its disk tier file can't be
+// used, the entry is dropped then
+bool CgiCache::serve(Client &client, Entry &entry) {
+  HttpRequest *request = client.get_request();
+  std::string head;
+  int fd = -1;
+
+  if (entry.fd != -1 && (fd = dup(entry.fd)) == -1) {
+    LOG_STREAM(ERROR, "cgi_cache: dup failed: " << strerror(errno));
+    return false;
+  }
+  reset_body(client);
+  head.reserve(HEADER_RESERVE + entry.headers.size());
+  head += "HTTP/1.1 " + entry.status + CRLF;
+  head += get_server_header();
+  head += get_date_header();
+  head += get_connection_header(client);
+  head += entry.headers;
+
+  if (entry.fd != -1) {
+    // served from the file as it is, without compression
+    append_header(head, "Content-Length", entry.size);
+    head += CRLF;
+    client.queue_swap(head);
+    client.response_fd = fd;
+    client.file_offset = 0;
+    client.file_end = entry.size;
+    client.use_sendfile = !request->location || request->location->sendfile;
+    return true;
+  }
+
+  SharedBuffer *body = entry.body;
+  std::string content_type;
+  size_t type_pos = to_lower(entry.headers).find("content-type:");
+  if (type_pos != std::string::npos)
+    content_type = entry.headers.substr(
+        type_pos + 13, entry.headers.find('\r', type_pos) - type_pos - 13);
+  if (use_gzip(request, content_type, entry.size, head)) {
+    if (!entry.gzipped) {
+      entry.gzipped = new_shared_buffer(gzip_string(
+          body->data, request->location->gzip.comp_level));
+      memory_used += entry.gzipped->data.size();
+    }
+    body = entry.gzipped;
+    head += get_content_encoding("gzip");
+  }
+  append_header(head, "Content-Length", body->data.size());
+  head += CRLF;
+  client.queue_swap(head);
+  if (!body->data.empty())
+    client.queue_shared(retain_buffer(body));
+  return true;
+}
+
+// decides from the script's header block whether its response is kept:
+// a 200 without Set-Cookie, for the Cache-Control max-age or s-maxage,
+// never with no-store, no-cache or private, or else for cgi_cache_valid.
+// waiting requests get any response but those with Set-Cookie or private
+void CgiCache::check_headers(Client &client, const std::string &cgi_headers) {
+  CgiCacheFill *fill = client.cache_fill;
+  if (!fill)
+    return;
+  std::istringstream lines(cgi_headers);
+  std::string line;
+  long ttl = fill->valid;
+  long max_age = -1;
+  long s_maxage = -1;
+  bool personal = false;
+
+  fill->status = "200 OK";
+  while (std::getline(lines, line)) {
+    std::string::size_type colon = line.find(':');
+    if (colon == std::string::npos)
+      continue;
+    std::string key = to_lower(line.substr(0, colon));
+    std::string value = strip(line.substr(colon + 1));
+    if (key == "status") {
+      fill->status = value;
+      continue;
+    }
+    if (key == "content-length" || key == "transfer-encoding" ||
+        key == "connection")
+      continue;
+    if (key == "set-cookie")
+      personal = true;
+    if (key == "cache-control") {
+      std::vector<std::string> directives = split(to_lower(value), ',');
+      for (size_t i = 0; i < directives.size(); ++i) {
+        std::string directive = strip(directives[i]);
+        if (directive == "private")
+          personal = true;
+        else if (directive == "no-store" || directive == "no-cache")
+          ttl = 0;
+        else if (directive.compare(0, 8, "max-age=") == 0)
+          safeAtoi(directive.substr(8), max_age);
+        else if (directive.compare(0, 9, "s-maxage=") == 0)
+          safeAtoi(directive.substr(9), s_maxage);
+      }
+    }
+    fill->headers += strip(line) + CRLF;
+  }
+  if (ttl && s_maxage >= 0)
+    ttl = s_maxage;
+  else if (ttl && max_age >= 0)
+    ttl = max_age;
+  if (ttl > 0 && fill->cacheable && !personal &&
+      fill->status.compare(0, 3, "200") == 0)
+    fill->ttl = ttl;
+  fill->shared = fill->leader && !personal;
+  if (!fill->ttl && !fill->shared)
+    drop(client);
+}
+
+// keeps a part of the script's body, in memory then in a disk tier file
+void CgiCache::append(Client &client, const char *data, size_t len) {
+  CgiCacheFill *fill = client.cache_fill;
+  if (!fill || !len)
+    return;
+  fill->size += len;
+  if (fill->fd == -1 && fill->size <= CGI_CACHE_MEMORY_ENTRY) {
+    fill->body.append(data, len);
+    return;
+  }
+  if (disk_path.empty() || fill->size > disk_budget) {
+    drop(client);
+    return;
+  }
+  if (fill->fd == -1) {
+    std::string name = disk_path + "/cgi-XXXXXX";
+    fill->fd = mkstemp(&name[0]);
+    if (fill->fd == -1) {
+      LOG_STREAM(ERROR, "cgi_cache: " << name << ": " << strerror(errno));
+      drop(client);
+      return;
+    }
+    // the open descriptor keeps the file, nothing is left behind on exit
+    unlink(name.c_str());
+    fill->body.append(data, len);
+    data = fill->body.data();
+    len = fill->body.size();
+  }
+  while (len > 0) {
+    ssize_t written = write(fill->fd, data, len);
+    if (written < 0) {
+      LOG_STREAM(ERROR, "cgi_cache: write failed: " << strerror(errno));
+      drop(client);
+      return;
+    }
+    data += written;
+    len -= written;
+  }
+  std::string().swap(fill->body);
+}
+
+// stores the complete response of the client's fill, and copies it to
+// the requests waiting on it
+void CgiCache::store(Client &client) {
+  CgiCacheFill *fill = client.cache_fill;
+  if (!fill)
+    return;
+  Entry *entry = NULL;
+  if (fill->ttl) {
+    std::map<std::string, Entry>::iterator it = entries.find(fill->key);
+    if (it != entries.end())
+      erase(it);
+    if (make_room(fill->size, fill->fd != -1)) {
+      entry = &entries[fill->key];
+      take_fill(fill, *entry);
+      entry->expires = std::time(NULL) + fill->ttl;
+      entry->lru = lru.insert(lru.begin(), fill->key);
+      stores++;
+    }
+  }
+  if (fill->shared) {
+    Entry copy;
+    if (!entry) {
+      take_fill(fill, copy);
+      entry = &copy;
+    }
+    fill->leader = false;
+    end_flight(fill->key, entry);
+    if (entry == &copy)
+      release_entry(copy);
+  }
+  drop(client);
+}
+
+// forgets the client's fill. requests waiting on it run their own script
+void CgiCache::drop(Client &client) {
+  CgiCacheFill *fill = client.cache_fill;
+  if (!fill)
+    return;
+  if (fill->leader)
+    end_flight(fill->key, NULL);
+  delete fill;
+  client.cache_fill = NULL;
+}
+
+// a waiting client is gone
+void CgiCache::leave(Client &client) {
+  CgiCacheFlight *flight = client.cache_flight;
+  if (!flight)
+    return;
+  std::vector<Client *> &waiters = flight->waiters;
+  waiters.erase(std::remove(waiters.begin(), waiters.end(), &client),
+                waiters.end());
+  client.cache_flight = NULL;
+}
+
+// requests that waited longer than cgi_cache_lock_timeout run their own
+// script, once a second at most
+void CgiCache::expire() {
+  time_t now = std::time(NULL);
+  if (now == last_expire)
+    return;
+  last_expire = now;
+
+  for (std::map<std::string, CgiCacheFlight *>::iterator it = flights.begin();
+       it != flights.end(); ++it) {
+    CgiCacheFlight *flight = it->second;
+    if (flight->waiters.empty() || now - flight->start < flight->timeout)
+      continue;
+    for (size_t i = 0; i < flight->waiters.size(); ++i) {
+      flight->waiters[i]->cache_flight = NULL;
+      flight->waiters[i]->cache_unlocked = true;
+      retries.push_back(flight->waiters[i]->get_socket());
+      lock_timeouts++;
+    }
+    flight->waiters.clear();
+  }
+}
+
+void CgiCache::take_finished(std::vector<int> &fds) {
+  fds.insert(fds.end(), finished.begin(), finished.end());
+  finished.clear();
+}
+
+void CgiCache::take_retries(std::vector<int> &fds) {
+  fds.insert(fds.end(), retries.begin(), retries.end());
+  retries.clear();
+}
+
+std::string CgiCache::status() const {
+  return "cgi_cache: entries " + long_to_string(entries.size()) +
+         " memory " + long_to_string(memory_used) + "/" +
+         long_to_string(memory_budget) + " disk " + long_to_string(disk_used) +
+         "/" + long_to_string(disk_budget) + " hits " + long_to_string(hits) +
+         " misses " + long_to_string(misses) + " bypasses " +
+         long_to_string(bypasses) + " stores " + long_to_string(stores) +
+         " evictions " + long_to_string(evictions) + " collapsed " +
+         long_to_string(collapsed) + " lock_timeouts " +
+         long_to_string(lock_timeouts) + "\n";
+}
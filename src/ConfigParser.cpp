@@ -78,6 +78,86 @@ std::vector<std::string> split_with_quotes(const std::string &s) {
   return tokens;
 }
 
+// accepts a number of seconds with an optional s/m/h suffix
+bool parseTime(const std::string &str, long &seconds) {
+  std::string num = str;
+  long multiplier = 1;
+  if (!num.empty()) {
+    char last_char = num[num.length() - 1];
+    if (last_char == 's')
+      num.erase(num.length() - 1);
+    else if (last_char == 'm') {
+      multiplier = 60;
+      num.erase(num.length() - 1);
+    } else if (last_char == 'h') {
+      multiplier = 3600;
+      num.erase(num.length() - 1);
+    }
+  }
+  if (!safeAtoi(num, seconds) || seconds < 0 || seconds > 2147483647L / multiplier)
+    return false;
+  seconds *= multiplier;
+  return true;
+}
+
+size_t parse_body_size(const std::vector<std::string> &tokens) {
+  if (tokens.size() != 2)
+    throw std::runtime_error("Invalid " + tokens[0] + " directive");
+  std::string size_str = tokens[1];
+  if (size_str.length() > MAX_STRING_LENGTH) {
+    throw std::runtime_error(tokens[0] + " value too long");
+  }
+  size_t multiplier = 1;
+  if (!size_str.empty()) {
+    char last_char = size_str[size_str.length() - 1];
+    if (last_char == 'm' || last_char == 'M') {
+      multiplier = 1024 * 1024;
+      size_str = size_str.substr(0, size_str.length() - 1);
+    } else if (last_char == 'k' || last_char == 'K') {
+      multiplier = 1024;
+      size_str = size_str.substr(0, size_str.length() - 1);
+    }
+  }
+  long size;
+  if (!safeAtoi(size_str, size) || size < 0 || size > static_cast<long>(MAX_BODY_SIZE / multiplier)) {
+    throw std::runtime_error("Invalid " + tokens[0] + " value: " + tokens[1]);
+  }
+  return static_cast<size_t>(size) * multiplier;
+}
+
+bool isGzipDirective(const std::string &directive) {
+  return directive == "gzip" || directive == "gzip_comp_level" ||
+         directive == "gzip_min_length" || directive == "gzip_types";
+}
+
+void parseGzipDirective(GzipConfig &gzip,
+                        const std::vector<std::string> &tokens) {
+  const std::string &directive = tokens[0];
+  if (directive == "gzip") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid gzip directive");
+    }
+    gzip.enabled = (tokens[1] == "on");
+  } else if (directive == "gzip_comp_level") {
+    long level;
+    if (tokens.size() != 2 || !safeAtoi(tokens[1], level) || level < 1 ||
+        level > 9)
+      throw std::runtime_error("Invalid gzip_comp_level directive");
+    gzip.comp_level = level;
+  } else if (directive == "gzip_min_length") {
+    gzip.min_length = parse_body_size(tokens);
+  } else {
+    if (tokens.size() < 2 || tokens.size() > MAX_VECTOR_SIZE)
+      throw std::runtime_error("Invalid gzip_types directive");
+    gzip.types.clear();
+    for (size_t i = 1; i < tokens.size(); ++i) {
+      if (tokens[i].length() > MAX_STRING_LENGTH)
+        throw std::runtime_error("gzip_types value too long");
+      gzip.types.push_back(toLower(tokens[i]));
+    }
+  }
+}
+
 void parse_server_directive(ServerConfig &server,
                            const std::vector<std::string> &tokens) {
   if (tokens.empty()) {
@@ -181,33 +261,102 @@ void parse_server_directive(ServerConfig &server,
     }
     server.setErrorPages(pages);
   } else if (directive == "client_max_body_size") {
-    if (tokens.size() != 2)
-      throw std::runtime_error("Invalid client_max_body_size directive");
-    std::string size_str = tokens[1];
-    if (size_str.length() > MAX_STRING_LENGTH) {
-      throw std::runtime_error("Client max body size value too long");
-    }
-    size_t multiplier = 1;
-    if (!size_str.empty()) {
-      char last_char = size_str[size_str.length() - 1];
-      if (last_char == 'm' || last_char == 'M') {
-        multiplier = 1024 * 1024;
-        size_str = size_str.substr(0, size_str.length() - 1);
-      } else if (last_char == 'k' || last_char == 'K') {
-        multiplier = 1024;
-        size_str = size_str.substr(0, size_str.length() - 1);
-      }
-    }
-    long size;
-    if (!safeAtoi(size_str, size) || size < 0 || size > static_cast<long>(MAX_BODY_SIZE / multiplier)) {
-      throw std::runtime_error("Invalid client_max_body_size value: " + tokens[1]);
-    }
-    server.setClientMaxBodySize(static_cast<size_t>(size) * multiplier);
+    server.setClientMaxBodySize(parse_body_size(tokens));
   } else if (directive == "autoindex") {
     if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
       throw std::runtime_error("Invalid autoindex directive");
     }
     server.setAutoindex(tokens[1] == "on");
+  } else if (directive == "sendfile") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid sendfile directive");
+    }
+    server.setSendfile(tokens[1] == "on");
+  } else if (directive == "tcp_nopush") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid tcp_nopush directive");
+    }
+    server.setTcpNopush(tokens[1] == "on");
+  } else if (directive == "tcp_nodelay") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid tcp_nodelay directive");
+    }
+    server.setTcpNodelay(tokens[1] == "on");
+  } else if (directive == "open_file_cache") {
+    if (tokens.size() == 2 && tokens[1] == "off") {
+      server.setOpenFileCache(0, 0);
+      return;
+    }
+    if (tokens.size() < 2 || tokens.size() > 3)
+      throw std::runtime_error("Invalid open_file_cache directive");
+    long max = 0;
+    long inactive = server.getOpenFileCacheInactive();
+    for (size_t i = 1; i < tokens.size(); ++i) {
+      if (tokens[i].compare(0, 4, "max=") == 0) {
+        if (!safeAtoi(tokens[i].substr(4), max) || max <= 0)
+          throw std::runtime_error("Invalid open_file_cache max: " + tokens[i]);
+      } else if (tokens[i].compare(0, 9, "inactive=") == 0) {
+        if (!parseTime(tokens[i].substr(9), inactive))
+          throw std::runtime_error("Invalid open_file_cache inactive: " +
+                                   tokens[i]);
+      } else
+        throw std::runtime_error("Invalid open_file_cache parameter: " +
+                                 tokens[i]);
+    }
+    if (max == 0)
+      throw std::runtime_error("open_file_cache requires max=N");
+    server.setOpenFileCache(max, inactive);
+  } else if (directive == "open_file_cache_errors") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid open_file_cache_errors directive");
+    }
+    server.setOpenFileCacheErrors(tokens[1] == "on");
+  } else if (directive == "content_cache") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid content_cache directive");
+    }
+    server.setContentCache(tokens[1] == "on");
+  } else if (directive == "content_cache_size") {
+    server.setContentCacheSize(parse_body_size(tokens));
+  } else if (directive == "content_cache_max_file") {
+    server.setContentCacheMaxFile(parse_body_size(tokens));
+  } else if (directive == "cgi_cache_size") {
+    server.setCgiCacheSize(parse_body_size(tokens));
+  } else if (directive == "cgi_cache_path") {
+    if (tokens.size() < 2 || tokens.size() > 3)
+      throw std::runtime_error("Invalid cgi_cache_path directive");
+    size_t size = DEFAULT_CGI_CACHE_DISK_SIZE;
+    if (tokens.size() == 3) {
+      if (tokens[2].compare(0, 9, "max_size=") != 0)
+        throw std::runtime_error("Invalid cgi_cache_path parameter: " +
+                                 tokens[2]);
+      std::vector<std::string> size_tokens;
+      size_tokens.push_back("cgi_cache_path");
+      size_tokens.push_back(tokens[2].substr(9));
+      size = parse_body_size(size_tokens);
+    }
+    struct stat st;
+    if (stat(tokens[1].c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+      throw std::runtime_error("cgi_cache_path is not a directory: " +
+                               tokens[1]);
+    server.setCgiCachePath(tokens[1], size);
+  } else if (directive == "keepalive_timeout") {
+    long timeout;
+    if (tokens.size() != 2 || !parseTime(tokens[1], timeout))
+      throw std::runtime_error("Invalid keepalive_timeout directive");
+    server.setKeepaliveTimeout(timeout);
+  } else if (directive == "keepalive_requests") {
+    long requests;
+    if (tokens.size() != 2 || !safeAtoi(tokens[1], requests) || requests <= 0)
+      throw std::runtime_error("Invalid keepalive_requests directive");
+    server.setKeepaliveRequests(requests);
+  } else if (directive == "write_quantum") {
+    size_t quantum = parse_body_size(tokens);
+    if (quantum == 0)
+      throw std::runtime_error("Invalid write_quantum value: " + tokens[1]);
+    server.setWriteQuantum(quantum);
+  } else if (isGzipDirective(directive)) {
+    parseGzipDirective(server.getGzip(), tokens);
   } else {
     throw std::runtime_error("Unknown server directive: " + directive);
   }
@@ -348,6 +497,119 @@ void parse_location_directive(LocationConfig &location,
       throw std::runtime_error("CGI binary path cannot be empty");
     }
     location.cgi_ext[tokens[1]] = tokens[2];
+  } else if (directive == "fastcgi_pass") {
+    if (tokens.size() != 2 || tokens[1].length() > MAX_STRING_LENGTH)
+      throw std::runtime_error("Invalid fastcgi_pass directive");
+    const std::string &address = tokens[1];
+    std::string::size_type colon = address.rfind(':');
+    long port;
+    if (address.compare(0, 5, "unix:") == 0) {
+      if (address.size() == 5)
+        throw std::runtime_error("Invalid fastcgi_pass address: " + address);
+    } else if (colon == std::string::npos || colon == 0 ||
+               !safeAtoi(address.substr(colon + 1), port) || port < 1 ||
+               port > 65535) {
+      throw std::runtime_error("Invalid fastcgi_pass address: " + address);
+    }
+    location.fastcgi_pass = address;
+  } else if (directive == "client_max_body_size") {
+    location.client_max_body_size = parse_body_size(tokens);
+  } else if (directive == "sendfile") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid sendfile directive");
+    }
+    location.sendfile = (tokens[1] == "on");
+  } else if (directive == "tcp_nopush") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid tcp_nopush directive");
+    }
+    location.tcp_nopush = (tokens[1] == "on");
+  } else if (directive == "tcp_nodelay") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid tcp_nodelay directive");
+    }
+    location.tcp_nodelay = (tokens[1] == "on");
+  } else if (directive == "content_cache") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid content_cache directive");
+    }
+    location.content_cache = (tokens[1] == "on");
+  } else if (directive == "cgi_cache") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid cgi_cache directive");
+    }
+    location.cgi_cache = (tokens[1] == "on");
+  } else if (directive == "cgi_cache_key") {
+    if (tokens.size() != 2)
+      throw std::runtime_error("Invalid cgi_cache_key directive");
+    location.cgi_cache_key = tokens[1];
+  } else if (directive == "cgi_cache_valid") {
+    long seconds;
+    if (tokens.size() != 2 || !parseTime(tokens[1], seconds))
+      throw std::runtime_error("Invalid cgi_cache_valid directive");
+    location.cgi_cache_valid = seconds;
+  } else if (directive == "cgi_cache_lock") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid cgi_cache_lock directive");
+    }
+    location.cgi_cache_lock = (tokens[1] == "on");
+  } else if (directive == "cgi_cache_lock_timeout") {
+    long seconds;
+    if (tokens.size() != 2 || !parseTime(tokens[1], seconds))
+      throw std::runtime_error("Invalid cgi_cache_lock_timeout directive");
+    location.cgi_cache_lock_timeout = seconds;
+  } else if (directive == "limit_rate") {
+    location.limit_rate = parse_body_size(tokens);
+  } else if (directive == "limit_rate_after") {
+    location.limit_rate_after = parse_body_size(tokens);
+  } else if (directive == "stub_status") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid stub_status directive");
+    }
+    location.stub_status = (tokens[1] == "on");
+  } else if (directive == "internal") {
+    if (tokens.size() != 1)
+      throw std::runtime_error("Invalid internal directive");
+    location.internal = true;
+  } else if (directive == "gzip_static") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid gzip_static directive");
+    }
+    location.gzip_static = (tokens[1] == "on");
+  } else if (directive == "brotli_static") {
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+      throw std::runtime_error("Invalid brotli_static directive");
+    }
+    location.brotli_static = (tokens[1] == "on");
+  } else if (isGzipDirective(directive)) {
+    parseGzipDirective(location.gzip, tokens);
+  } else if (directive == "expires") {
+    long seconds;
+    if (tokens.size() != 2)
+      throw std::runtime_error("Invalid expires directive");
+    if (tokens[1] == "off")
+      location.expires = EXPIRES_OFF;
+    else if (tokens[1] == "epoch")
+      location.expires = EXPIRES_EPOCH;
+    else if (tokens[1] == "max")
+      location.expires = EXPIRES_MAX;
+    else if (parseTime(tokens[1], seconds))
+      location.expires = seconds;
+    else
+      throw std::runtime_error("Invalid expires value: " + tokens[1]);
+  } else if (directive == "cache_control") {
+    if (tokens.size() < 2)
+      throw std::runtime_error("Invalid cache_control directive");
+    std::string value;
+    for (size_t i = 1; i < tokens.size(); ++i) {
+      if (i > 1)
+        value += " ";
+      value += tokens[i];
+    }
+    value.erase(std::remove(value.begin(), value.end(), '"'), value.end());
+    if (value.empty() || value.length() > MAX_STRING_LENGTH)
+      throw std::runtime_error("Invalid cache_control value");
+    location.cache_control = value;
   } else {
     throw std::runtime_error("Unknown location directive: " + directive);
   }
@@ -442,6 +704,13 @@ std::vector<ServerConfig> parseConfig(const std::string &file) {
         new_location.autoindex = current_server.isAutoindex();
         new_location.index = current_server.getIndex();
         new_location.root = current_server.getRoot();
+        new_location.client_max_body_size =
+            current_server.getClientMaxBodySize();
+        new_location.sendfile = current_server.isSendfile();
+        new_location.tcp_nopush = current_server.isTcpNopush();
+        new_location.tcp_nodelay = current_server.isTcpNodelay();
+        new_location.content_cache = current_server.isContentCache();
+        new_location.gzip = current_server.getGzip();
         if (current_server.getLocations().size() >= MAX_VECTOR_SIZE) {
           ifs.close();
           throw std::runtime_error("Too many location blocks");
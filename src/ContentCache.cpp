@@ -0,0 +1,174 @@
+#include "../include/ContentCache.hpp"
+#include "../include/webserv.hpp"
+
+ContentCache content_cache;
+
+SharedBuffer *new_shared_buffer(const std::string &data) {
+  SharedBuffer *buffer = new SharedBuffer();
+  buffer->data = data;
+  buffer->refs = 1;
+  return buffer;
+}
+
+SharedBuffer *retain_buffer(SharedBuffer *buffer) {
+  if (buffer)
+    buffer->refs++;
+  return buffer;
+}
+
+void release_buffer(SharedBuffer *buffer) {
+  if (buffer && --buffer->refs == 0)
+    delete buffer;
+}
+
+static bool same_file(const FileInfo &a, const FileInfo &b) {
+  return a.size == b.size && a.ino == b.ino && a.mtime == b.mtime &&
+         a.mtime_nsec == b.mtime_nsec;
+}
+
+ContentCache::ContentCache()
+    : used(0), budget(0), max_file(0), hits(0), misses(0), evictions(0) {}
+
+ContentCache::~ContentCache() {
+  while (!entries.empty())
+    erase(entries.begin());
+}
+
+// the cache is shared by all servers, it gets the largest budget and
+// file size limit among the servers having a location that enables it
+void ContentCache::configure(std::vector<ServerConfig> &servers_conf) {
+  budget = 0;
+  max_file = 0;
+  for (size_t i = 0; i < servers_conf.size(); ++i) {
+    std::vector<LocationConfig> &locations = servers_conf[i].getLocations();
+    for (size_t j = 0; j < locations.size(); ++j) {
+      if (!locations[j].content_cache)
+        continue;
+      budget = std::max(budget, servers_conf[i].getContentCacheSize());
+      max_file = std::max(max_file, servers_conf[i].getContentCacheMaxFile());
+    }
+  }
+}
+
+void ContentCache::erase(std::map<std::string, Entry>::iterator it) {
+  used -= it->second.body->data.size() + it->second.headers.size();
+  release_buffer(it->second.body);
+  lru.erase(it->second.lru);
+  entries.erase(it);
+}
+
+// the header block carries a Date, it is rebuilt once per second. it is
+// left open, the caller adds the per location headers and the final CRLF
+void ContentCache::refresh_headers(Entry &entry) {
+  time_t now = std::time(NULL);
+  if (!entry.headers.empty() && entry.headers_date == now)
+    return;
+
+  used -= entry.headers.size();
+  std::string &headers = entry.headers;
+  headers.clear();
+  headers.reserve(HEADER_RESERVE);
+  append_status_line(headers, 200);
+  headers += get_server_header();
+  headers += get_date_header();
+  append_content_type(headers, entry.type_path);
+  headers += entry.extra_headers;
+  headers += get_validator_headers(
+      make_etag(entry.info.ino, entry.info.size, entry.info.mtime, false),
+      entry.info.mtime);
+  headers += "Accept-Ranges: bytes" CRLF;
+  append_header(headers, "Content-Length", entry.body->data.size());
+  entry.headers_date = now;
+  used += entry.headers.size();
+}
+
+// on a hit, fills in the header block and a new reference to the body.
+// type_path names the file the Content-Type is derived from, and
+// extra_headers are the representation headers (Content-Encoding, Vary)
+bool ContentCache::lookup(const std::string &path, const std::string &type_path,
+                          const std::string &extra_headers,
+                          const FileInfo &info, std::string &headers,
+                          SharedBuffer *&body) {
+  std::map<std::string, Entry>::iterator it = entries.find(path);
+  if (it == entries.end()) {
+    misses++;
+    return false;
+  }
+  if (!same_file(it->second.info, info) ||
+      it->second.type_path != type_path ||
+      it->second.extra_headers != extra_headers) {
+    erase(it);
+    misses++;
+    return false;
+  }
+
+  hits++;
+  lru.splice(lru.begin(), lru, it->second.lru);
+  refresh_headers(it->second);
+  headers = it->second.headers;
+  body = retain_buffer(it->second.body);
+  return true;
+}
+
+// reads a small file from fd into the cache, evicting the least recently
+// used entries to make room. returns false when the file isn't cacheable
+bool ContentCache::store(const std::string &path, const std::string &type_path,
+                         const std::string &extra_headers,
+                         const FileInfo &info, int fd, std::string &headers,
+                         SharedBuffer *&body) {
+  size_t size = info.size;
+  if (!S_ISREG(info.mode) || size > max_file || size > budget)
+    return false;
+
+  SharedBuffer *buffer = new SharedBuffer();
+  buffer->refs = 1;
+  buffer->data.resize(size);
+  size_t total_read = 0;
+  while (total_read < size) {
+    ssize_t bytes = pread(fd, &buffer->data[total_read], size - total_read,
+                          total_read);
+    if (bytes <= 0)
+      break;
+    total_read += bytes;
+  }
+  // changed while we were reading it, serve it from the file instead
+  if (total_read != size) {
+    release_buffer(buffer);
+    return false;
+  }
+
+  std::map<std::string, Entry>::iterator it = entries.find(path);
+  if (it != entries.end())
+    erase(it);
+  while (!lru.empty() && used + size > budget) {
+    erase(entries.find(lru.back()));
+    evictions++;
+  }
+
+  Entry &entry = entries[path];
+  entry.body = buffer;
+  entry.type_path = type_path;
+  entry.extra_headers = extra_headers;
+  entry.info = info;
+  entry.lru = lru.insert(lru.begin(), path);
+  used += size;
+  refresh_headers(entry);
+
+  headers = entry.headers;
+  body = retain_buffer(buffer);
+  return true;
+}
+
+void ContentCache::invalidate(const std::string &path) {
+  std::map<std::string, Entry>::iterator it = entries.find(path);
+  if (it != entries.end())
+    erase(it);
+}
+
+std::string ContentCache::status() const {
+  return "content_cache: entries " + long_to_string(entries.size()) +
+         " bytes " + long_to_string(used) + "/" + long_to_string(budget) +
+         " hits " + long_to_string(hits) + " misses " +
+         long_to_string(misses) + " evictions " + long_to_string(evictions) +
+         "\n";
+}
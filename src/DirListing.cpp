@@ -0,0 +1,358 @@
+#include "../include/DirListing.hpp"
+#include "../include/webserv.hpp"
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#define DIRENT_BUFFER_SIZE (32 * 1024)
+// entries rendered per call once a sorted listing is read
+#define RENDER_BATCH 512
+#define NAME_COLUMN 40
+#define DIR_LISTING_CACHE_SIZE (16 * 1024 * 1024) // 16MB
+
+DirListingCache dir_listing_cache;
+
+static const char *MONTH_NAMES[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+// layout of the records getdents64 fills the buffer with
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+static bool parse_count(const std::string &str, size_t &value) {
+  if (str.empty() || str.size() > 9)
+    return false;
+  value = 0;
+  for (size_t i = 0; i < str.size(); ++i) {
+    if (!std::isdigit(static_cast<unsigned char>(str[i])))
+      return false;
+    value = value * 10 + (str[i] - '0');
+  }
+  return true;
+}
+
+// unknown parameters and values are ignored
+ListingOptions parse_listing_options(const std::string &query) {
+  ListingOptions options;
+  std::vector<std::string> params = split(query, '&');
+
+  for (size_t i = 0; i < params.size(); ++i) {
+    std::string::size_type eq = params[i].find('=');
+    if (eq == std::string::npos)
+      continue;
+    std::string key = params[i].substr(0, eq);
+    std::string value = params[i].substr(eq + 1);
+    size_t count;
+
+    if (key == "sort") {
+      if (value == "name")
+        options.sort = SORT_NAME;
+      else if (value == "size")
+        options.sort = SORT_SIZE;
+      else if (value == "time")
+        options.sort = SORT_TIME;
+    } else if (key == "order") {
+      options.desc = value == "desc";
+    } else if (key == "page" && parse_count(value, count) && count > 0) {
+      options.page = count;
+    } else if (key == "per_page" && parse_count(value, count)) {
+      options.per_page = count;
+    }
+  }
+  return options;
+}
+
+static const char *sort_name(ListingSort sort) {
+  if (sort == SORT_NAME)
+    return "name";
+  if (sort == SORT_SIZE)
+    return "size";
+  if (sort == SORT_TIME)
+    return "time";
+  return "";
+}
+
+std::string listing_cache_key(const std::string &path,
+                              const ListingOptions &options) {
+  std::string key = path + "?" + sort_name(options.sort) +
+                    (options.desc ? "-" : "+");
+  append_number(key, options.page);
+  key += '/';
+  append_number(key, options.per_page);
+  return key;
+}
+
+static bool entry_less(const ListingEntry &a, const ListingEntry &b,
+                       ListingSort sort) {
+  if (sort == SORT_SIZE && a.size != b.size)
+    return a.size < b.size;
+  if (sort == SORT_TIME && a.mtime != b.mtime)
+    return a.mtime < b.mtime;
+  return a.name < b.name;
+}
+
+struct EntryOrder {
+  ListingSort sort;
+  bool desc;
+
+  EntryOrder(ListingSort sort, bool desc) : sort(sort), desc(desc) {}
+  bool operator()(const ListingEntry &a, const ListingEntry &b) const {
+    return desc ? entry_less(b, a, sort) : entry_less(a, b, sort);
+  }
+};
+
+DirListing::DirListing(int dir_fd, const std::string &title,
+                       const ListingOptions &options,
+                       const std::string &cache_key, const FileInfo &dir_info)
+    : dir_fd(dir_fd), title(title), options(options),
+      buffer(DIRENT_BUFFER_SIZE), seen(0), render_index(0), started(false),
+      read_done(false), has_next(false), minute(-1), cache_key(cache_key),
+      dir_info(dir_info), cacheable(!cache_key.empty()) {}
+
+DirListing::~DirListing() {
+  if (dir_fd != -1)
+    close(dir_fd);
+}
+
+void DirListing::render(const ListingEntry &entry, std::string &out) {
+  const char *slash = entry.is_dir ? "/" : "";
+
+  out += "<a href=\"";
+  out += entry.name;
+  out += slash;
+  out += "\">";
+  out += entry.name;
+  out += slash;
+  out += "</a>";
+  int pad = NAME_COLUMN - static_cast<int>(entry.name.size());
+  out.append(pad < 1 ? 1 : pad, ' ');
+
+  if (entry.size < 0) {
+    out += '-';
+  } else if (entry.size > 1024) {
+    unsigned long tenths = (entry.size * 10 + 512) / 1024;
+    append_number(out, tenths / 10);
+    out += '.';
+    append_number(out, tenths % 10);
+    out += 'K';
+  } else {
+    append_number(out, entry.size);
+  }
+  out += "  ";
+
+  if (entry.mtime / 60 != minute) {
+    struct tm tm_info;
+    minute = entry.mtime / 60;
+    time_str = "-";
+    if (localtime_r(&entry.mtime, &tm_info)) {
+      time_str.clear();
+      append_number(time_str, tm_info.tm_mday);
+      time_str += '-';
+      time_str += MONTH_NAMES[tm_info.tm_mon];
+      time_str += '-';
+      append_number(time_str, tm_info.tm_year + 1900);
+      time_str += tm_info.tm_hour < 10 ? " 0" : " ";
+      append_number(time_str, tm_info.tm_hour);
+      time_str += tm_info.tm_min < 10 ? ":0" : ":";
+      append_number(time_str, tm_info.tm_min);
+    }
+  }
+  out += time_str;
+  out += '\n';
+}
+
+// links to the neighbouring pages, then the end of the document
+void DirListing::render_tail(std::string &out) {
+  if (options.per_page && (options.page > 1 || has_next)) {
+    std::string query = "?";
+    if (options.sort != SORT_NONE)
+      query += std::string("sort=") + sort_name(options.sort) + "&";
+    if (options.desc)
+      query += "order=desc&";
+    query += "per_page=";
+    append_number(query, options.per_page);
+    query += "&page=";
+
+    out += '\n';
+    if (options.page > 1) {
+      out += "<a href=\"" + query;
+      append_number(out, options.page - 1);
+      out += "\">&laquo; prev</a>  ";
+    }
+    if (has_next) {
+      out += "<a href=\"" + query;
+      append_number(out, options.page + 1);
+      out += "\">next &raquo;</a>";
+    }
+    out += '\n';
+  }
+  out += "</pre></body></html>";
+}
+
+// reads one getdents64 batch. unsorted entries of the current page are
+// rendered straight away and those before it skipped without a stat,
+// sorted listings keep every entry for sorting
+bool DirListing::read_batch(std::string &out) {
+  long bytes = syscall(SYS_getdents64, dir_fd, &buffer[0], buffer.size());
+  if (bytes < 0) {
+    LOG_STREAM(ERROR, "getdents64 " << title << ": " << strerror(errno));
+    return false;
+  }
+  if (bytes == 0) {
+    read_done = true;
+    return true;
+  }
+
+  size_t first = (options.page - 1) * options.per_page;
+  for (long pos = 0; pos < bytes;) {
+    struct linux_dirent64 *dirent =
+        reinterpret_cast<struct linux_dirent64 *>(&buffer[pos]);
+    pos += dirent->d_reclen;
+    const char *name = dirent->d_name;
+    if (!strcmp(name, ".") || !strcmp(name, ".."))
+      continue;
+
+    // unsorted pages are found by counting, only their entries are stat'ed
+    if (options.sort == SORT_NONE) {
+      if (options.per_page && seen >= first + options.per_page) {
+        // one entry past the page is enough to know there is a next one
+        has_next = true;
+        read_done = true;
+        return true;
+      }
+      if (seen++ < first)
+        continue;
+    }
+
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, 0) != 0) {
+      LOG_STREAM(WARNING, "stat failed in dir listing: " << strerror(errno));
+      continue;
+    }
+    ListingEntry entry;
+    entry.name = name;
+    entry.is_dir = S_ISDIR(st.st_mode);
+    entry.size = entry.is_dir ? -1 : st.st_size;
+    entry.mtime = st.st_mtime;
+
+    if (options.sort != SORT_NONE)
+      entries.push_back(entry);
+    else
+      render(entry, out);
+  }
+  return true;
+}
+
+// appends the next part of the page to out. returns false once the whole
+// page, tail included, has been produced
+bool DirListing::next(std::string &out) {
+  size_t start = out.size();
+
+  if (!started) {
+    out += "<html><head><title>Index of " + title +
+           "</title></head><body><h1>Index of " + title + "</h1><pre>\n";
+    out += "<a href=\"../\">../</a>\n";
+    started = true;
+  }
+
+  bool more = true;
+  if (!read_done) {
+    if (!read_batch(out)) {
+      cacheable = false;
+      read_done = true;
+      entries.clear();
+    }
+    if (read_done && options.sort != SORT_NONE) {
+      std::sort(entries.begin(), entries.end(),
+                EntryOrder(options.sort, options.desc));
+      size_t first = (options.page - 1) * options.per_page;
+      size_t last = entries.size();
+      if (options.per_page && first + options.per_page < last) {
+        last = first + options.per_page;
+        has_next = true;
+      }
+      // only the requested page is kept
+      entries.erase(entries.begin() + last, entries.end());
+      render_index = std::min(first, last);
+    }
+  } else if (render_index < entries.size()) {
+    size_t end = std::min(entries.size(), render_index + RENDER_BATCH);
+    for (; render_index < end; ++render_index)
+      render(entries[render_index], out);
+  } else {
+    render_tail(out);
+    more = false;
+  }
+
+  if (cacheable) {
+    rendered.append(out, start, std::string::npos);
+    if (rendered.size() > DIR_LISTING_CACHE_SIZE) {
+      cacheable = false;
+      std::string().swap(rendered);
+    }
+  }
+  if (!more && cacheable)
+    dir_listing_cache.store(cache_key, dir_info, rendered);
+  return more;
+}
+
+DirListingCache::DirListingCache() : used(0), hits(0), misses(0) {}
+
+DirListingCache::~DirListingCache() {
+  while (!entries.empty())
+    erase(entries.begin());
+}
+
+void DirListingCache::erase(std::map<std::string, Entry>::iterator it) {
+  used -= it->second.body->data.size();
+  release_buffer(it->second.body);
+  lru.erase(it->second.lru);
+  entries.erase(it);
+}
+
+bool DirListingCache::lookup(const std::string &key, const FileInfo &info,
+                             SharedBuffer *&body) {
+  std::map<std::string, Entry>::iterator it = entries.find(key);
+  if (it == entries.end()) {
+    misses++;
+    return false;
+  }
+  const FileInfo &cached = it->second.info;
+  if (cached.ino != info.ino || cached.mtime != info.mtime ||
+      cached.mtime_nsec != info.mtime_nsec) {
+    erase(it);
+    misses++;
+    return false;
+  }
+  hits++;
+  lru.splice(lru.begin(), lru, it->second.lru);
+  body = retain_buffer(it->second.body);
+  return true;
+}
+
+void DirListingCache::store(const std::string &key, const FileInfo &info,
+                            const std::string &html) {
+  if (html.size() > DIR_LISTING_CACHE_SIZE)
+    return;
+  std::map<std::string, Entry>::iterator it = entries.find(key);
+  if (it != entries.end())
+    erase(it);
+  while (!lru.empty() && used + html.size() > DIR_LISTING_CACHE_SIZE)
+    erase(entries.find(lru.back()));
+
+  Entry &entry = entries[key];
+  entry.body = new_shared_buffer(html);
+  entry.info = info;
+  entry.lru = lru.insert(lru.begin(), key);
+  used += html.size();
+}
+
+std::string DirListingCache::status() const {
+  return "dir_listing_cache: entries " + long_to_string(entries.size()) +
+         " bytes " + long_to_string(used) + " hits " + long_to_string(hits) +
+         " misses " + long_to_string(misses) + "\n";
+}
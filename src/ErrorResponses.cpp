@@ -0,0 +1,151 @@
+#include "../include/ErrorResponses.hpp"
+#include "../include/webserv.hpp"
+#include <set>
+
+ErrorResponses error_responses;
+
+static bool same_file(const FileInfo &a, const FileInfo &b) {
+  return a.size == b.size && a.ino == b.ino && a.mtime == b.mtime &&
+         a.mtime_nsec == b.mtime_nsec;
+}
+
+ErrorResponses::~ErrorResponses() { clear(); }
+
+// renders the built-in pages shared by requests without a server, then
+// every page of each server, custom error_page files included
+void ErrorResponses::configure(std::vector<ServerConfig> &servers_conf) {
+  const std::vector<int> &codes = special_response_codes();
+
+  clear();
+  for (size_t i = 0; i <= servers_conf.size(); ++i) {
+    const ServerConfig *server_conf = i ? &servers_conf[i - 1] : NULL;
+    std::map<int, ErrorPage> &server_pages = pages[server_conf];
+    std::set<int> all(codes.begin(), codes.end());
+    if (server_conf) {
+      const std::map<int, std::string> &custom = server_conf->getErrorPages();
+      for (std::map<int, std::string>::const_iterator it = custom.begin();
+           it != custom.end(); ++it)
+        all.insert(it->first);
+    }
+    for (std::set<int>::iterator it = all.begin(); it != all.end(); ++it) {
+      ErrorPage page;
+      if (render(server_conf, *it, page))
+        server_pages[*it] = page;
+    }
+  }
+}
+
+// reads the custom error_page file into page. false when it can't be
+static bool read_page(ErrorPage &page) {
+  int fd = open(page.file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    LOG_STREAM(WARNING, "Error page " << page.file << ": " << strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    LOG_STREAM(WARNING, "Error page " << page.file << " is not a file");
+    close(fd);
+    return false;
+  }
+  page.info.mode = st.st_mode;
+  page.info.size = st.st_size;
+  page.info.mtime = st.st_mtime;
+  page.info.mtime_nsec = st.st_mtim.tv_nsec;
+  page.info.ino = st.st_ino;
+  try {
+    page.body = new_shared_buffer(read_file_to_str(fd, st.st_size));
+  } catch (std::exception &e) {
+    LOG_STREAM(WARNING, "Error page " << page.file << ": " << e.what());
+    close(fd);
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+// false when the code has neither a custom nor a built-in page
+bool ErrorResponses::render(const ServerConfig *server_conf, int code,
+                            ErrorPage &page) {
+  std::map<int, std::string>::const_iterator it;
+  page.body = NULL;
+  page.gzip_bodies.clear();
+  page.mime = get_mime_type(".html");
+  page.file.clear();
+  page.missing = false;
+  memset(&page.info, 0, sizeof(page.info));
+  page.checked = std::time(NULL);
+
+  if (server_conf &&
+      (it = server_conf->getErrorPages().find(code)) !=
+          server_conf->getErrorPages().end()) {
+    page.file = it->second;
+    page.mime = get_mime_type(page.file);
+    if (read_page(page))
+      return true;
+    page.mime = get_mime_type(".html");
+    page.missing = true;
+  }
+
+  const std::vector<int> &codes = special_response_codes();
+  if (std::find(codes.begin(), codes.end(), code) != codes.end())
+    page.body = new_shared_buffer(special_response(code));
+  return page.body || page.missing;
+}
+
+void ErrorResponses::release(ErrorPage &page) {
+  release_buffer(page.body);
+  page.body = NULL;
+  for (std::map<int, SharedBuffer *>::iterator it = page.gzip_bodies.begin();
+       it != page.gzip_bodies.end(); ++it)
+    release_buffer(it->second);
+  page.gzip_bodies.clear();
+}
+
+// whether a custom page still matches the disk, a missing one while it
+// stays missing
+static bool page_current(const ServerConfig *server_conf, ErrorPage &page) {
+  time_t now = std::time(NULL);
+  if (page.file.empty() || now - page.checked < ERROR_PAGE_CHECK_INTERVAL)
+    return true;
+  page.checked = now;
+  FileInfo info;
+  bool exists = open_file_cache.stat(server_conf, page.file, info);
+  if (page.missing)
+    return !exists;
+  return exists && same_file(info, page.info);
+}
+
+// returns the page to answer code with, or NULL when there is none and
+// the response has to be built the regular way
+ErrorPage *ErrorResponses::find(const ServerConfig *server_conf, int code) {
+  std::map<const ServerConfig *, std::map<int, ErrorPage> >::iterator
+      server_pages = pages.find(server_conf);
+  if (server_pages == pages.end())
+    return NULL;
+  std::map<int, ErrorPage> &codes = server_pages->second;
+  std::map<int, ErrorPage>::iterator it = codes.find(code);
+
+  if (it != codes.end()) {
+    if (page_current(server_conf, it->second))
+      return it->second.body ? &it->second : NULL;
+    release(it->second);
+    codes.erase(it);
+  }
+  // the custom page changed on disk, showed up or went missing
+  ErrorPage page;
+  if (!render(server_conf, code, page))
+    return NULL;
+  ErrorPage &stored = codes[code] = page;
+  return stored.body ? &stored : NULL;
+}
+
+void ErrorResponses::clear() {
+  std::map<const ServerConfig *, std::map<int, ErrorPage> >::iterator it;
+  for (it = pages.begin(); it != pages.end(); ++it) {
+    std::map<int, ErrorPage>::iterator page;
+    for (page = it->second.begin(); page != it->second.end(); ++page)
+      release(page->second);
+  }
+  pages.clear();
+}
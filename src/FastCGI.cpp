@@ -0,0 +1,701 @@
+#include "../include/FastCGI.hpp"
+#include "../include/CgiCache.hpp"
+#include "../include/webserv.hpp"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+
+// record types and values of the FastCGI 1.0 specification
+#define FCGI_VERSION_1 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_GET_VALUES 9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_CANT_MPX_CONN 1
+#define FCGI_OVERLOADED 2
+
+#define FASTCGI_MAX_CONNS 16  // per application
+#define FASTCGI_MAX_REQS 256  // on a multiplexed connection
+#define FASTCGI_TIMEOUT 60    // seconds for an application to answer
+// larger responses are refused with a 502, they are held whole
+#define FASTCGI_OUTPUT_MAX (16 * 1024 * 1024) // 16MB
+// records are queued until this much waits to be written
+#define FASTCGI_OUT_BUFFER (64 * 1024)
+#define FASTCGI_STDIN_CHUNK (32 * 1024)
+#define FASTCGI_READ_BUFFER (32 * 1024)
+
+FastCGIPool fastcgi_pool;
+
+static void append_record(std::string &out, unsigned char type,
+                          unsigned short id, const char *data, size_t len) {
+  size_t padding = (8 - len % 8) % 8;
+  char header[FCGI_HEADER_LEN] = {
+      FCGI_VERSION_1,
+      static_cast<char>(type),
+      static_cast<char>(id >> 8),
+      static_cast<char>(id & 0xff),
+      static_cast<char>(len >> 8),
+      static_cast<char>(len & 0xff),
+      static_cast<char>(padding),
+      0};
+
+  out.append(header, FCGI_HEADER_LEN);
+  out.append(data, len);
+  out.append(padding, '\0');
+}
+
+// a whole stream, split in records and ended by an empty one
+static void append_stream(std::string &out, unsigned char type,
+                          unsigned short id, const std::string &data) {
+  for (size_t pos = 0; pos < data.size(); pos += FCGI_MAX_CONTENT)
+    append_record(out, type, id, data.data() + pos,
+                  std::min(data.size() - pos, (size_t)FCGI_MAX_CONTENT));
+  append_record(out, type, id, NULL, 0);
+}
+
+static void append_length(std::string &out, size_t len) {
+  if (len < 128) {
+    out += static_cast<char>(len);
+    return;
+  }
+  out += static_cast<char>((len >> 24) | 0x80);
+  out += static_cast<char>(len >> 16);
+  out += static_cast<char>(len >> 8);
+  out += static_cast<char>(len);
+}
+
+static void append_pair(std::string &out, const std::string &name,
+                        const std::string &value) {
+  append_length(out, name.size());
+  append_length(out, value.size());
+  out += name;
+  out += value;
+}
+
+static bool read_length(const std::string &data, size_t &pos, size_t &len) {
+  if (pos >= data.size())
+    return false;
+  unsigned char first = data[pos];
+  if (!(first & 0x80)) {
+    len = first;
+    pos++;
+    return true;
+  }
+  if (pos + 4 > data.size())
+    return false;
+  len = (static_cast<size_t>(first & 0x7f) << 24) |
+        (static_cast<size_t>(static_cast<unsigned char>(data[pos + 1])) << 16) |
+        (static_cast<size_t>(static_cast<unsigned char>(data[pos + 2])) << 8) |
+        static_cast<unsigned char>(data[pos + 3]);
+  pos += 4;
+  return true;
+}
+
+// request headers as HTTP_* params, the ones CGI names otherwise aside
+static void append_header_params(HttpRequest *request, CgiParams &params) {
+  const std::vector<HttpHeader> &headers = request->get_headers();
+
+  for (size_t i = 0; i < headers.size(); ++i) {
+    const std::string &key = headers[i].key;
+    if (key == "cookie" || key == "content-length" || key == "content-type")
+      continue;
+    std::string name = "HTTP_";
+    for (size_t j = 0; j < key.size(); ++j)
+      name += key[j] == '-' ? '_' : static_cast<char>(std::toupper(key[j]));
+    params.push_back(std::make_pair(name, strip(headers[i].value)));
+  }
+}
+
+FastCGIUpstream::FastCGIUpstream(const std::string &address)
+    : address(address), addr_len(0) {
+  memset(&addr, 0, sizeof(addr));
+}
+
+// "unix:/path" or "host:port", looked up once
+bool FastCGIUpstream::resolve() {
+  if (address.compare(0, 5, "unix:") == 0) {
+    struct sockaddr_un *un = reinterpret_cast<struct sockaddr_un *>(&addr);
+    std::string path = address.substr(5);
+    if (path.size() >= sizeof(un->sun_path)) {
+      LOG_STREAM(ERROR, "FastCGI: socket path too long: " << path);
+      return false;
+    }
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, path.c_str(), path.size() + 1);
+    addr_len = sizeof(struct sockaddr_un);
+    return true;
+  }
+
+  std::string::size_type colon = address.rfind(':');
+  std::string host = address.substr(0, colon);
+  std::string port = address.substr(colon + 1);
+  if (host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']')
+    host = host.substr(1, host.size() - 2);
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int status = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+  if (status != 0) {
+    LOG_STREAM(ERROR, "FastCGI: " << address << ": " << gai_strerror(status));
+    return false;
+  }
+  memcpy(&addr, result->ai_addr, result->ai_addrlen);
+  addr_len = result->ai_addrlen;
+  freeaddrinfo(result);
+  return true;
+}
+
+FastCGIPool::FastCGIPool()
+    : epoll_fd(-1), last_expire(0), requests(0), connects(0), reuses(0),
+      multiplexed(0) {}
+
+FastCGIPool::~FastCGIPool() {
+  for (std::map<int, FastCGIConnection *>::iterator it = connections.begin();
+       it != connections.end(); ++it) {
+    close(it->first);
+    for (std::map<unsigned short, FastCGIRequest *>::iterator req =
+             it->second->requests.begin();
+         req != it->second->requests.end(); ++req)
+      release(req->second);
+    delete it->second;
+  }
+  for (std::map<std::string, FastCGIUpstream *>::iterator it =
+           upstreams.begin();
+       it != upstreams.end(); ++it) {
+    for (size_t i = 0; i < it->second->waiting.size(); ++i)
+      release(it->second->waiting[i]);
+    delete it->second;
+  }
+}
+
+void FastCGIPool::init(int epoll_fd) { this->epoll_fd = epoll_fd; }
+
+bool FastCGIPool::owns(int fd) const {
+  return connections.find(fd) != connections.end();
+}
+
+// queues the request for the location's application. returns 0 once it
+// is queued, the response is produced when the application ends it
+int FastCGIPool::start(Client &client, const ServerConfig &server_conf,
+                       const LocationConfig *location,
+                       const std::string &path) {
+  HttpRequest *http = client.get_request();
+  FastCGIUpstream *&upstream = upstreams[location->fastcgi_pass];
+  if (!upstream)
+    upstream = new FastCGIUpstream(location->fastcgi_pass);
+  if (!upstream->addr_len && !upstream->resolve())
+    return 502;
+
+  int body_fd = -1;
+  if (http->body_created) {
+    body_fd = open(http->body.c_str(), O_RDONLY | O_CLOEXEC);
+    if (body_fd == -1) {
+      LOG_STREAM(ERROR, "Error opening body file: " << strerror(errno));
+      return 500;
+    }
+  }
+
+  std::string uri = http->get_path().get_coded_path();
+  CgiParams params = cgi_params(&client, server_conf, location, uri, "");
+  params.push_back(std::make_pair("SCRIPT_FILENAME", path));
+  params.push_back(std::make_pair("DOCUMENT_ROOT", location->root));
+  params.push_back(std::make_pair(
+      "REQUEST_URI", uri + http->get_path().get_coded_queries()));
+  append_header_params(http, params);
+
+  FastCGIRequest *request = new FastCGIRequest();
+  request->client = &client;
+  request->upstream = upstream;
+  request->conn = NULL;
+  request->id = 0;
+  for (size_t i = 0; i < params.size(); ++i)
+    append_pair(request->params, params[i].first, params[i].second);
+  request->body_fd = body_fd;
+  request->start = std::time(NULL);
+  request->attempts = 0;
+  client.fastcgi = request;
+  requests++;
+
+  upstream->waiting.push_back(request);
+  dispatch(upstream);
+  return 0;
+}
+
+FastCGIConnection *FastCGIPool::connect(FastCGIUpstream *upstream) {
+  int fd = socket(upstream->addr.ss_family,
+                  SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    LOG_STREAM(ERROR, "FastCGI: socket: " << strerror(errno));
+    return NULL;
+  }
+  bool connecting = false;
+  if (::connect(fd, reinterpret_cast<struct sockaddr *>(&upstream->addr),
+                upstream->addr_len) == -1) {
+    if (errno != EINPROGRESS) {
+      LOG_STREAM(ERROR, "FastCGI: connect to " << upstream->address << ": "
+                                               << strerror(errno));
+      close(fd);
+      return NULL;
+    }
+    connecting = true;
+  }
+  if (upstream->addr.ss_family != AF_UNIX) {
+    int on = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+      LOG_STREAM(WARNING, "setsockopt TCP_NODELAY: " << strerror(errno));
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  FastCGIConnection *conn = new FastCGIConnection();
+  conn->fd = fd;
+  conn->upstream = upstream;
+  conn->connecting = connecting;
+  conn->writing = true;
+  conn->reused = false;
+  conn->mpxs = false;
+  conn->max_reqs = 1;
+  conn->next_id = 1;
+  // one request at a time until the application says it multiplexes
+  std::string values;
+  append_pair(values, "FCGI_MPXS_CONNS", "");
+  append_pair(values, "FCGI_MAX_REQS", "");
+  append_record(conn->out, FCGI_GET_VALUES, 0, values.data(), values.size());
+
+  connections[fd] = conn;
+  upstream->conns.push_back(conn);
+  connects++;
+  return conn;
+}
+
+// requests that got nothing back on a connection that had served before
+// are retried once, the application may have closed it while idle
+void FastCGIPool::close_connection(FastCGIConnection *conn, bool retry) {
+  FastCGIUpstream *upstream = conn->upstream;
+
+  connections.erase(conn->fd);
+  close(conn->fd);
+  upstream->conns.remove(conn);
+  for (std::map<unsigned short, FastCGIRequest *>::iterator it =
+           conn->requests.begin();
+       it != conn->requests.end(); ++it) {
+    FastCGIRequest *request = it->second;
+    request->conn = NULL;
+    if (!request->client)
+      release(request);
+    else if (retry && conn->reused && request->output.empty() &&
+             request->attempts < 2)
+      upstream->waiting.push_front(request);
+    else
+      finish(request, 502);
+  }
+  delete conn;
+}
+
+void FastCGIPool::set_writing(FastCGIConnection *conn, bool on) {
+  if (conn->writing == on)
+    return;
+  struct epoll_event ev;
+  ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.fd = conn->fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1)
+    LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
+  conn->writing = on;
+}
+
+// hands waiting requests to connections with room for them, opening new
+// ones up to FASTCGI_MAX_CONNS
+void FastCGIPool::dispatch(FastCGIUpstream *upstream) {
+  while (!upstream->waiting.empty()) {
+    FastCGIConnection *conn = NULL;
+    for (std::list<FastCGIConnection *>::iterator it = upstream->conns.begin();
+         it != upstream->conns.end(); ++it) {
+      size_t room = (*it)->mpxs ? (*it)->max_reqs : 1;
+      if ((*it)->requests.size() < room) {
+        conn = *it;
+        break;
+      }
+    }
+    if (!conn && upstream->conns.size() < FASTCGI_MAX_CONNS) {
+      conn = connect(upstream);
+      // the requests wait for a busy connection, unless there is none
+      if (!conn && upstream->conns.empty()) {
+        while (!upstream->waiting.empty()) {
+          FastCGIRequest *request = upstream->waiting.front();
+          upstream->waiting.pop_front();
+          finish(request, 502);
+        }
+      }
+    }
+    if (!conn)
+      return;
+    FastCGIRequest *request = upstream->waiting.front();
+    upstream->waiting.pop_front();
+    assign(conn, request);
+  }
+}
+
+void FastCGIPool::assign(FastCGIConnection *conn, FastCGIRequest *request) {
+  unsigned short id;
+  do {
+    id = conn->next_id++;
+  } while (id == 0 || conn->requests.count(id));
+
+  if (conn->reused)
+    reuses++;
+  if (!conn->requests.empty())
+    multiplexed++;
+  request->conn = conn;
+  request->id = id;
+  request->attempts++;
+  request->output.clear();
+  conn->requests[id] = request;
+
+  const char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+  append_record(conn->out, FCGI_BEGIN_REQUEST, id, begin, sizeof(begin));
+  append_stream(conn->out, FCGI_PARAMS, id, request->params);
+  if (request->body_fd != -1)
+    lseek(request->body_fd, 0, SEEK_SET);
+  conn->uploading.push_back(request);
+  set_writing(conn, true);
+}
+
+// queues the request bodies as FCGI_STDIN records, one stream after the
+// other, while the output buffer has room
+bool FastCGIPool::fill_stdin(FastCGIConnection *conn) {
+  char buffer[FASTCGI_STDIN_CHUNK];
+
+  while (!conn->uploading.empty() && conn->out.size() < FASTCGI_OUT_BUFFER) {
+    FastCGIRequest *request = conn->uploading.front();
+    ssize_t bytes = 0;
+    if (request->body_fd != -1) {
+      bytes = read(request->body_fd, buffer, sizeof(buffer));
+      if (bytes < 0) {
+        LOG_STREAM(ERROR, "FastCGI: read body: " << strerror(errno));
+        return false;
+      }
+    }
+    append_record(conn->out, FCGI_STDIN, request->id, buffer, bytes);
+    if (bytes == 0)
+      conn->uploading.pop_front();
+  }
+  return true;
+}
+
+bool FastCGIPool::flush(FastCGIConnection *conn) {
+  if (!fill_stdin(conn))
+    return false;
+  while (!conn->out.empty()) {
+    ssize_t sent =
+        send(conn->fd, conn->out.data(), conn->out.size(), MSG_NOSIGNAL);
+    if (sent < 0 && errno == EAGAIN)
+      break;
+    if (sent < 0) {
+      LOG_STREAM(ERROR, "FastCGI: send to " << conn->upstream->address << ": "
+                                            << strerror(errno));
+      return false;
+    }
+    conn->out.erase(0, sent);
+    if (!fill_stdin(conn))
+      return false;
+  }
+  set_writing(conn, !conn->out.empty());
+  return true;
+}
+
+// reads what the application sent and handles every complete record.
+// returns false once the connection is closed or broken
+bool FastCGIPool::read_records(FastCGIConnection *conn) {
+  char buffer[FASTCGI_READ_BUFFER];
+
+  for (;;) {
+    ssize_t bytes = recv(conn->fd, buffer, sizeof(buffer), 0);
+    if (bytes < 0 && errno == EAGAIN)
+      return true;
+    if (bytes < 0) {
+      LOG_STREAM(ERROR, "FastCGI: recv from " << conn->upstream->address
+                                              << ": " << strerror(errno));
+      return false;
+    }
+    if (bytes == 0)
+      return false;
+    conn->in.append(buffer, bytes);
+
+    size_t pos = 0;
+    while (conn->in.size() - pos >= FCGI_HEADER_LEN) {
+      const unsigned char *header =
+          reinterpret_cast<const unsigned char *>(conn->in.data() + pos);
+      if (header[0] != FCGI_VERSION_1) {
+        LOG_STREAM(ERROR, "FastCGI: bad record from "
+                              << conn->upstream->address);
+        return false;
+      }
+      size_t len = (header[4] << 8) | header[5];
+      size_t total = FCGI_HEADER_LEN + len + header[6];
+      if (conn->in.size() - pos < total)
+        break;
+      if (!handle_record(conn, header[1], (header[2] << 8) | header[3],
+                         conn->in.substr(pos + FCGI_HEADER_LEN, len)))
+        return false;
+      pos += total;
+    }
+    conn->in.erase(0, pos);
+  }
+}
+
+// false when the connection has to be closed
+bool FastCGIPool::handle_record(FastCGIConnection *conn, unsigned char type,
+                                unsigned short id,
+                                const std::string &content) {
+  // management records, FCGI_UNKNOWN_TYPE when FCGI_GET_VALUES isn't known
+  if (id == 0) {
+    if (type != FCGI_GET_VALUES_RESULT)
+      return true;
+    size_t pos = 0, name_len, value_len;
+    while (read_length(content, pos, name_len) &&
+           read_length(content, pos, value_len) &&
+           pos + name_len + value_len <= content.size()) {
+      std::string name = content.substr(pos, name_len);
+      std::string value = content.substr(pos + name_len, value_len);
+      pos += name_len + value_len;
+      if (name == "FCGI_MPXS_CONNS")
+        conn->mpxs = value == "1";
+      else if (name == "FCGI_MAX_REQS")
+        conn->max_reqs =
+            std::min(std::max(1, std::atoi(value.c_str())), FASTCGI_MAX_REQS);
+    }
+    return true;
+  }
+
+  std::map<unsigned short, FastCGIRequest *>::iterator it =
+      conn->requests.find(id);
+  if (it == conn->requests.end())
+    return true;
+  FastCGIRequest *request = it->second;
+  if (type == FCGI_STDOUT && request->client &&
+      request->output.size() + content.size() > FASTCGI_OUTPUT_MAX) {
+    LOG_STREAM(ERROR, "FastCGI: response from " << conn->upstream->address
+                                                << " is too large");
+    Client *client = request->client;
+    client->fastcgi = NULL;
+    request->client = NULL;
+    std::string().swap(request->output);
+    cgi_cache.drop(*client);
+    send_special_response(*client, 502);
+    finished.push_back(client->get_socket());
+    // the rest of its output is dropped as it comes
+    if (!conn->mpxs)
+      return false;
+    send_abort(conn, request);
+  } else if (type == FCGI_STDOUT) {
+    if (request->client)
+      request->output += content;
+  } else if (type == FCGI_STDERR) {
+    if (!strip(content).empty())
+      LOG_STREAM(WARNING, "FastCGI " << conn->upstream->address << ": "
+                                     << strip(content));
+  } else if (type == FCGI_END_REQUEST && content.size() >= 8) {
+    unsigned char protocol_status = content[4];
+    conn->requests.erase(it);
+    // it may end the request before reading the whole body
+    std::deque<FastCGIRequest *>::iterator up = std::find(
+        conn->uploading.begin(), conn->uploading.end(), request);
+    if (up != conn->uploading.end())
+      conn->uploading.erase(up);
+    request->conn = NULL;
+    conn->reused = true;
+    if (protocol_status == FCGI_CANT_MPX_CONN && request->client) {
+      conn->mpxs = false;
+      conn->upstream->waiting.push_front(request);
+    } else if (protocol_status == FCGI_REQUEST_COMPLETE) {
+      finish(request, 0);
+    } else {
+      LOG_STREAM(ERROR, "FastCGI: " << conn->upstream->address
+                                    << " rejected the request, status "
+                                    << static_cast<int>(protocol_status));
+      finish(request, protocol_status == FCGI_OVERLOADED ? 503 : 502);
+    }
+  }
+  return true;
+}
+
+// queues the client's response, from the application's output or for
+// status when it is an error
+void FastCGIPool::finish(FastCGIRequest *request, int status) {
+  Client *client = request->client;
+
+  if (client) {
+    client->fastcgi = NULL;
+    if (!status)
+      status = cgi_output_response(client, request->output);
+    cgi_cache.drop(*client);
+    if (status)
+      send_special_response(*client, status);
+    finished.push_back(client->get_socket());
+  }
+  release(request);
+}
+
+void FastCGIPool::release(FastCGIRequest *request) {
+  if (request->body_fd != -1)
+    close(request->body_fd);
+  delete request;
+}
+
+void FastCGIPool::handle_event(int fd, uint32_t events) {
+  std::map<int, FastCGIConnection *>::iterator it = connections.find(fd);
+  if (it == connections.end())
+    return;
+  FastCGIConnection *conn = it->second;
+  FastCGIUpstream *upstream = conn->upstream;
+  bool ok = true;
+
+  if (conn->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+      error = errno;
+    if (error) {
+      LOG_STREAM(ERROR, "FastCGI: connect to " << upstream->address << ": "
+                                               << strerror(error));
+      ok = false;
+    }
+    conn->connecting = false;
+  }
+  if (ok && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    ok = read_records(conn);
+  if (ok)
+    ok = flush(conn);
+  if (!ok)
+    close_connection(conn, true);
+  dispatch(upstream);
+}
+
+// the client is gone or has been answered already. a request still
+// being served is aborted with FCGI_ABORT_REQUEST, or by closing its
+// connection when the application doesn't multiplex
+void FastCGIPool::abort(FastCGIRequest *request) {
+  FastCGIUpstream *upstream = request->upstream;
+  FastCGIConnection *conn = request->conn;
+
+  request->client = NULL;
+  if (!conn) {
+    std::deque<FastCGIRequest *>::iterator it = std::find(
+        upstream->waiting.begin(), upstream->waiting.end(), request);
+    if (it != upstream->waiting.end())
+      upstream->waiting.erase(it);
+    release(request);
+    return;
+  }
+  if (!conn->mpxs) {
+    close_connection(conn, false);
+    dispatch(upstream);
+    return;
+  }
+  send_abort(conn, request);
+}
+
+// asks a multiplexing application to end a request. it keeps its id until
+// the application does, for FASTCGI_TIMEOUT at most
+void FastCGIPool::send_abort(FastCGIConnection *conn,
+                             FastCGIRequest *request) {
+  std::deque<FastCGIRequest *>::iterator it =
+      std::find(conn->uploading.begin(), conn->uploading.end(), request);
+  if (it != conn->uploading.end())
+    conn->uploading.erase(it);
+  append_record(conn->out, FCGI_ABORT_REQUEST, request->id, NULL, 0);
+  set_writing(conn, true);
+  request->start = std::time(NULL);
+}
+
+static FastCGIRequest *find_late(std::map<std::string, FastCGIUpstream *> &
+                                     upstreams,
+                                 time_t now) {
+  for (std::map<std::string, FastCGIUpstream *>::iterator it =
+           upstreams.begin();
+       it != upstreams.end(); ++it) {
+    FastCGIUpstream *upstream = it->second;
+    for (size_t i = 0; i < upstream->waiting.size(); ++i) {
+      if (std::difftime(now, upstream->waiting[i]->start) >= FASTCGI_TIMEOUT)
+        return upstream->waiting[i];
+    }
+    for (std::list<FastCGIConnection *>::iterator conn =
+             upstream->conns.begin();
+         conn != upstream->conns.end(); ++conn) {
+      for (std::map<unsigned short, FastCGIRequest *>::iterator req =
+               (*conn)->requests.begin();
+           req != (*conn)->requests.end(); ++req) {
+        if (std::difftime(now, req->second->start) >= FASTCGI_TIMEOUT)
+          return req->second;
+      }
+    }
+  }
+  return NULL;
+}
+
+// answers 504 to the requests the application took too long with, and
+// closes the connections of aborted requests it never ended. checked once
+// a second
+void FastCGIPool::expire() {
+  time_t now = std::time(NULL);
+  if (now == last_expire)
+    return;
+  last_expire = now;
+
+  FastCGIRequest *request;
+  while ((request = find_late(upstreams, now))) {
+    Client *client = request->client;
+    if (!client) {
+      FastCGIUpstream *upstream = request->upstream;
+      LOG_STREAM(WARNING, "FastCGI: " << upstream->address
+                                      << " didn't end an aborted request");
+      close_connection(request->conn, true);
+      dispatch(upstream);
+      continue;
+    }
+    LOG_STREAM(WARNING, "FastCGI: " << request->upstream->address
+                                    << " timed out");
+    client->fastcgi = NULL;
+    abort(request);
+    send_special_response(*client, 504);
+    finished.push_back(client->get_socket());
+  }
+}
+
+// sockets of the clients answered since the last call
+void FastCGIPool::take_finished(std::vector<int> &fds) {
+  fds.insert(fds.end(), finished.begin(), finished.end());
+  finished.clear();
+}
+
+std::string FastCGIPool::status() const {
+  size_t open = connections.size();
+  size_t waiting = 0;
+  for (std::map<std::string, FastCGIUpstream *>::const_iterator it =
+           upstreams.begin();
+       it != upstreams.end(); ++it)
+    waiting += it->second->waiting.size();
+  return "fastcgi: requests " + long_to_string(requests) + " connections " +
+         long_to_string(open) + " connects " + long_to_string(connects) +
+         " reused " + long_to_string(reuses) + " multiplexed " +
+         long_to_string(multiplexed) + " waiting " + long_to_string(waiting) +
+         "\n";
+}
@@ -0,0 +1,331 @@
+#include "../include/OpenFileCache.hpp"
+#include "../include/webserv.hpp"
+#include <sys/inotify.h>
+
+#define WATCH_MASK                                                             \
+  (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |            \
+   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+OpenFileCache open_file_cache;
+
+// collapses repeated slashes, so equivalent spellings share an entry.
+// a trailing slash is kept since "file/" must keep failing with ENOTDIR
+static std::string cache_key(const std::string &path) {
+  std::string key;
+  key.reserve(path.size());
+  for (size_t i = 0; i < path.size(); ++i) {
+    if (path[i] == '/' && !key.empty() && key[key.size() - 1] == '/')
+      continue;
+    key += path[i];
+  }
+  return key;
+}
+
+static std::string dir_of(std::string key) {
+  if (key.size() > 1 && key[key.size() - 1] == '/')
+    key.erase(key.size() - 1);
+  std::string::size_type pos = key.rfind('/');
+  if (pos == std::string::npos)
+    return ".";
+  if (pos == 0)
+    return "/";
+  return key.substr(0, pos);
+}
+
+static void fill_info(const struct stat &st, FileInfo &info) {
+  info.mode = st.st_mode;
+  info.size = st.st_size;
+  info.mtime = st.st_mtime;
+  info.mtime_nsec = st.st_mtim.tv_nsec;
+  info.ino = st.st_ino;
+}
+
+static int open_and_stat(const std::string &path, FileInfo &info) {
+  memset(&info, 0, sizeof(info));
+  int fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  struct stat st;
+
+  if (fd == -1) {
+    info.error = errno;
+    // the path may exist without being readable, report what stat sees
+    if (info.error != ENOENT && info.error != ENOTDIR &&
+        ::stat(path.c_str(), &st) == 0)
+      info.error = 0;
+    else
+      return -1;
+  } else if (fstat(fd, &st) == -1) {
+    info.error = errno;
+    close(fd);
+    return -1;
+  }
+  fill_info(st, info);
+  return fd;
+}
+
+static bool use_cache(const ServerConfig *server_conf) {
+  return open_file_cache.is_active() && server_conf &&
+         server_conf->getOpenFileCacheMax() > 0;
+}
+
+OpenFileCache::OpenFileCache()
+    : max_entries(0), inactive(DEFAULT_OPEN_FILE_CACHE_INACTIVE),
+      inotify_fd(-1) {}
+
+OpenFileCache::~OpenFileCache() {
+  clear();
+  if (inotify_fd != -1)
+    close(inotify_fd);
+}
+
+// the cache is shared by all servers, it is sized by the largest
+// max and inactive values among the servers enabling it
+void OpenFileCache::configure(std::vector<ServerConfig> &servers_conf) {
+  max_entries = 0;
+  inactive = 0;
+  for (size_t i = 0; i < servers_conf.size(); ++i) {
+    if (servers_conf[i].getOpenFileCacheMax() == 0)
+      continue;
+    max_entries = std::max(max_entries, servers_conf[i].getOpenFileCacheMax());
+    inactive = std::max(inactive, servers_conf[i].getOpenFileCacheInactive());
+  }
+}
+
+int OpenFileCache::init(int epoll_fd) {
+  if (max_entries == 0)
+    return 0;
+
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd == -1) {
+    LOG_STREAM(WARNING, "inotify_init1: " << strerror(errno)
+                                          << ", open_file_cache disabled");
+    return -1;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = inotify_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev) == -1) {
+    LOG_STREAM(WARNING, "epoll_ctl: " << strerror(errno)
+                                      << ", open_file_cache disabled");
+    close(inotify_fd);
+    inotify_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+int OpenFileCache::watch_dir(const std::string &dir) {
+  std::map<std::string, int>::iterator it = dir_to_wd.find(dir);
+  if (it != dir_to_wd.end()) {
+    watches[it->second].second++;
+    return it->second;
+  }
+
+  int wd = inotify_add_watch(inotify_fd, dir.c_str(), WATCH_MASK);
+  if (wd == -1) {
+    LOG_STREAM(WARNING, "inotify_add_watch " << dir << ": " << strerror(errno));
+    return -1;
+  }
+  // same directory reached through another spelling, leave it uncached
+  if (watches.find(wd) != watches.end())
+    return -1;
+  dir_to_wd[dir] = wd;
+  watches[wd] = std::make_pair(dir, 1);
+  return wd;
+}
+
+void OpenFileCache::erase(std::map<std::string, Entry>::iterator it) {
+  if (it->second.fd != -1)
+    close(it->second.fd);
+  lru.erase(it->second.lru);
+
+  std::map<int, std::pair<std::string, size_t> >::iterator w =
+      watches.find(it->second.wd);
+  if (w != watches.end() && --w->second.second == 0) {
+    inotify_rm_watch(inotify_fd, w->first);
+    dir_to_wd.erase(w->second.first);
+    watches.erase(w);
+  }
+  entries.erase(it);
+}
+
+void OpenFileCache::erase_dir(int wd) {
+  std::map<std::string, Entry>::iterator it = entries.begin();
+  while (it != entries.end()) {
+    if (it->second.wd == wd)
+      erase(it++);
+    else
+      ++it;
+  }
+}
+
+// opens the path and caches the result when it is worth keeping.
+// returns the cached entry, or NULL with fd and info filled in for the caller
+const OpenFileCache::Entry *OpenFileCache::load(const std::string &key,
+                                                bool cache_errors, int &fd,
+                                                FileInfo &info) {
+  fd = open_and_stat(key, info);
+  if (fd == -1 && !(cache_errors && (info.error == ENOENT ||
+                                     info.error == ENOTDIR)))
+    return NULL;
+  if (info.error == 0 && fd == -1)
+    return NULL;
+
+  int wd = watch_dir(dir_of(key));
+  if (wd == -1)
+    return NULL;
+
+  while (!lru.empty() && entries.size() >= max_entries)
+    erase(entries.find(lru.back()));
+
+  Entry &entry = entries[key];
+  entry.fd = fd;
+  entry.info = info;
+  entry.wd = wd;
+  entry.last_used = std::time(NULL);
+  entry.lru = lru.insert(lru.begin(), key);
+  fd = -1;
+  return &entry;
+}
+
+const OpenFileCache::Entry *OpenFileCache::find(const std::string &key) {
+  std::map<std::string, Entry>::iterator it = entries.find(key);
+  if (it == entries.end())
+    return NULL;
+  it->second.last_used = std::time(NULL);
+  lru.splice(lru.begin(), lru, it->second.lru);
+  return &it->second;
+}
+
+// returns whether the path exists, info is filled in either way
+bool OpenFileCache::stat(const ServerConfig *server_conf,
+                         const std::string &path, FileInfo &info) {
+  if (!use_cache(server_conf)) {
+    struct stat st;
+    memset(&info, 0, sizeof(info));
+    if (::stat(path.c_str(), &st) == -1)
+      info.error = errno;
+    else
+      fill_info(st, info);
+    return info.error == 0;
+  }
+
+  std::string key = cache_key(path);
+  const Entry *entry = find(key);
+  if (!entry) {
+    int fd;
+    entry = load(key, server_conf->isOpenFileCacheErrors(), fd, info);
+    if (fd != -1)
+      close(fd);
+    if (!entry)
+      return info.error == 0;
+  }
+  info = entry->info;
+  return info.error == 0;
+}
+
+// returns a descriptor owned by the caller, or -1 with errno set.
+// cached descriptors are handed out as duplicates, they share the file
+// offset so readers must use explicit offsets (sendfile/pread)
+int OpenFileCache::open(const ServerConfig *server_conf,
+                        const std::string &path) {
+  if (!use_cache(server_conf))
+    return ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+  std::string key = cache_key(path);
+  const Entry *entry = find(key);
+  if (!entry) {
+    int fd;
+    FileInfo info;
+    entry = load(key, server_conf->isOpenFileCacheErrors(), fd, info);
+    if (!entry) {
+      if (fd == -1 && info.error == 0)
+        return ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+      errno = info.error;
+      return fd;
+    }
+  }
+  if (entry->fd == -1) {
+    errno = entry->info.error;
+    return -1;
+  }
+  return fcntl(entry->fd, F_DUPFD_CLOEXEC, 0);
+}
+
+void OpenFileCache::invalidate(const std::string &path) {
+  std::string key = cache_key(path);
+  if (key.size() > 1 && key[key.size() - 1] == '/')
+    key.erase(key.size() - 1);
+
+  std::map<std::string, Entry>::iterator it = entries.find(key);
+  if (it != entries.end())
+    erase(it);
+  it = entries.find(key + "/");
+  if (it != entries.end())
+    erase(it);
+}
+
+// drops every entry below a directory that went away, their own
+// directories may still be watched under the old name
+void OpenFileCache::invalidate_tree(const std::string &dir) {
+  std::string prefix = dir + "/";
+  std::map<std::string, Entry>::iterator it = entries.lower_bound(prefix);
+  while (it != entries.end() &&
+         it->first.compare(0, prefix.size(), prefix) == 0)
+    erase(it++);
+}
+
+void OpenFileCache::handle_events() {
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (true) {
+    ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+    if (len <= 0)
+      return;
+
+    for (char *ptr = buffer; ptr < buffer + len;
+         ptr += sizeof(struct inotify_event) +
+                reinterpret_cast<struct inotify_event *>(ptr)->len) {
+      struct inotify_event *event = reinterpret_cast<struct inotify_event *>(ptr);
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        LOG(WARNING, "inotify queue overflow, open_file_cache flushed");
+        clear();
+        continue;
+      }
+      std::map<int, std::pair<std::string, size_t> >::iterator w =
+          watches.find(event->wd);
+      if (w == watches.end())
+        continue;
+
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        std::string dir = w->second.first;
+        erase_dir(event->wd);
+        invalidate_tree(dir);
+        continue;
+      }
+      if (event->len) {
+        std::string path = join_paths(w->second.first, event->name);
+        invalidate(path);
+        if (event->mask & IN_ISDIR)
+          invalidate_tree(path);
+      }
+    }
+  }
+}
+
+// drops entries unused for longer than the inactive timeout
+void OpenFileCache::expire() {
+  std::time_t now = std::time(NULL);
+  while (!lru.empty()) {
+    std::map<std::string, Entry>::iterator it = entries.find(lru.back());
+    if (std::difftime(now, it->second.last_used) < inactive)
+      return;
+    erase(it);
+  }
+}
+
+void OpenFileCache::clear() {
+  while (!entries.empty())
+    erase(entries.begin());
+}
@@ -10,11 +10,18 @@
 /*                                                                            */
 /* ************************************************************************** */
 
+#include "../include/CgiCache.hpp"
 #include "../include/ConfigParser.hpp"
 #include "../include/parser.hpp"
 #include "../include/webserv.hpp"
+#include "../include/gzip.hpp"
+#include <limits>
+#include <spawn.h>
+
+#define CGI_READ_SIZE (32 * 1024)
+// longest header block a script may write
+#define CGI_HEADER_MAX (64 * 1024)
 
-static pid_t cgi_child_pid = -1;
 std::map<int, Client *> cgi_to_client;
 
 void wait_for_child() {
@@ -22,16 +29,68 @@ void wait_for_child() {
     ;
 }
 
+// whether the client is still sending the body of a request its script
+// may already be answering
+bool receiving_script_body(Client *client) {
+  HttpRequest *request = client->get_request();
+  return request && request->body_sink && !client->error_code &&
+         !request->request_is_ready();
+}
+
+// the part of a script's output the client can be sent now. while its body
+// is received the last queued segment is held back, so the client doesn't
+// see the response end and send its next request before this one is read
+size_t sendable_output(Client *client) {
+  size_t pending = client->pending_bytes();
+  if (client->out.empty() || !receiving_script_body(client))
+    return pending;
+  const OutSegment &last = client->out.back();
+  size_t size = last.shared ? last.shared->data.size() : last.data.size();
+  return pending - (size - last.offset);
+}
+
+// sets the events of a script's client socket: the body while it is
+// received and the script keeps up with it, and the output queued so far,
+// which is sent without waiting for the end of the body
+void watch_script_client(int epoll_fd, Client *client) {
+  bool receiving = receiving_script_body(client);
+  struct epoll_event ev;
+
+  ev.events = 0;
+  if (!client->cgi.input_paused && (receiving || client->out.empty()))
+    ev.events |= EPOLLIN;
+  if (sendable_output(client))
+    ev.events |= EPOLLOUT;
+  ev.data.fd = client->get_socket();
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->get_socket(), &ev) == -1)
+    LOG_STREAM(WARNING, "epoll_ctl: " << strerror(errno));
+}
+
+// the client's socket is read again, or no longer while the script is a
+// buffer behind on its body
+static void set_body_reading(int epoll_fd, Client *client, bool on) {
+  client->cgi.input_paused = !on;
+  watch_script_client(epoll_fd, client);
+}
+
 void cgi_cleanup(int epoll_fd, Client *client) {
+  if (client->cgi.input_paused)
+    set_body_reading(epoll_fd, client, true);
   epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->cgi.pipe_fd, NULL);
   epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->cgi.in_pipe_fd, NULL);
-  close(client->cgi.output_fd);
   close(client->cgi.pipe_fd);
   close(client->cgi.in_pipe_fd);
   close(client->cgi.body_fd);
-  remove(client->cgi.output_file.c_str());
   cgi_to_client.erase(client->cgi.pipe_fd);
   cgi_to_client.erase(client->cgi.in_pipe_fd);
+  cgi_cache.drop(*client);
+}
+
+// stops a script whose output is no longer wanted
+void stop_cgi(int epoll_fd, Client *client) {
+  if (client->cgi.pid > 0)
+    kill(client->cgi.pid, SIGTERM);
+  cgi_cleanup(epoll_fd, client);
 }
 
 std::string get_script_dir(std::string path) {
@@ -98,6 +157,116 @@ std::string remove_path_info(std::string str, const std::string &substr) {
   return str;
 }
 
+// the CGI/1.1 meta-variables of a request, given to CGI processes as
+// their environment and to FastCGI applications as FCGI_PARAMS
+CgiParams cgi_params(Client *client, const ServerConfig &server_conf,
+                     const LocationConfig *location,
+                     const std::string &script_name,
+                     const std::string &path_info) {
+  HttpRequest *request = client->get_request();
+  CgiParams params;
+
+  params.push_back(std::make_pair("GATEWAY_INTERFACE", "CGI/0.1"));
+  params.push_back(std::make_pair(
+      "REQUEST_METHOD", method_to_string(request->get_method())));
+  params.push_back(std::make_pair("SCRIPT_NAME", script_name));
+
+  const std::vector<std::string> &server_names = server_conf.getServerNames();
+  params.push_back(std::make_pair(
+      "SERVER_NAME", server_names.empty() ? "localhost" : server_names[0]));
+  try {
+    params.push_back(std::make_pair(
+        "SERVER_NAME", request->get_header_by_key("host")->value));
+  } catch (std::exception &e) {
+  }
+
+  params.push_back(std::make_pair("SERVER_PORT", client->port));
+  params.push_back(std::make_pair("SERVER_PROTOCOL", "HTTP/1.1"));
+  params.push_back(std::make_pair("SERVER_SOFTWARE", SERVER_SOFTWARE));
+  std::string query = request->get_path().get_coded_queries();
+  params.push_back(std::make_pair(
+      "QUERY_STRING", query.empty() ? query : query.substr(1)));
+  params.push_back(std::make_pair("REMOTE_ADDR", client->addr));
+  params.push_back(std::make_pair("REMOTE_HOST", client->addr));
+  try {
+    params.push_back(std::make_pair(
+        "HTTP_COOKIE", request->get_header_by_key("cookie")->value));
+  } catch (std::exception &e) {
+  }
+
+  // a chunked body still being received has no length yet, the script
+  // reads it to the end of its input
+  size_t content_length = request->request_is_ready()
+                              ? request->get_body_len()
+                              : std::max<ssize_t>(request->get_content_len(), 0);
+  if (content_length != 0)
+    params.push_back(
+        std::make_pair("CONTENT_LENGTH", long_to_string(content_length)));
+  try {
+    params.push_back(std::make_pair(
+        "CONTENT_TYPE", request->get_header_by_key("content-type")->value));
+  } catch (std::exception &e) {
+  }
+
+  params.push_back(std::make_pair("PATH_INFO", path_info));
+  if (!path_info.empty())
+    params.push_back(std::make_pair(
+        "PATH_TRANSLATED", join_paths(location->root, decode_url(path_info))));
+  return params;
+}
+
+// the environment as one "NAME=value\0" block, envp pointing into it
+static void build_environment(const CgiParams &params, std::string &block,
+                              std::vector<char *> &envp) {
+  size_t size = 0;
+  for (size_t i = 0; i < params.size(); ++i)
+    size += params[i].first.size() + params[i].second.size() + 2;
+  block.reserve(size);
+  for (size_t i = 0; i < params.size(); ++i) {
+    block += params[i].first;
+    block += '=';
+    block += params[i].second;
+    block += '\0';
+  }
+  envp.reserve(params.size() + 1);
+  for (size_t pos = 0; pos < block.size(); pos = block.find('\0', pos) + 1)
+    envp.push_back(&block[pos]);
+  envp.push_back(NULL);
+}
+
+// runs the interpreter on the script from the script's directory, with
+// stdin_fd and stdout_fd as its stdin and stdout. posix_spawn shares the
+// server's memory until the exec instead of copying its page tables as
+// fork does, the cost no longer grows with the caches and client pool.
+// returns 0 or the error number
+static int spawn_cgi(const std::string &cgi_bin, const std::string &script,
+                     const CgiParams &params, int stdin_fd, int stdout_fd,
+                     pid_t &pid) {
+  std::string env_block;
+  std::vector<char *> envp;
+  build_environment(params, env_block, envp);
+
+  std::string script_dir = get_script_dir(script);
+  std::string script_name = "." + get_script_name(script);
+  char *argv[] = {const_cast<char *>(cgi_bin.c_str()),
+                  const_cast<char *>(script_name.c_str()), NULL};
+
+  posix_spawn_file_actions_t actions;
+  int error = posix_spawn_file_actions_init(&actions);
+  if (error)
+    return error;
+  // the pipes are close-on-exec, their copies as stdin and stdout are not
+  if (!(error = posix_spawn_file_actions_adddup2(&actions, stdin_fd,
+                                                 STDIN_FILENO)) &&
+      !(error = posix_spawn_file_actions_adddup2(&actions, stdout_fd,
+                                                 STDOUT_FILENO)) &&
+      !(error = posix_spawn_file_actions_addchdir_np(&actions,
+                                                     script_dir.c_str())))
+    error = posix_spawn(&pid, cgi_bin.c_str(), &actions, NULL, argv, &envp[0]);
+  posix_spawn_file_actions_destroy(&actions);
+  return error;
+}
+
 int executeCGI(int epoll_fd, const ServerConfig &server_conf,
                const std::string &script_path, const LocationConfig *location,
                Client *client) {
@@ -162,9 +331,14 @@ int executeCGI(int epoll_fd, const ServerConfig &server_conf,
     return 403;
   }
 
+  CgiParams params =
+      cgi_params(client, server_conf, location, script_name, path_info);
+
   int input_pipe[2] = {-1, -1};  // Parent writes to child stdin
   int output_pipe[2] = {-1, -1}; // Child writes to parent stdout
-  if (pipe(input_pipe) == -1 || pipe(output_pipe) == -1) {
+  // close-on-exec, so later scripts don't hold this one's pipes open
+  if (pipe2(input_pipe, O_CLOEXEC) == -1 ||
+      pipe2(output_pipe, O_CLOEXEC) == -1) {
     LOG_STREAM(ERROR, "CGI: Pipe creation failed: " << strerror(errno));
     close(input_pipe[0]);
     close(input_pipe[1]);
@@ -173,8 +347,9 @@ int executeCGI(int epoll_fd, const ServerConfig &server_conf,
     return 503;
   }
 
-  // Set output pipe to non-blocking
-  if (fcntl(output_pipe[0], F_SETFL, O_NONBLOCK) == -1) {
+  // Set the parent's ends to non-blocking
+  if (fcntl(output_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+      fcntl(input_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
     LOG_STREAM(ERROR, "CGI: fcntl failed: " << strerror(errno));
     close(input_pipe[0]);
     close(input_pipe[1]);
@@ -183,431 +358,509 @@ int executeCGI(int epoll_fd, const ServerConfig &server_conf,
     return 503;
   }
 
-  cgi_child_pid = fork();
-  if (cgi_child_pid == -1) {
-    LOG_STREAM(ERROR, "CGI: Fork failed: " << strerror(errno));
+  pid_t pid;
+  int error = spawn_cgi(cgi_bin, correct_script_path, params, input_pipe[0],
+                        output_pipe[1], pid);
+  if (error) {
+    LOG_STREAM(ERROR, "CGI: posix_spawn " << cgi_bin << ": "
+                                          << strerror(error));
     close(input_pipe[0]);
     close(input_pipe[1]);
     close(output_pipe[0]);
     close(output_pipe[1]);
-    return 503;
+    return 502;
   }
 
-  if (cgi_child_pid == 0) {
-
-    close(input_pipe[1]);
-    close(output_pipe[0]);
-
-    // Redirect stdin and stdout
-    if (dup2(input_pipe[0], STDIN_FILENO) == -1 ||
-        dup2(output_pipe[1], STDOUT_FILENO) == -1) {
-      LOG_STREAM(ERROR, "CGI: dup2 failed: " << strerror(errno));
-      exit(1);
+  close(input_pipe[0]);
+  close(output_pipe[1]);
+  client->cgi.pipe_fd = output_pipe[0];
+  client->cgi.in_pipe_fd = input_pipe[1];
+  client->cgi.pid = pid;
+  client->cgi.start = std::time(NULL);
+
+  // a complete body is read back from its file, one still being received
+  // is piped to the script as it arrives
+  if (request->request_is_ready() && request->body_created) {
+    client->cgi.body_fd = open(request->body.c_str(), O_RDONLY);
+    if (client->cgi.body_fd < 0) {
+      LOG_STREAM(ERROR, "Error opening body file: " << strerror(errno));
+      stop_cgi(epoll_fd, client);
+      client->clear_cgi();
+      return 503;
     }
-    close(input_pipe[0]);
-    close(output_pipe[1]);
+  } else if (request->request_is_ready()) {
+    close(client->cgi.in_pipe_fd);
+    client->cgi.in_pipe_fd = -1;
+  }
 
-    // Set up CGI environment variables
-    std::vector<std::string> env_strings;
-    std::vector<char *> envp;
-    std::stringstream env_stream;
-
-    env_stream << "GATEWAY_INTERFACE=" << "CGI/0.1";
-    env_strings.push_back(env_stream.str());
-    env_stream.str("");
-
-    env_stream << "REQUEST_METHOD=" << method_to_string(request->get_method());
-    env_strings.push_back(env_stream.str());
-    env_stream.str("");
-
-    env_stream << "SCRIPT_NAME=" << script_name;
-    env_strings.push_back(env_stream.str());
-    env_stream.str("");
-
-    const std::vector<std::string> &server_names = server_conf.getServerNames();
-    env_stream << "SERVER_NAME="
-               << (server_names.empty() ? "localhost" : server_names[0]);
-    env_strings.push_back(env_stream.str());
-    env_stream.str("");
-
-    try {
-      std::string host = request->get_header_by_key("host")->value;
-      env_stream << "SERVER_NAME=" << host;
-      env_strings.push_back(env_stream.str());
-      env_stream.str("");
-    } catch (std::exception &e) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = client->cgi.pipe_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->cgi.pipe_fd, &ev) == -1) {
+    LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
+    stop_cgi(epoll_fd, client);
+    client->clear_cgi();
+    return 500;
+  }
+  cgi_to_client[client->cgi.pipe_fd] = client;
+  if (client->cgi.in_pipe_fd != -1) {
+    ev.events = 0;
+    if (client->cgi.body_fd != -1)
+      ev.events = EPOLLOUT;
+    ev.data.fd = client->cgi.in_pipe_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->cgi.in_pipe_fd, &ev) ==
+        -1) {
+      LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
+      stop_cgi(epoll_fd, client);
+      client->clear_cgi();
+      return 500;
     }
+    cgi_to_client[client->cgi.in_pipe_fd] = client;
+  }
+  if (!request->request_is_ready())
+    request->body_sink = &client->cgi.input;
+  return 0;
+}
 
-    env_stream << "SERVER_PORT=" << client->port;
-    env_strings.push_back(env_stream.str());
-    env_stream.str("");
-
-    env_stream << "SERVER_PROTOCOL=HTTP/1.1";
-    env_strings.push_back(env_stream.str());
-    env_stream.str("");
-
-    env_stream << "SERVER_SOFTWARE=" << SERVER_SOFTWARE;
-    env_strings.push_back(env_stream.str());
-    env_stream.str("");
-
-    env_stream << "QUERY_STRING=" << request->get_path().get_coded_queries();
-    ;
-    env_strings.push_back(env_stream.str());
-    env_stream.str("");
-
-    env_stream << "REMOTE_ADDR=" << client->addr;
-    env_strings.push_back(env_stream.str());
-    env_stream.str("");
-
-    env_stream << "REMOTE_HOST=" << client->addr;
-    env_strings.push_back(env_stream.str());
-    env_stream.str("");
-
-    try {
-      std::string cookie = request->get_header_by_key("cookie")->value;
-      env_stream << "HTTP_COOKIE=" << cookie;
-      env_strings.push_back(env_stream.str());
-      env_stream.str("");
+// the status, Content-Type and Content-Length of a script's header block
+static void scan_cgi_headers(const std::string &cgi_headers,
+                             std::string &http_status,
+                             std::string &content_type, bool &has_length,
+                             size_t &length) {
+  std::istringstream header_stream(cgi_headers);
+  std::string line;
 
-    } catch (std::exception &e) {
-    }
+  http_status = "200 OK";
+  has_length = false;
+  length = std::numeric_limits<size_t>::max();
+  while (std::getline(header_stream, line) && !line.empty() && line != "\r") {
+    std::string::size_type colon_pos = line.find(':');
+    if (colon_pos == std::string::npos)
+      continue;
 
-    size_t content_length = request->get_body_len();
-    if (content_length != 0) {
-      env_stream << "CONTENT_LENGTH=" << content_length;
-      env_strings.push_back(env_stream.str());
-      env_stream.str("");
-    }
+    std::string key = to_lower(line.substr(0, colon_pos));
+    std::string value = header_trim(line.substr(colon_pos + 1));
 
-    try {
-      std::string content_type =
-          request->get_header_by_key("content-type")->value;
-      env_stream << "CONTENT_TYPE=" << content_type;
-      env_strings.push_back(env_stream.str());
-      env_stream.str("");
-    } catch (std::exception &e) {
+    if (key == "status") {
+      http_status = value;
+    } else if (key == "content-length") {
+      has_length = true;
+      length = std::strtoul(value.c_str(), NULL, 10);
+    } else if (key == "content-type") {
+      content_type = value;
     }
+  }
+}
 
-    env_stream << "PATH_INFO=" << path_info;
-    env_strings.push_back(env_stream.str());
-    env_stream.str("");
-
-    if (!path_info.empty()) {
-      std::string path_translated;
+// the script's Content-Length describes the uncompressed body
+static void remove_content_length(std::string &headers) {
+  std::istringstream lines(headers);
+  std::string line;
 
-      path_translated = join_paths(location->root, decode_url(path_info));
+  headers.clear();
+  while (std::getline(lines, line)) {
+    if (to_lower(line).compare(0, 15, "content-length:") != 0)
+      headers += line + "\n";
+  }
+}
 
-      env_stream << "PATH_TRANSLATED=" << path_translated;
-      env_strings.push_back(env_stream.str());
-      env_stream.str("");
-    }
+static std::string cgi_status_line(Client *client,
+                                   const std::string &http_status) {
+  return "HTTP/1.1 " + http_status + CRLF + get_server_header() +
+         get_date_header() + get_connection_header(*client);
+}
 
-    for (size_t i = 0; i < env_strings.size(); ++i) {
-      envp.push_back(const_cast<char *>(env_strings[i].c_str()));
-    }
-    envp.push_back(0);
+// queues the response for the output of a CGI script or FastCGI
+// application, its header block then its body, or the file it redirects
+// to. returns 502 when the output has no header block
+int cgi_output_response(Client *client, std::string &cgi_content) {
+  size_t header_end = cgi_content.find("\r\n\r\n");
+  if (header_end == std::string::npos) {
+    LOG_STREAM(ERROR, "CGI: Invalid output format");
+    return 502;
+  }
 
-    std::string script_dir = get_script_dir(correct_script_path);
-    script_name = "." + get_script_name(correct_script_path);
+  std::string cgi_headers = cgi_content.substr(0, header_end);
+  int status = serve_internal_redirect(*client, cgi_headers);
+  if (status != -1)
+    return status;
+  std::string cgi_body = cgi_content.substr(header_end + 4);
+  std::string http_status;
+  std::string content_type;
+  bool has_content_length;
+  size_t length;
+  scan_cgi_headers(cgi_headers, http_status, content_type, has_content_length,
+                   length);
+
+  cgi_cache.check_headers(*client, cgi_headers);
+  cgi_cache.append(*client, cgi_body.data(), cgi_body.size());
+  cgi_cache.store(*client);
+
+  std::string headers = cgi_headers + "\r\n";
+  if (use_gzip(client->get_request(), content_type, cgi_body.size(),
+               headers)) {
+    remove_content_length(headers);
+    headers += get_content_encoding("gzip");
+    cgi_body = gzip_string(cgi_body,
+                           client->get_request()->location->gzip.comp_level);
+    has_content_length = false;
+  }
+  std::stringstream response_stream;
+  response_stream << cgi_status_line(client, http_status) << headers;
+  if (!has_content_length)
+    response_stream << "content-length: " << cgi_body.size() << "\r\n";
 
-    std::vector<std::string> argv_strings;
-    std::vector<char *> argv;
-    argv_strings.push_back(cgi_bin);
-    argv_strings.push_back(script_name);
-    for (size_t i = 0; i < argv_strings.size(); ++i) {
-      argv.push_back(const_cast<char *>(argv_strings[i].c_str()));
-    }
-    argv.push_back(0);
+  response_stream << "\r\n";
 
-    if (chdir(script_dir.c_str()) == -1) {
-      LOG_STREAM(ERROR, "CGI: chdir failed: " << strerror(errno));
-      exit(1);
-    }
+  client->queue(response_stream.str());
+  client->queue_swap(cgi_body);
+  return 0;
+}
 
-    execve(cgi_bin.c_str(), argv.data(), envp.data());
-    LOG_STREAM(ERROR, "CGI: execve failed: " << strerror(errno));
-    exit(1);
+// queues the response head for a script's header block. the body that
+// follows is sent as it is read, chunked unless the script gave its
+// Content-Length or the request is HTTP/1.0, compressed chunk by chunk when gzip applies
+static void start_cgi_response(Client *client,
+                               const std::string &cgi_headers) {
+  std::string http_status;
+  std::string content_type;
+  bool has_length;
+  size_t length;
+  scan_cgi_headers(cgi_headers, http_status, content_type, has_length, length);
+  cgi_cache.check_headers(*client, cgi_headers);
+
+  std::string headers = cgi_headers + "\r\n";
+  HttpRequest *request = client->get_request();
+  if (use_gzip(request, content_type, length, headers)) {
+    remove_content_length(headers);
+    headers += get_content_encoding("gzip");
+    client->gzip = new GzipStream(request->location->gzip.comp_level);
+    has_length = false;
   }
+  // the status line decides keep-alive, which an unframed body turns off
+  headers = cgi_status_line(client, http_status) + headers;
+  client->cgi.chunked = !has_length && frame_unknown_length(*client, headers);
+  client->queue(headers + CRLF);
+  client->cgi.streaming = true;
+}
 
-  close(input_pipe[0]);
-  close(output_pipe[1]);
-  client->cgi.pipe_fd = output_pipe[0];
-  client->cgi.pid = cgi_child_pid;
-
-  std::string body_path = request->body;
-  if (request->body_created) {
-    int fd = open(body_path.c_str(), O_RDONLY);
-    if (fd < 0) {
-      LOG_STREAM(ERROR, "Error opening body file: " << strerror(errno));
-      kill(cgi_child_pid, SIGTERM);
-      close(input_pipe[1]);
-      close(output_pipe[0]);
-      return 503;
-    }
-    client->cgi.body_fd = fd;
-    client->cgi.in_pipe_fd = input_pipe[1];
-
-    struct epoll_event ev;
-    ev.events = EPOLLOUT;
-    ev.data.fd = client->cgi.in_pipe_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->cgi.in_pipe_fd, &ev) == -1) {
-      LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
-      kill(cgi_child_pid, SIGTERM);
-      cgi_cleanup(epoll_fd, client);
-      return 500;
-    }
-    cgi_to_client[client->cgi.in_pipe_fd] = client;
-  } else {
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = client->cgi.pipe_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->cgi.pipe_fd, &ev) == -1) {
-      LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
-      kill(cgi_child_pid, SIGTERM);
-      cgi_cleanup(epoll_fd, client);
-      return 500;
+// queues a part of the script's body, or with last the end of it
+static void forward_cgi_body(Client *client, const char *data, size_t len,
+                             bool last) {
+  std::string body(data, len);
+
+  cgi_cache.append(*client, data, len);
+  if (client->gzip) {
+    std::string compressed;
+    client->gzip->compress(data, len, compressed);
+    if (last) {
+      client->gzip->finish(compressed);
+      delete client->gzip;
+      client->gzip = NULL;
     }
-    client->cgi.start = std::time(NULL);
-    cgi_to_client[client->cgi.pipe_fd] = client;
+    body.swap(compressed);
   }
-
-  std::string temp_output_file = "/tmp/cgi_" + random_string();
-  int output_fd =
-      open(temp_output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
-  if (output_fd == -1) {
-    LOG_STREAM(ERROR, "CGI: Failed to open temp file: " << strerror(errno));
-    kill(client->cgi.pid, SIGTERM);
-    cgi_cleanup(epoll_fd, client);
-    return 503;
+  if (!client->cgi.chunked) {
+    client->queue_swap(body);
+    return;
   }
-  client->cgi.output_fd = output_fd;
-  client->cgi.output_file = temp_output_file;
+  if (!body.empty()) {
+    client->queue(int_to_hex(body.size()) + CRLF);
+    client->queue_swap(body);
+    client->queue(CRLF);
+  }
+  if (last)
+    client->queue("0" CRLF CRLF);
+}
 
-  return 0;
+// ends a script's response short of its end. the connection is closed
+// once the output so far is sent, the missing last chunk or bytes of
+// Content-Length tell the client the body is incomplete
+void cut_cgi_response(Client *client) {
+  delete client->gzip;
+  client->gzip = NULL;
+  client->keep_alive = false;
 }
 
-void in_cgi_cleanup(int epoll_fd, Client *client) {
-  close(client->cgi.output_fd);
+// whether the script is known to have exited with an error
+static bool cgi_failed(Client *client) {
+  int wait_status;
+
+  if (waitpid(client->cgi.pid, &wait_status, WNOHANG) != client->cgi.pid)
+    return false;
+  client->cgi.pid = -1;
+  if (WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0)
+    return false;
+  LOG_STREAM(ERROR, "CGI: Child process failed: "
+                        << (WIFEXITED(wait_status)
+                                ? int_to_string(WEXITSTATUS(wait_status))
+                                : "abnormal termination"));
+  return true;
+}
+
+// stops reading the script while the client has a full buffer of its
+// output queued. the pipe leaves epoll, a hung up pipe would be reported
+// even without events
+static void pause_cgi(int epoll_fd, Client *client) {
   if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->cgi.pipe_fd, NULL) == -1)
     LOG_STREAM(WARNING, "epoll_ctl: " << strerror(errno));
-  close(client->cgi.pipe_fd);
-  kill(client->cgi.pid, SIGTERM);
-  remove(client->cgi.output_file.c_str());
-  cgi_to_client.erase(client->cgi.pipe_fd);
+  client->cgi.paused = true;
 }
 
-int prepare_cgi_response(int epoll_fd, Client *client, bool check) {
-  if (check) {
-    int wait_status;
-    pid_t wait_result = waitpid(client->cgi.pid, &wait_status, WNOHANG);
-    if (wait_result == client->cgi.pid) {
-      client->cgi.pid = -1;
-      if (!WIFEXITED(wait_status) || WEXITSTATUS(wait_status) != 0) {
-        LOG_STREAM(ERROR, "CGI: Child process failed: "
-                              << (WIFEXITED(wait_status)
-                                      ? int_to_string(WEXITSTATUS(wait_status))
-                                      : "abnormal termination"));
-        cgi_cleanup(epoll_fd, client);
-        return 502;
-      }
-    } else if (wait_result == -1) {
-      LOG_STREAM(ERROR, "CGI: waitpid failed: " << strerror(errno));
-      cgi_cleanup(epoll_fd, client);
-      return 503;
-    }
-  }
+// reads the script again once the client took most of its output
+void resume_cgi(int epoll_fd, Client *client) {
+  struct epoll_event ev;
 
-  close(client->cgi.output_fd);
-  if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->cgi.pipe_fd, NULL) == -1)
+  ev.events = EPOLLIN;
+  ev.data.fd = client->cgi.pipe_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->cgi.pipe_fd, &ev) == -1)
     LOG_STREAM(WARNING, "epoll_ctl: " << strerror(errno));
-  close(client->cgi.pipe_fd);
-  cgi_to_client.erase(client->cgi.pipe_fd);
+  client->cgi.paused = false;
+  client->cgi.start = std::time(NULL);
+}
 
-  if (!client->cgi.data_received) {
-    LOG_STREAM(ERROR, "CGI: No data received from child process");
-    remove(client->cgi.output_file.c_str());
+// the script closed its output
+static int end_cgi_output(int epoll_fd, Client *client) {
+  bool streaming = client->cgi.streaming;
+  bool failed = cgi_failed(client);
+
+  // complete once the script exited without an error
+  if (streaming && !failed)
+    cgi_cache.store(*client);
+  cgi_cleanup(epoll_fd, client);
+  if (!streaming) {
+    LOG_STREAM(ERROR, (client->cgi.header.empty()
+                           ? "CGI: No data received from child process"
+                           : "CGI: Invalid output format"));
     return 502;
   }
+  if (failed)
+    cut_cgi_response(client);
+  else
+    forward_cgi_body(client, NULL, 0, true);
+  client->clear_cgi();
+  return 0;
+}
 
-  std::ifstream cgi_output_file(client->cgi.output_file.c_str(),
-                                std::ios::binary);
-  if (!cgi_output_file) {
-    LOG_STREAM(ERROR, "CGI: Failed to read temp file");
-    remove(client->cgi.output_file.c_str());
-    return 503;
+// reads what the script wrote so far. its header block is kept until
+// complete, the body is queued on the client straight away
+static int read_cgi_output(int epoll_fd, Client *client) {
+  char buffer[CGI_READ_SIZE];
+  ssize_t bytes_read = read(client->cgi.pipe_fd, buffer, sizeof(buffer));
+
+  if (bytes_read < 0) {
+    if (errno == EAGAIN)
+      return -1;
+    LOG_STREAM(ERROR, "CGI: Read from output pipe failed: " << strerror(errno));
+    stop_cgi(epoll_fd, client);
+    if (!client->cgi.streaming)
+      return 500;
+    cut_cgi_response(client);
+    client->clear_cgi();
+    return 0;
   }
-  std::stringstream cgi_output;
-  cgi_output << cgi_output_file.rdbuf();
-  cgi_output_file.close();
-  remove(client->cgi.output_file.c_str());
+  if (bytes_read == 0)
+    return end_cgi_output(epoll_fd, client);
 
-  std::string cgi_content = cgi_output.str();
-  size_t header_end = cgi_content.find("\r\n\r\n");
-  if (header_end == std::string::npos) {
-    LOG_STREAM(ERROR, "CGI: Invalid output format");
-    return 502;
+  client->cgi.start = std::time(NULL);
+  client->last_time = client->cgi.start;
+  if (client->cgi.streaming) {
+    forward_cgi_body(client, buffer, bytes_read, false);
+  } else {
+    std::string &header = client->cgi.header;
+    header.append(buffer, bytes_read);
+    size_t header_end = header.find("\r\n\r\n");
+    if (header_end == std::string::npos) {
+      if (header.size() <= CGI_HEADER_MAX)
+        return -1;
+      LOG_STREAM(ERROR, "CGI: Header block too large");
+      stop_cgi(epoll_fd, client);
+      return 502;
+    }
+    std::string cgi_headers = header.substr(0, header_end);
+    int status = serve_internal_redirect(*client, cgi_headers);
+    if (status != -1) {
+      // the script's body is not wanted, it sees a closed pipe if it
+      // still writes
+      cgi_cleanup(epoll_fd, client);
+      client->clear_cgi();
+      return status;
+    }
+    start_cgi_response(client, cgi_headers);
+    forward_cgi_body(client, header.data() + header_end + 4,
+                     header.size() - header_end - 4, false);
+    std::string().swap(header);
   }
+  // also while the body is received: the output is sent meanwhile, and
+  // the body waits while the script is blocked writing
+  if (client->pending_bytes() >= CGI_OUTPUT_BUFFERED)
+    pause_cgi(epoll_fd, client);
+  return 0;
+}
 
-  std::string cgi_headers = cgi_content.substr(0, header_end);
-  std::string cgi_body = cgi_content.substr(header_end + 4);
-  std::string http_status = "200 OK";
+// registers the script's stdin for EPOLLOUT while it can't take more
+static void set_input_blocked(int epoll_fd, Client *client, bool on) {
+  struct epoll_event ev;
 
-  bool has_content_length = false;
-  std::istringstream header_stream(cgi_headers);
-  std::string line;
+  if (client->cgi.input_blocked == on)
+    return;
+  ev.events = 0;
+  if (on)
+    ev.events = EPOLLOUT;
+  ev.data.fd = client->cgi.in_pipe_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->cgi.in_pipe_fd, &ev) == -1)
+    LOG_STREAM(WARNING, "epoll_ctl: " << strerror(errno));
+  client->cgi.input_blocked = on;
+}
 
-  while (std::getline(header_stream, line) && !line.empty() && line != "\r") {
-    std::string::size_type colon_pos = line.find(':');
-    if (colon_pos == std::string::npos)
-      continue;
+// closes the script's stdin once its body is written, or early when the
+// script stopped reading it. the rest of the body is then dropped
+static void close_cgi_input(int epoll_fd, Client *client) {
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->cgi.in_pipe_fd, NULL) == -1)
+    LOG_STREAM(WARNING, "epoll_ctl: " << strerror(errno));
+  cgi_to_client.erase(client->cgi.in_pipe_fd);
+  close(client->cgi.in_pipe_fd);
+  client->cgi.in_pipe_fd = -1;
+  close(client->cgi.body_fd);
+  client->cgi.body_fd = -1;
+  std::string().swap(client->cgi.input);
+  client->cgi.input_blocked = false;
+  if (client->cgi.input_paused)
+    set_body_reading(epoll_fd, client, true);
+  // the script's timeout starts with its whole input
+  client->cgi.start = std::time(NULL);
+}
 
-    std::string key = to_lower(line.substr(0, colon_pos));
-    std::string value = header_trim(line.substr(colon_pos + 1));
+// writes what the script's stdin takes of the body, the bytes received so
+// far or the body file. the socket stops being read while a buffer of the
+// body waits on the script. returns false on an error
+bool write_cgi_input(int epoll_fd, Client *client) {
+  CGI &cgi = client->cgi;
+  HttpRequest *request = client->get_request();
 
-    if (key == "status") {
-      http_status = value;
-    } else if (key == "content-length") {
-      has_content_length = true;
+  if (cgi.in_pipe_fd == -1) {
+    cgi.input.clear();
+    return true;
+  }
+  for (;;) {
+    if (cgi.input.empty() && cgi.body_fd != -1) {
+      char buffer[CGI_READ_SIZE];
+      ssize_t bytes_read = read(cgi.body_fd, buffer, sizeof(buffer));
+      if (bytes_read < 0) {
+        LOG_STREAM(ERROR,
+                   "CGI: Read from body file failed: " << strerror(errno));
+        return false;
+      }
+      if (bytes_read == 0) {
+        close(cgi.body_fd);
+        cgi.body_fd = -1;
+      }
+      cgi.input.append(buffer, bytes_read);
+    }
+    if (cgi.input.empty())
+      break;
+    ssize_t written = write(cgi.in_pipe_fd, cgi.input.data(), cgi.input.size());
+    if (written < 0 && errno == EAGAIN)
+      break;
+    if (written < 0 && errno == EPIPE) {
+      LOG(WARNING, "CGI: script closed its input before the end of the body");
+      close_cgi_input(epoll_fd, client);
+      return true;
     }
+    if (written < 0) {
+      LOG_STREAM(ERROR, "CGI: Write to input pipe failed: " << strerror(errno));
+      return false;
+    }
+    cgi.input.erase(0, written);
+    // the pipe took all of it, splice may find room again
+    if (cgi.input.empty())
+      cgi.splice_full = false;
   }
-  std::stringstream response_stream;
-  response_stream << "HTTP/1.1 " << http_status << "\r\n"
-                  << get_server_header() + get_date_header() << cgi_headers
-                  << "\r\n";
-  if (!has_content_length)
-    response_stream << "content-length: " << cgi_body.size() << "\r\n";
 
-  response_stream << "\r\n" << cgi_body;
+  if (cgi.input.empty() && cgi.body_fd == -1 && request &&
+      request->request_is_ready()) {
+    close_cgi_input(epoll_fd, client);
+    return true;
+  }
+  set_input_blocked(epoll_fd, client, !cgi.input.empty());
+  if (request && !request->request_is_ready() &&
+      cgi.input_paused != (cgi.input.size() >= CGI_INPUT_BUFFERED))
+    set_body_reading(epoll_fd, client, cgi.input_paused);
+  return true;
+}
 
-  client->response = response_stream.str();
-  client->clear_cgi();
-  return 0;
+// whether the next body bytes can go from the socket to the script's
+// stdin without passing through the server: a Content-Length body, with
+// nothing received ahead of them
+bool can_splice_cgi_input(Client *client) {
+  HttpRequest *request = client->get_request();
+
+  return request && request->body_sink && client->cgi.in_pipe_fd != -1 &&
+         client->cgi.input.empty() && !client->cgi.splice_full &&
+         client->remaining_from_last_request.empty() &&
+         !request->request_is_ready() && !request->use_transfer_encoding();
 }
 
-int handle_cgi(int epoll_fd, Client *client, uint32_t actions) {
-  char buffer[4096] = {0};
-  ssize_t bytes_read;
-  ssize_t written;
-  ssize_t ret;
+// moves body bytes from the socket into the script's stdin with splice.
+// a full pipe stops the socket being read until the script catches up
+void splice_cgi_input(int epoll_fd, Client *client) {
+  HttpRequest *request = client->get_request();
+  size_t left = request->get_content_len() - request->get_body_len();
+  ssize_t moved = splice(client->get_socket(), NULL, client->cgi.in_pipe_fd,
+                         NULL, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 
-  if (actions & EPOLLERR) {
-    LOG(ERROR, "epoll: pipe error");
-    cgi_cleanup(epoll_fd, client);
-    return 500;
+  if (moved > 0) {
+    request->body_spliced(moved);
+    client->cgi.start = std::time(NULL);
+  } else if (moved == 0) {
+    LOG_STREAM(INFO, "Client " << client->get_socket() << " disconnected");
+    client->connected = false;
+  } else if (errno == EAGAIN) {
+    // the socket was readable, so the pipe has no room for the socket's
+    // pages. it may still take written bytes and report EPOLLOUT, so the
+    // body goes through input until the pipe takes all of it
+    client->cgi.splice_full = true;
+  } else if (errno == EPIPE) {
+    LOG(WARNING, "CGI: script closed its input before the end of the body");
+    close_cgi_input(epoll_fd, client);
+  } else {
+    LOG_STREAM(ERROR, "splice: " << strerror(errno));
+    client->connected = false;
   }
+}
 
-  if (actions & EPOLLHUP) {
-    int wait_status;
-    pid_t wait_result = waitpid(client->cgi.pid, &wait_status, WNOHANG);
-    if (wait_result == client->cgi.pid) {
-      client->cgi.pid = -1;
-      if (!WIFEXITED(wait_status) || WEXITSTATUS(wait_status) != 0) {
-        LOG_STREAM(ERROR, "CGI: Child process failed: "
-                              << (WIFEXITED(wait_status)
-                                      ? int_to_string(WEXITSTATUS(wait_status))
-                                      : "abnormal termination"));
-        cgi_cleanup(epoll_fd, client);
-        return 502;
-      }
-    } else if (wait_result == -1) {
-      LOG_STREAM(ERROR, "CGI: waitpid failed: " << strerror(errno));
-      cgi_cleanup(epoll_fd, client);
-      return 503;
-    }
-    return prepare_cgi_response(epoll_fd, client, false);
-  }
-
-  if (actions & EPOLLOUT && client->cgi.body_fd != -1) {
-    bytes_read = read(client->cgi.body_fd, buffer, sizeof(buffer));
-    if (bytes_read > 0) {
-      written = 0;
-      while (written < bytes_read) {
-        ret = write(client->cgi.in_pipe_fd, buffer, bytes_read);
-        if (ret < 0) {
-          LOG_STREAM(ERROR,
-                     "CGI: Write to input pipe failed: " << strerror(errno));
-
-          if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->cgi.in_pipe_fd,
-                        NULL) == -1)
-            LOG_STREAM(WARNING, "epoll_ctl: " << strerror(errno));
-          kill(client->cgi.pid, SIGTERM);
-          if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->cgi.in_pipe_fd,
-                        NULL) == -1)
-            LOG_STREAM(WARNING, "epoll_ctl: " << strerror(errno));
-          close(client->cgi.in_pipe_fd);
-          close(client->cgi.pipe_fd);
-          close(client->cgi.body_fd);
-          close(client->cgi.output_fd);
-          remove(client->cgi.output_file.c_str());
-          cgi_to_client.erase(client->cgi.in_pipe_fd);
-          return 503;
-        }
-        written += ret;
-      }
+// events of the pipes to and from a script. returns -1 when there is
+// nothing new for the client, 0 when it has output to send, or the
+// status of an error response
+int handle_cgi(int epoll_fd, Client *client, int fd, uint32_t actions) {
+  if (fd == client->cgi.in_pipe_fd) {
+    // EPOLLERR on a pipe's write end: the script closed its stdin
+    if (actions & EPOLLERR) {
+      close_cgi_input(epoll_fd, client);
       return -1;
-    } else if (bytes_read < 0) {
-      LOG_STREAM(ERROR, "CGI: Read from body file failed: " << strerror(errno));
-      if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->cgi.in_pipe_fd, NULL) ==
-          -1)
-        LOG_STREAM(WARNING, "epoll_ctl: " << strerror(errno));
-      kill(client->cgi.pid, SIGTERM);
-      if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->cgi.in_pipe_fd, NULL) ==
-          -1)
-        LOG_STREAM(WARNING, "epoll_ctl: " << strerror(errno));
-      close(client->cgi.in_pipe_fd);
-      close(client->cgi.pipe_fd);
-      close(client->cgi.body_fd);
-      close(client->cgi.output_fd);
-      remove(client->cgi.output_file.c_str());
-      cgi_to_client.erase(client->cgi.in_pipe_fd);
-      return 500;
-    } else {
-      if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->cgi.in_pipe_fd, NULL) ==
-          -1)
-        LOG_STREAM(WARNING, "epoll_ctl: " << strerror(errno));
-      close(client->cgi.in_pipe_fd);
-      close(client->cgi.body_fd);
-      client->cgi.in_pipe_fd = -1;
-      client->cgi.body_fd = -1;
-      cgi_to_client.erase(client->cgi.in_pipe_fd);
-
-      struct epoll_event ev;
-      ev.events = EPOLLIN;
-      ev.data.fd = client->cgi.pipe_fd;
-      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->cgi.pipe_fd, &ev) == -1) {
-        LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
-        kill(client->cgi.pid, SIGTERM);
-        close(client->cgi.pipe_fd);
-        return 500;
-      }
-      client->cgi.start = std::time(NULL);
-      cgi_to_client[client->cgi.pipe_fd] = client;
     }
-    return -1;
-  } else if (actions & EPOLLIN) {
-    bytes_read = read(client->cgi.pipe_fd, buffer, sizeof(buffer));
-    if (bytes_read > 0) {
-      client->cgi.data_received = true;
-      written = 0;
-      while (written < bytes_read) {
-        ret = write(client->cgi.output_fd, buffer, bytes_read);
-        if (ret < 0) {
-          LOG_STREAM(ERROR,
-                     "CGI: Write to temp file failed: " << strerror(errno));
-          in_cgi_cleanup(epoll_fd, client);
-          return 503;
-        }
-        written += ret;
-      }
+    if (write_cgi_input(epoll_fd, client))
       return -1;
-    } else if (bytes_read < 0) {
-      LOG_STREAM(ERROR,
-                 "CGI: Read from output pipe failed: " << strerror(errno));
-      in_cgi_cleanup(epoll_fd, client);
+    stop_cgi(epoll_fd, client);
+    if (!client->cgi.streaming)
       return 500;
-    } else {
-      return prepare_cgi_response(epoll_fd, client, true);
-    }
+    cut_cgi_response(client);
+    client->clear_cgi();
+    return 0;
+  }
+
+  if (actions & EPOLLERR) {
+    LOG(ERROR, "epoll: pipe error");
+    stop_cgi(epoll_fd, client);
+    if (!client->cgi.streaming)
+      return 500;
+    cut_cgi_response(client);
+    client->clear_cgi();
+    return 0;
   }
+  // a hung up pipe is read to its end, the script may exit before its
+  // last output is taken
+  if (actions & (EPOLLIN | EPOLLHUP))
+    return read_cgi_output(epoll_fd, client);
   return -1;
 }
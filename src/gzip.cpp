@@ -0,0 +1,237 @@
+#include "../include/gzip.hpp"
+
+#define WINDOW_SIZE 32768
+#define WINDOW_MASK (WINDOW_SIZE - 1)
+#define HASH_BITS 13
+#define HASH_SIZE (1 << HASH_BITS)
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+// a 3 byte match this far back costs more than the literals it replaces
+#define TOO_FAR 4096
+// positions are kept as window index + 1 in 16 bits, the window holds
+// the history plus at most one slice of new input
+#define SLICE_SIZE (65535 - WINDOW_SIZE)
+
+static const unsigned short LENGTH_BASE[] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char LENGTH_EXTRA[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                             1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                             4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short DIST_BASE[] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char DIST_EXTRA[] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                           4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                           9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const size_t CHAIN_BY_LEVEL[] = {4,   8,   16,   32,  64,
+                                        128, 256, 1024, 4096};
+
+static uint32_t crc32_update(uint32_t crc, const char *data, size_t len) {
+  static uint32_t table[256];
+  static bool table_ready = false;
+
+  if (!table_ready) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k)
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+    table_ready = true;
+  }
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i)
+    crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static void put_le32(uint32_t value, std::string &out) {
+  for (int i = 0; i < 4; ++i)
+    out += static_cast<char>((value >> (8 * i)) & 0xff);
+}
+
+GzipStream::GzipStream(int level)
+    : head(HASH_SIZE, 0), prev(WINDOW_SIZE, 0), base(0), bit_buffer(0),
+      bit_count(0), crc(0), total_in(0), started(false) {
+  if (level < 1)
+    level = 1;
+  if (level > 9)
+    level = 9;
+  max_chain = CHAIN_BY_LEVEL[level - 1];
+}
+
+// gzip member header, then the single final block using fixed codes
+void GzipStream::start(std::string &out) {
+  static const char header[] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+  out.append(header, sizeof(header));
+  put_bits(1, 1, out); // BFINAL
+  put_bits(1, 2, out); // BTYPE 01
+  started = true;
+}
+
+// deflate packs bits starting from the least significant one
+void GzipStream::put_bits(unsigned long value, int count, std::string &out) {
+  bit_buffer |= value << bit_count;
+  bit_count += count;
+  while (bit_count >= 8) {
+    out += static_cast<char>(bit_buffer & 0xff);
+    bit_buffer >>= 8;
+    bit_count -= 8;
+  }
+}
+
+// huffman codes go out most significant bit first
+void GzipStream::put_code(unsigned code, int len, std::string &out) {
+  unsigned reversed = 0;
+  for (int i = 0; i < len; ++i) {
+    reversed = (reversed << 1) | (code & 1);
+    code >>= 1;
+  }
+  put_bits(reversed, len, out);
+}
+
+void GzipStream::put_symbol(unsigned symbol, std::string &out) {
+  if (symbol < 144)
+    put_code(0x30 + symbol, 8, out);
+  else if (symbol < 256)
+    put_code(0x190 + symbol - 144, 9, out);
+  else if (symbol < 280)
+    put_code(symbol - 256, 7, out);
+  else
+    put_code(0xc0 + symbol - 280, 8, out);
+}
+
+void GzipStream::put_match(size_t length, size_t distance, std::string &out) {
+  int code = 28;
+  while (LENGTH_BASE[code] > length)
+    code--;
+  put_symbol(257 + code, out);
+  put_bits(length - LENGTH_BASE[code], LENGTH_EXTRA[code], out);
+
+  code = 29;
+  while (DIST_BASE[code] > distance)
+    code--;
+  put_code(code, 5, out);
+  put_bits(distance - DIST_BASE[code], DIST_EXTRA[code], out);
+}
+
+static unsigned hash3(const char *p) {
+  uint32_t v = (static_cast<unsigned char>(p[0]) << 16) |
+               (static_cast<unsigned char>(p[1]) << 8) |
+               static_cast<unsigned char>(p[2]);
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+void GzipStream::insert(size_t pos) {
+  unsigned h = hash3(window.data() + pos);
+  prev[(base + pos) & WINDOW_MASK] = head[h];
+  head[h] = pos + 1;
+}
+
+// walks the hash chain of pos, returns the best match length (0 if none)
+size_t GzipStream::longest_match(size_t pos, size_t &distance) {
+  const char *data = window.data();
+  size_t limit = std::min(window.size() - pos, (size_t)MAX_MATCH);
+  size_t best = 0;
+  size_t chain = max_chain;
+  size_t candidate = head[hash3(data + pos)];
+
+  while (candidate && chain--) {
+    size_t match = candidate - 1;
+    if (pos - match > WINDOW_SIZE)
+      break;
+    if (data[match + best] == data[pos + best]) {
+      size_t len = 0;
+      while (len < limit && data[match + len] == data[pos + len])
+        len++;
+      if (len > best) {
+        best = len;
+        distance = pos - match;
+        if (len == limit)
+          break;
+      }
+    }
+    size_t next = prev[(base + match) & WINDOW_MASK];
+    // stale slots may point forward, the chain ends there
+    if (next >= candidate)
+      break;
+    candidate = next;
+  }
+  if (best < MIN_MATCH || (best == MIN_MATCH && distance > TOO_FAR))
+    return 0;
+  return best;
+}
+
+void GzipStream::deflate_slice(size_t start, std::string &out) {
+  size_t end = window.size();
+  size_t pos = start;
+
+  while (pos < end) {
+    size_t distance = 0;
+    size_t len = pos + MIN_MATCH <= end ? longest_match(pos, distance) : 0;
+    if (len) {
+      put_match(len, distance, out);
+      for (size_t i = pos; i < pos + len && i + MIN_MATCH <= end; ++i)
+        insert(i);
+      pos += len;
+    } else {
+      put_symbol(static_cast<unsigned char>(window[pos]), out);
+      if (pos + MIN_MATCH <= end)
+        insert(pos);
+      pos++;
+    }
+  }
+}
+
+// drops everything but the last WINDOW_SIZE bytes and rebases positions
+void GzipStream::slide() {
+  if (window.size() <= WINDOW_SIZE)
+    return;
+  size_t shift = window.size() - WINDOW_SIZE;
+  window.erase(0, shift);
+  base += shift;
+  for (size_t i = 0; i < head.size(); ++i)
+    head[i] = head[i] > shift ? head[i] - shift : 0;
+  for (size_t i = 0; i < prev.size(); ++i)
+    prev[i] = prev[i] > shift ? prev[i] - shift : 0;
+}
+
+// appends the compressed form of data to out, a few bits may be held
+// back until the next call
+void GzipStream::compress(const char *data, size_t len, std::string &out) {
+  if (!started)
+    start(out);
+  crc = crc32_update(crc, data, len);
+  total_in += len;
+
+  while (len > 0) {
+    size_t n = std::min(len, (size_t)SLICE_SIZE);
+    size_t start = window.size();
+    window.append(data, n);
+    deflate_slice(start, out);
+    slide();
+    data += n;
+    len -= n;
+  }
+}
+
+// ends the block and appends the gzip trailer
+void GzipStream::finish(std::string &out) {
+  if (!started)
+    start(out);
+  put_symbol(256, out);
+  if (bit_count > 0)
+    put_bits(0, 8 - bit_count, out);
+  put_le32(crc, out);
+  put_le32(total_in, out);
+}
+
+std::string gzip_string(const std::string &data, int level) {
+  GzipStream stream(level);
+  std::string out;
+  stream.compress(data.data(), data.size(), out);
+  stream.finish(out);
+  return out;
+}
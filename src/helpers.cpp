@@ -52,6 +52,8 @@ std::string httpversion_to_string(HTTP_VERSION method) {
   switch (method) {
     case HTTP1:
       return "HTTP1";
+    case HTTP10:
+      return "HTTP10";
   }
   return "not suppose to be reached";
 }
@@ -140,47 +142,57 @@ std::string decode_url(const std::string& encoded) {
     return decoded;
 }
 
-std::string replace_first(const std::string& str, const std::string& old_sub, const std::string& new_sub) {
-    if (old_sub.empty()) {
-        return new_sub + str;
-    }
+// drops the last segment of out when it is "." or "..", the latter also
+// removing its parent. returns false for a regular segment
+static bool resolve_dot_segment(std::string& out) {
+    size_t seg = out.rfind('/') + 1;
+    size_t seg_len = out.size() - seg;
 
-    size_t pos = str.find(old_sub);
-    if (pos == std::string::npos) {
-        return str;  // No match found
+    if (seg_len == 1 && out[seg] == '.') {
+        out.resize(seg);
+        return true;
     }
-
-    return str.substr(0, pos) + new_sub + str.substr(pos + old_sub.size());
-}
-
-std::string clean_path(const std::string url) {
-    std::string clean = url;
-    while (clean != replace_first(clean, "//", "/")) {
-        clean = replace_first(clean, "//", "/");
+    if (seg_len == 2 && out[seg] == '.' && out[seg + 1] == '.') {
+        out.resize(seg);
+        if (seg > 1)
+            out.resize(out.rfind('/', seg - 2) + 1);
+        return true;
     }
+    return false;
+}
 
-    std::vector<std::string> parts = split(clean, '/');
-    std::vector<std::string> clean_parts = std::vector<std::string>();
-    
-    for (size_t i = 0; i < parts.size(); i++) {
-        if (parts[i] == "..") {
-            if (!clean_parts.empty())
-                clean_parts.pop_back();
-        } else {
-            clean_parts.push_back(parts[i]);
+// decodes %XX escapes, collapses repeated slashes and resolves "." and ".."
+// segments in a single pass over the raw path.
+// ".." never climbs above the root, and a trailing slash is kept only when
+// the raw path ends with one (a decoded %2F counts as a slash)
+std::string normalize_path(const std::string& raw) {
+    std::string out;
+    out.reserve(raw.size() + 1);
+    out += '/';
+
+    bool trailing_slash = false;
+    for (size_t i = 0; i < raw.size(); ++i) {
+        char c = raw[i];
+        if (c == '%' && i + 2 < raw.size() &&
+            std::isxdigit(static_cast<unsigned char>(raw[i + 1])) &&
+            std::isxdigit(static_cast<unsigned char>(raw[i + 2]))) {
+            c = static_cast<char>((hex_char_to_value(raw[i + 1]) << 4) |
+                                  hex_char_to_value(raw[i + 2]));
+            i += 2;
         }
-    }
 
-    clean = join(clean_parts, "/");
-
-    while (clean != replace_first(clean, "./", "")) {
-        clean = replace_first(clean, "./", "");
+        trailing_slash = (c == '/');
+        if (c != '/')
+            out += c;
+        else if (out[out.size() - 1] != '/' && !resolve_dot_segment(out))
+            out += '/';
     }
 
-    if (clean[0] != '/')
-        clean = "/" + clean;
-
-    return clean;
+    if (out[out.size() - 1] != '/')
+        resolve_dot_segment(out);
+    if (!trailing_slash && out.size() > 1 && out[out.size() - 1] == '/')
+        out.resize(out.size() - 1);
+    return out;
 }
 
 
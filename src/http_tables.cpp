@@ -0,0 +1,236 @@
+#include "../include/webserv.hpp"
+
+#define HTTP_VERSION "HTTP/1.1"
+
+#define STATUS_MIN 100
+#define STATUS_MAX 599
+// open addressing table of the known extensions, sized so that a seed
+// giving every extension its own slot is found quickly
+#define MIME_SLOTS 256
+#define MIME_MAX_EXT 8
+
+struct StatusEntry {
+  int code;
+  const char *phrase;
+};
+
+struct MimeEntry {
+  const char *ext;
+  const char *type;
+};
+
+static const StatusEntry STATUS_TABLE[] = {
+    // 1xx (Informational): The request was received, continuing process
+    {100, "Continue"},
+    {101, "Switching Protocols"},
+    {102, "Processing"},
+    {103, "Early Hints"},
+
+    // 2xx (Successful): The request was successfully received, understood,
+    // and accepted
+    {200, "OK"},
+    {201, "Created"},
+    {202, "Accepted"},
+    {203, "Non-Authoritative Information"},
+    {204, "No Content"},
+    {205, "Reset Content"},
+    {206, "Partial Content"},
+    {207, "Multi-Status"},
+    {208, "Already Reported"},
+    {226, "IM Used"},
+
+    // 3xx (Redirection): Further action needs to be taken in order to
+    // complete the request
+    {300, "Multiple Choices"},
+    {301, "Moved Permanently"},
+    {302, "Found"},
+    {303, "See Other"},
+    {304, "Not Modified"},
+    {305, "Use Proxy"},
+    {307, "Temporary Redirect"},
+    {308, "Permanent Redirect"},
+
+    // 4xx (Client Error): The request contains bad syntax or cannot be
+    // fulfilled
+    {400, "Bad Request"},
+    {401, "Unauthorized"},
+    {403, "Forbidden"},
+    {404, "Not Found"},
+    {405, "Method Not Allowed"},
+    {406, "Not Acceptable"},
+    {407, "Proxy Authentication Required"},
+    {408, "Request Timeout"},
+    {409, "Conflict"},
+    {410, "Gone"},
+    {411, "Length Required"},
+    {412, "Precondition Failed"},
+    {413, "Payload Too Large"},
+    {414, "URI Too Long"},
+    {415, "Unsupported Media Type"},
+    {416, "Range Not Satisfiable"},
+    {417, "Expectation Failed"},
+    {418, "I'm a teapot"},
+    {421, "Misdirected Request"},
+    {422, "Unprocessable Entity"},
+    {423, "Locked"},
+    {424, "Failed Dependency"},
+    {425, "Too Early"},
+    {426, "Upgrade Required"},
+    {428, "Precondition Required"},
+    {429, "Too Many Requests"},
+    {431, "Request Header Fields Too Large"},
+    {451, "Unavailable For Legal Reasons"},
+
+    // 5xx (Server Error): The server failed to fulfill an apparently valid
+    // request
+    {500, "Internal Server Error"},
+    {501, "Not Implemented"},
+    {502, "Bad Gateway"},
+    {503, "Service Unavailable"},
+    {504, "Gateway Timeout"},
+    {505, "HTTP Version Not Supported"},
+    {506, "Variant Also Negotiates"},
+    {507, "Insufficient Storage"},
+    {508, "Loop Detected"},
+    {510, "Not Extended"},
+    {511, "Network Authentication Required"},
+};
+
+static const MimeEntry MIME_TABLE[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"txt", "text/plain"},
+    {"csv", "text/csv"},
+    {"md", "text/markdown"},
+    {"css", "text/css"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"png", "image/png"},
+    {"gif", "image/gif"},
+    {"bmp", "image/bmp"},
+    {"svg", "image/svg+xml"},
+    {"webp", "image/webp"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+    {"ogg", "audio/ogg"},
+    {"mp3", "audio/mpeg"},
+    {"wav", "audio/wav"},
+    {"pdf", "application/pdf"},
+    {"doc", "application/msword"},
+    {"docx", "application/"
+             "vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    {"xls", "application/vnd.ms-excel"},
+    {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    {"ppt", "application/vnd.ms-powerpoint"},
+    {"pptx", "application/"
+             "vnd.openxmlformats-officedocument.presentationml.presentation"},
+    {"zip", "application/zip"},
+    {"tar", "application/x-tar"},
+    {"gz", "application/gzip"},
+    {"rar", "application/vnd.rar"},
+    {"7z", "application/x-7z-compressed"},
+    {"json", "application/json"},
+    {"xml", "application/xml"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"js", "application/javascript"},
+};
+
+#define TABLE_SIZE(table) (sizeof(table) / sizeof(table[0]))
+
+// full status lines, indexed by code - STATUS_MIN. built on first use,
+// unknown codes are left empty
+static const std::vector<std::string> &status_lines() {
+  static std::vector<std::string> lines;
+
+  if (lines.empty()) {
+    lines.resize(STATUS_MAX - STATUS_MIN + 1);
+    for (size_t i = 0; i < TABLE_SIZE(STATUS_TABLE); ++i) {
+      std::string &line = lines[STATUS_TABLE[i].code - STATUS_MIN];
+      line = HTTP_VERSION " ";
+      append_number(line, STATUS_TABLE[i].code);
+      line += ' ';
+      line += STATUS_TABLE[i].phrase;
+      line += CRLF;
+    }
+  }
+  return lines;
+}
+
+const std::string &get_status_line(int status_code) {
+  static const std::string empty;
+
+  if (status_code < STATUS_MIN || status_code > STATUS_MAX)
+    return empty;
+  return status_lines()[status_code - STATUS_MIN];
+}
+
+const char *get_status_code_phrase(int code) {
+  for (size_t i = 0; i < TABLE_SIZE(STATUS_TABLE); ++i) {
+    if (STATUS_TABLE[i].code == code)
+      return STATUS_TABLE[i].phrase;
+  }
+  return "Unknown";
+}
+
+static unsigned mime_hash(const char *ext, size_t len, unsigned seed) {
+  unsigned h = seed;
+  for (size_t i = 0; i < len; ++i)
+    h = (h ^ static_cast<unsigned char>(ext[i])) * 16777619u;
+  return h % MIME_SLOTS;
+}
+
+// perfect hash of the extension table: the seed is searched once so that
+// every extension lands in a slot of its own, a lookup is then one hash
+// and one comparison
+class MimeIndex {
+private:
+  unsigned seed;
+  short slots[MIME_SLOTS];
+
+  bool try_seed(unsigned candidate) {
+    for (size_t i = 0; i < MIME_SLOTS; ++i)
+      slots[i] = -1;
+    for (size_t i = 0; i < TABLE_SIZE(MIME_TABLE); ++i) {
+      const char *ext = MIME_TABLE[i].ext;
+      unsigned h = mime_hash(ext, strlen(ext), candidate);
+      if (slots[h] != -1)
+        return false;
+      slots[h] = i;
+    }
+    seed = candidate;
+    return true;
+  }
+
+public:
+  MimeIndex() : seed(0) {
+    unsigned candidate = 2166136261u;
+    while (!try_seed(candidate))
+      candidate++;
+  }
+
+  const char *find(const char *ext, size_t len) const {
+    int i = slots[mime_hash(ext, len, seed)];
+    if (i == -1 || strlen(MIME_TABLE[i].ext) != len ||
+        memcmp(MIME_TABLE[i].ext, ext, len))
+      return NULL;
+    return MIME_TABLE[i].type;
+  }
+};
+
+const char *find_mime_type(const std::string &filepath) {
+  static const MimeIndex index;
+
+  size_t dot_pos = filepath.find_last_of('.');
+  if (dot_pos == std::string::npos)
+    return NULL;
+  size_t len = filepath.size() - dot_pos - 1;
+  if (len == 0 || len > MIME_MAX_EXT)
+    return NULL;
+  char ext[MIME_MAX_EXT];
+  for (size_t i = 0; i < len; ++i)
+    ext[i] = std::tolower(static_cast<unsigned char>(filepath[dot_pos + 1 + i]));
+  return index.find(ext, len);
+}
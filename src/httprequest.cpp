@@ -2,14 +2,17 @@
 
 #include "../include/errors.hpp"
 #include "../include/helpers.hpp"
+#include "../include/multipart.hpp"
 #include "../include/parser.hpp"
 
 HttpRequest::HttpRequest()
-    : body(std::tmpnam(NULL)), method(NONE), body_parsed(false), body_len(0),
+    : body(std::tmpnam(NULL)), method(NONE), http_version(HTTP1),
+      body_parsed(false), body_len(0),
       body_tmpfile(this->body.c_str(),
                    std::ios::out | std::ios::trunc | std::ios::binary),
-      head_parsed(false), server_conf(NULL), chunk_size(0), max(0),
-      body_created(true) {
+      head_parsed(false), server_conf(NULL), location(NULL),
+      max_body_size(DEFAULT_MAX_BODY_SIZE), chunk_size(0), max(0),
+      body_created(true), body_sink(NULL), multipart(NULL) {
   if (!this->body_tmpfile) {
     throw std::runtime_error("failed to create tmpfile for body");
   }
@@ -18,6 +21,7 @@ HttpRequest::HttpRequest()
 HttpRequest::~HttpRequest() {
   this->body_tmpfile.close(); // should be closed before but just incase
   std::remove(this->body.c_str());
+  delete this->multipart;
 }
 
 HttpRequest *HttpRequest::clone() {
@@ -83,7 +87,9 @@ int HttpRequest::set_method(std::string method) {
 
 int HttpRequest::set_httpversion(std::string version) {
   version = trim(version, "\r\n");
-  if (version == "HTTP/1.0" || version == "HTTP/1.1")
+  if (version == "HTTP/1.0")
+    this->http_version = HTTP10;
+  else if (version == "HTTP/1.1")
     this->http_version = HTTP1;
   else
     return 1;
@@ -182,11 +188,15 @@ HttpHeader *HttpRequest::get_header_by_key(std::string key) {
   throw std::runtime_error("HttpRequest::get_header_by_key: key not found");
 }
 
+const std::vector<HttpHeader> &HttpRequest::get_headers() const {
+  return this->headers;
+}
+
 // return -1 when failed
 ssize_t HttpRequest::get_content_len() {
   try {
     HttpHeader *header = get_header_by_key("content-length");
-    return ft_atoi(header->value.c_str());
+    return std::strtol(header->value.c_str(), NULL, 10);
   } catch (std::exception &e) {
     return -1;
   }
@@ -201,7 +211,7 @@ bool HttpRequest::read_body_loop(std::string &raw_data) {
   } else if (this->use_content_len() &&
              this->body_len < (size_t)this->get_content_len()) {
     push_to_body(raw_data, this->get_content_len());
-    if (this->body_len > this->server_conf->getClientMaxBodySize())
+    if (this->body_len > this->max_body_size)
       throw ParsingError(PAYLOAD_TOO_LARGE, "Too large body");
     if (this->body_len == (size_t)this->get_content_len()) {
       return false;
@@ -264,6 +274,8 @@ bool HttpRequest::handle_transfer_encoded_body(std::string &raw_data) {
       this->chunk_size = std::strtol(size_portion_str.c_str(), NULL, 16) +
                          2; // 2 is for the trailing \r\n
       this->max += this->chunk_size - 2;
+      if (this->max > this->max_body_size)
+        throw ParsingError(PAYLOAD_TOO_LARGE, "body too large");
       raw_data = CONSUME_BEGINNING(raw_data, size_portion_str.size());
       if (raw_data.compare(0, 2, "\r\n"))
         throw ParsingError(BAD_REQUEST, "bad chunk identifier");
@@ -285,7 +297,7 @@ bool HttpRequest::handle_transfer_encoded_body(std::string &raw_data) {
     }
 
 
-    if (this->body_len > this->server_conf->getClientMaxBodySize()) {
+    if (this->body_len > this->max_body_size) {
       throw ParsingError(PAYLOAD_TOO_LARGE, "body too large");
     }
   }
@@ -314,21 +326,26 @@ long getFileSize(FILE *file) {
 }
 
 size_t HttpRequest::push_to_body(std::string &raw_data, size_t max) {
-  ssize_t bytes_pushed;
-  if (this->body_len + raw_data.length() < max) {
-    this->body_tmpfile << raw_data;
-    bytes_pushed = raw_data.length();
-    this->body_len += bytes_pushed;
-    raw_data = CONSUME_BEGINNING(raw_data, bytes_pushed);
-  } else {
-    this->body_tmpfile << raw_data.substr(0, max - this->body_len);
-    raw_data = CONSUME_BEGINNING(raw_data, max - this->body_len);
-    bytes_pushed = max - this->body_len;
-    this->body_len += bytes_pushed;
-  }
+  size_t bytes_pushed = std::min(raw_data.length(), max - this->body_len);
+  if (this->multipart)
+    this->multipart->feed(raw_data.data(), bytes_pushed);
+  else if (this->body_sink)
+    this->body_sink->append(raw_data, 0, bytes_pushed);
+  else
+    this->body_tmpfile.write(raw_data.data(), bytes_pushed);
+  this->body_len += bytes_pushed;
+  raw_data = CONSUME_BEGINNING(raw_data, bytes_pushed);
   return bytes_pushed;
 }
 
+// accounts for Content-Length body bytes moved past the parser, straight
+// from the socket to where the body goes
+void HttpRequest::body_spliced(size_t bytes) {
+  this->body_len += bytes;
+  if (this->body_len == (size_t)this->get_content_len())
+    this->body_parsed = true;
+}
+
 std::fstream &HttpRequest::get_body_tmpfile() { return this->body_tmpfile; }
 
 bool contains_value(const std::map<std::string, int> &map, int value) {
@@ -381,6 +398,22 @@ void HttpRequest::setup_serverconf(std::vector<ServerConfig> &servers_conf,
   throw ParsingError(INTERNAL_SERVER_ERROR, "Fail to find server conf");
 }
 
+// resolves the routed location and its body limit, and rejects an announced
+// body that exceeds it before any of it is read
+void HttpRequest::setup_body_limit() {
+  if (!this->server_conf)
+    return;
+  this->max_body_size = this->server_conf->getClientMaxBodySize();
+  this->location =
+      get_location(this->server_conf->getLocations(), this->path.get_path());
+  if (this->location)
+    this->max_body_size = this->location->client_max_body_size;
+
+  if (!this->use_transfer_encoding() && this->use_content_len() &&
+      (size_t)this->get_content_len() > this->max_body_size)
+    throw ParsingError(PAYLOAD_TOO_LARGE, "Content-Length exceeds limit");
+}
+
 size_t HttpRequest::get_body_len() {
   return this->body_len;
 }
@@ -0,0 +1,232 @@
+#include "../include/multipart.hpp"
+#include "../include/errors.hpp"
+#include "../include/webserv.hpp"
+
+BMHMatcher::BMHMatcher() {
+  for (size_t i = 0; i < 256; ++i)
+    skip[i] = 1;
+}
+
+BMHMatcher::BMHMatcher(const std::string &pattern) : pattern(pattern) {
+  size_t len = pattern.size();
+  for (size_t i = 0; i < 256; ++i)
+    skip[i] = len;
+  for (size_t i = 0; i + 1 < len; ++i)
+    skip[static_cast<unsigned char>(pattern[i])] = len - 1 - i;
+}
+
+// returns the offset of the first match or std::string::npos
+size_t BMHMatcher::find(const char *data, size_t len) const {
+  size_t plen = pattern.size();
+  if (plen == 0 || len < plen)
+    return std::string::npos;
+
+  const char *p = pattern.data();
+  size_t pos = 0;
+  while (pos <= len - plen) {
+    unsigned char last = static_cast<unsigned char>(data[pos + plen - 1]);
+    if (last == static_cast<unsigned char>(p[plen - 1]) &&
+        memcmp(data + pos, p, plen - 1) == 0)
+      return pos;
+    pos += skip[last];
+  }
+  return std::string::npos;
+}
+
+// the body starts with "--boundary" without a leading CRLF,
+// seeding the carry with one lets a single delimiter pattern match it
+MultipartParser::MultipartParser(const std::string &boundary,
+                                 const std::string &upload_store)
+    : state(PREAMBLE), delimiter("\r\n--" + boundary),
+      upload_store(upload_store), carry(CRLF), out_fd(-1), part_index(0),
+      complete(false) {}
+
+MultipartParser::~MultipartParser() {
+  if (!complete)
+    discard();
+  close_part();
+}
+
+void MultipartParser::feed(const char *data, size_t len) {
+  carry.append(data, len);
+
+  while (true) {
+    if (state == PREAMBLE || state == BODY) {
+      size_t pos = delimiter.find(carry.data(), carry.size());
+      if (pos == std::string::npos) {
+        // keep a tail that may hold the start of a delimiter
+        size_t keep = delimiter.size() - 1;
+        if (carry.size() > keep) {
+          if (state == BODY)
+            write_part(carry.data(), carry.size() - keep);
+          carry.erase(0, carry.size() - keep);
+        }
+        return;
+      }
+      if (state == BODY) {
+        write_part(carry.data(), pos);
+        close_part();
+      }
+      carry.erase(0, pos + delimiter.size());
+      state = AFTER_DELIMITER;
+    } else if (state == AFTER_DELIMITER) {
+      if (carry.size() < 2)
+        return;
+      if (!carry.compare(0, 2, "--")) {
+        state = DONE;
+      } else if (!carry.compare(0, 2, CRLF)) {
+        carry.erase(0, 2);
+        state = HEADERS;
+      } else
+        throw ParsingError(BAD_REQUEST, "multipart: bad delimiter");
+    } else if (state == HEADERS) {
+      size_t end;
+      if (!carry.compare(0, 2, CRLF))
+        end = 0;
+      else {
+        end = carry.find("\r\n\r\n");
+        if (end == std::string::npos) {
+          if (carry.size() > MULTIPART_MAX_HEADER_SIZE)
+            throw ParsingError(BAD_REQUEST, "multipart: part header too large");
+          return;
+        }
+        end += 2;
+      }
+      parse_part_headers(carry.substr(0, end));
+      carry.erase(0, end + 2);
+      state = BODY;
+    } else {
+      // epilogue is ignored
+      carry.clear();
+      return;
+    }
+  }
+}
+
+void MultipartParser::finish() {
+  if (state != DONE)
+    throw ParsingError(BAD_REQUEST, "multipart: truncated body");
+  close_part();
+  complete = true;
+}
+
+// remove whatever was written so far, used when the upload fails
+void MultipartParser::discard() {
+  pending.clear();
+  close_part();
+  for (size_t i = 0; i < saved.size(); ++i)
+    remove(saved[i].c_str());
+  saved.clear();
+}
+
+void MultipartParser::parse_part_headers(const std::string &headers) {
+  std::string filename;
+  bool has_filename = false;
+  std::vector<std::string> lines = split(headers, '\n');
+
+  for (size_t i = 0; i < lines.size(); ++i) {
+    std::string::size_type colon = lines[i].find(':');
+    if (colon == std::string::npos)
+      continue;
+    if (to_lower(strip(lines[i].substr(0, colon))) != "content-disposition")
+      continue;
+
+    std::vector<std::string> params = split(lines[i].substr(colon + 1), ';');
+    for (size_t j = 0; j < params.size(); ++j) {
+      std::string param = strip(params[j]);
+      std::string::size_type eq = param.find('=');
+      if (eq == std::string::npos ||
+          to_lower(strip(param.substr(0, eq))) != "filename")
+        continue;
+      filename = strip(param.substr(eq + 1));
+      if (filename.size() >= 2 && filename[0] == '"' &&
+          filename[filename.size() - 1] == '"')
+        filename = filename.substr(1, filename.size() - 2);
+      has_filename = true;
+    }
+  }
+
+  // plain form fields are skipped, only file parts are stored
+  if (has_filename && !filename.empty())
+    open_part_file(filename);
+}
+
+void MultipartParser::open_part_file(const std::string &filename) {
+  std::string ext;
+  std::string::size_type slash = filename.find_last_of("/\\");
+  std::string base =
+      slash == std::string::npos ? filename : filename.substr(slash + 1);
+  std::string::size_type dot = base.find_last_of('.');
+  if (dot != std::string::npos && base.size() - dot - 1 <= 10) {
+    ext = base.substr(dot);
+    for (size_t i = 1; i < ext.size(); ++i) {
+      if (!std::isalnum(static_cast<unsigned char>(ext[i]))) {
+        ext.clear();
+        break;
+      }
+    }
+  }
+
+  std::string path = upload_store + "/file_" + random_string() + "_" +
+                     int_to_string(part_index++) + ext;
+  if (path.length() >= PATH_MAX)
+    throw std::runtime_error("multipart: generated path too long: " + path);
+
+  out_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0)
+    throw std::runtime_error("multipart: error opening " + path + ": " +
+                             strerror(errno));
+  saved.push_back(path);
+}
+
+void MultipartParser::write_part(const char *data, size_t len) {
+  if (out_fd == -1)
+    return;
+  pending.append(data, len);
+  if (pending.size() >= MULTIPART_WRITE_SIZE)
+    flush_part();
+}
+
+void MultipartParser::flush_part() {
+  size_t total_written = 0;
+  while (total_written < pending.size()) {
+    ssize_t bytes_written = write(out_fd, pending.data() + total_written,
+                                  pending.size() - total_written);
+    if (bytes_written < 0)
+      throw std::runtime_error("multipart: write failed: " +
+                               std::string(strerror(errno)));
+    total_written += bytes_written;
+  }
+  pending.clear();
+}
+
+void MultipartParser::close_part() {
+  if (out_fd != -1) {
+    flush_part();
+    close(out_fd);
+  }
+  out_fd = -1;
+}
+
+// returns the boundary of a multipart/form-data content type, or ""
+std::string get_multipart_boundary(const std::string &content_type) {
+  std::vector<std::string> params = split(content_type, ';');
+  if (params.empty() || to_lower(strip(params[0])) != "multipart/form-data")
+    return "";
+
+  for (size_t i = 1; i < params.size(); ++i) {
+    std::string param = strip(params[i]);
+    std::string::size_type eq = param.find('=');
+    if (eq == std::string::npos ||
+        to_lower(strip(param.substr(0, eq))) != "boundary")
+      continue;
+    std::string boundary = strip(param.substr(eq + 1));
+    if (boundary.size() >= 2 && boundary[0] == '"' &&
+        boundary[boundary.size() - 1] == '"')
+      boundary = boundary.substr(1, boundary.size() - 2);
+    if (boundary.empty() || boundary.size() > MULTIPART_MAX_BOUNDARY)
+      return "";
+    return boundary;
+  }
+  return "";
+}
@@ -1,10 +1,16 @@
 
+#include "../include/gzip.hpp"
+#include "../include/DirListing.hpp"
+#include "../include/FastCGI.hpp"
+#include "../include/CgiCache.hpp"
 
 
+#include "../include/ContentCache.hpp"
 #include "../include/parser.hpp"
 #include "../include/helpers.hpp"
 #include "../include/webserv.hpp"
 #include "../include/errors.hpp"
+#include <limits>
 
 
 int Client::recv(void *buffer, size_t len) {
@@ -52,36 +58,148 @@ bool Client::parse_loop(int a) {
 
 Client::~Client() {
   close(this->client_socket);
-  response.clear();
-  write_offset = 0;
-  chunk = false;
-  current_chunk.clear();
-  chunk_offset = 0;
-  final_chunk_sent = false;
+  if (response_fd != -1)
+    close(response_fd);
+  clear_output();
+  delete gzip;
+  gzip = NULL;
+  delete listing;
+  listing = NULL;
+  if (fastcgi)
+    fastcgi_pool.abort(fastcgi);
+  cgi_cache.leave(*this);
+  cgi_cache.drop(*this);
+  response_fd = -1;
+  file_offset = 0;
+  file_end = 0;
   remaining_from_last_request.clear();
   delete this->request;
 }
 
 Client::Client(int client_socket) : client_socket(client_socket), request(NULL), connected(true){
-  response.clear();
-  write_offset = 0;
-  chunk = false;
-  current_chunk.clear();
-  chunk_offset = 0;
-  final_chunk_sent = false;
+  response_fd = -1;
+  file_offset = 0;
+  file_end = 0;
+  use_sendfile = true;
+  corked = false;
+  nodelay = false;
+  gzip = NULL;
+  chunked = false;
+  listing = NULL;
+  fastcgi = NULL;
+  cache_fill = NULL;
+  cache_flight = NULL;
+  cache_unlocked = false;
+  range_index = 0;
   remaining_from_last_request.clear();
   last_time = std::time(NULL);
+  keep_alive = true;
+  requests = 0;
+  keepalive_timeout = CLIENT_TIMEOUT;
+  bytes_sent = 0;
+  blocked = false;
+  send_limit = std::numeric_limits<size_t>::max();
+  limit_rate = 0;
+  limit_rate_after = 0;
+  rate_start_bytes = 0;
+  rate_start = 0;
+  throttled_until = 0;
   error_code = false;
   free_client = false;
   cgi.pipe_fd = -1;
   cgi.in_pipe_fd = -1;
   cgi.pid = -1;
-  cgi.data_received = false;
-  cgi.output_fd = -1;
+  cgi.input_blocked = false;
+  cgi.input_paused = false;
+  cgi.splice_full = false;
+  cgi.streaming = false;
+  cgi.chunked = false;
+  cgi.paused = false;
   cgi.body_fd = -1;
   cgi.start = -1;
 }
 
+void Client::queue(const std::string &data) {
+  if (data.empty())
+    return;
+  out.push_back(OutSegment());
+  out.back().data = data;
+  out.back().shared = NULL;
+  out.back().offset = 0;
+}
+
+// queues a large body without copying it, data is left empty
+void Client::queue_swap(std::string &data) {
+  if (data.empty())
+    return;
+  out.push_back(OutSegment());
+  out.back().data.swap(data);
+  out.back().shared = NULL;
+  out.back().offset = 0;
+}
+
+// takes over the caller's reference to buffer
+void Client::queue_shared(SharedBuffer *buffer) {
+  if (buffer->data.empty()) {
+    release_buffer(buffer);
+    return;
+  }
+  out.push_back(OutSegment());
+  out.back().shared = buffer;
+  out.back().offset = 0;
+}
+
+void Client::clear_output() {
+  for (size_t i = 0; i < out.size(); ++i)
+    release_buffer(out[i].shared);
+  out.clear();
+}
+
+// releases the capacity the last request left behind, an idle
+// keep-alive connection only holds the Client itself
+void Client::compact() {
+  std::string().swap(remaining_from_last_request);
+  std::deque<OutSegment>().swap(out);
+  std::vector<RangePart>().swap(ranges);
+}
+
+// waiting for the next request of a keep-alive connection
+bool Client::is_idle() {
+  return requests > 0 && !request && out.empty() && response_fd == -1 &&
+         !listing && !fastcgi && cgi.pid == -1;
+}
+
+// heap and pool bytes held by the connection
+size_t Client::memory_usage() {
+  size_t bytes = sizeof(Client) + port.capacity() + addr.capacity() +
+                 remaining_from_last_request.capacity() +
+                 ranges.capacity() * sizeof(RangePart);
+  for (size_t i = 0; i < out.size(); ++i)
+    bytes += sizeof(OutSegment) + out[i].data.capacity();
+  for (size_t i = 0; i < ranges.size(); ++i)
+    bytes += ranges[i].head.capacity();
+  if (request)
+    bytes += sizeof(HttpRequest) + request->body.capacity();
+  return bytes;
+}
+
+// bytes of the response still to be sent, as far as they are known.
+// streamed bodies count as large, they are produced as they are sent
+size_t Client::pending_bytes() {
+  size_t bytes = 0;
+  for (size_t i = 0; i < out.size(); ++i)
+    bytes += (out[i].shared ? out[i].shared->data.size() : out[i].data.size()) -
+             out[i].offset;
+  if (response_fd != -1) {
+    bytes += file_end - file_offset;
+    for (size_t i = range_index; i < ranges.size(); ++i)
+      bytes += ranges[i].head.size() + (ranges[i].end - ranges[i].start);
+  }
+  if (listing)
+    bytes += STREAMED_BODY_SIZE;
+  return bytes;
+}
+
 Client & Client::operator = (const Client &client) {
   if (&client != this) {
     this->client_socket = client.client_socket;
@@ -1,90 +1,311 @@
+#include "../include/errors.hpp"
+#include "../include/CgiCache.hpp"
+#include "../include/ContentCache.hpp"
+#include "../include/DirListing.hpp"
+#include "../include/ErrorResponses.hpp"
+#include "../include/FastCGI.hpp"
+#include "../include/gzip.hpp"
+#include "../include/multipart.hpp"
 #include "../include/webserv.hpp"
 #include <cstdio>
-#include <dirent.h>
+#include <limits>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
-const size_t CHUNK_THRESHOLD = 1024 * 1024; // 1MB
-const int CHUNK_SIZE = 8192;
 const size_t FIXED_BUFFER_SIZE = 1024 * 32; // 32KB
-const char *MONTH_NAMES[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-                             "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+const size_t MAX_IOVECS = 16;
 
-bool send_data(int fd, const std::string &data, size_t &offset, size_t max_size,
-               const std::string &error_prefix) {
-  size_t to_send = std::min(max_size, data.size() - offset);
-  ssize_t sent = send(fd, data.c_str() + offset, to_send, MSG_NOSIGNAL);
+// whether more of the response body follows what is queued, so sends
+// can be flagged MSG_MORE and coalesced by the kernel
+static bool body_pending(Client &client) {
+  if (client.listing)
+    return true;
+  return client.response_fd != -1 &&
+         (client.gzip || client.file_offset < client.file_end ||
+          client.range_index < client.ranges.size());
+}
+
+// sends up to FIXED_BUFFER_SIZE bytes of the queued segments, or the
+// client's send_limit when lower, with one gathered sendmsg. segments
+// sent in part keep their offset. MSG_MORE is set unless this is the end
+// of the response or the limit holds the rest back
+bool send_segments(Client &client) {
+  struct iovec iov[MAX_IOVECS];
+  size_t count = 0;
+  size_t total = 0;
+  size_t limit = std::min(FIXED_BUFFER_SIZE, client.send_limit);
+  bool truncated = false;
+
+  if (client.out.empty())
+    return true;
+  for (std::deque<OutSegment>::iterator it = client.out.begin();
+       it != client.out.end() && count < MAX_IOVECS && total < limit; ++it) {
+    const std::string &data = it->shared ? it->shared->data : it->data;
+    size_t len = std::min(data.size() - it->offset, limit - total);
+    truncated = len < data.size() - it->offset;
+    iov[count].iov_base = const_cast<char *>(data.data()) + it->offset;
+    iov[count].iov_len = len;
+    total += len;
+    count++;
+  }
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  bool more = total < client.send_limit &&
+              (truncated || count < client.out.size() || body_pending(client));
+  ssize_t sent = sendmsg(client.get_socket(), &msg,
+                         MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+  if (sent < 0 && errno == EAGAIN) {
+    client.blocked = true;
+    return true;
+  }
   if (sent < 0) {
-    LOG_STREAM(ERROR, error_prefix << strerror(errno));
+    LOG_STREAM(ERROR, "send error on fd " << client.get_socket() << ": "
+                                          << strerror(errno));
     return false;
   } else if (sent == 0)
     LOG_STREAM(WARNING, "Send 0 byte");
-  offset += sent;
+  // a short send means the socket buffer is full
+  client.bytes_sent += sent;
+  if ((size_t)sent < total)
+    client.blocked = true;
+
+  // fully sent segments are popped, empty ones included
+  size_t left = sent;
+  while (!client.out.empty()) {
+    OutSegment &segment = client.out.front();
+    size_t size = segment.shared ? segment.shared->data.size()
+                                 : segment.data.size();
+    if (left < size - segment.offset) {
+      segment.offset += left;
+      break;
+    }
+    left -= size - segment.offset;
+    release_buffer(segment.shared);
+    client.out.pop_front();
+  }
   return true;
 }
 
-bool handle_write(Client &client) {
-  int client_fd = client.get_socket();
-
-  if (client.write_offset < client.response.size()) {
-    if (!send_data(client_fd, client.response, client.write_offset,
-                   FIXED_BUFFER_SIZE,
-                   "send error on fd " + int_to_string(client_fd) + ": "))
-      return false;
-    return true;
+void set_cork(Client &client, bool on) {
+  int value = on;
+  if (setsockopt(client.get_socket(), IPPROTO_TCP, TCP_CORK, &value,
+                 sizeof(value)) == -1) {
+    LOG_STREAM(WARNING, "setsockopt TCP_CORK: " << strerror(errno));
+    return;
   }
+  client.corked = on;
+}
 
-  client.response.clear();
-  client.write_offset = 0;
+// TCP_NODELAY as configured for the location, changed only when needed
+void set_nodelay(Client &client, bool on) {
+  if (client.nodelay == on)
+    return;
+  int value = on;
+  if (setsockopt(client.get_socket(), IPPROTO_TCP, TCP_NODELAY, &value,
+                 sizeof(value)) == -1) {
+    LOG_STREAM(WARNING, "setsockopt TCP_NODELAY: " << strerror(errno));
+    return;
+  }
+  client.nodelay = on;
+}
 
-  if (client.chunk) {
-    int file_fd = client.response_fd;
-    char buffer[CHUNK_SIZE];
-    ssize_t bytes;
+// the location's limit_rate applies from the start of its response, the
+// request's own time included
+void start_rate_limit(Client &client, const LocationConfig *location) {
+  client.limit_rate = location->limit_rate;
+  client.limit_rate_after = location->limit_rate_after;
+  client.rate_start_bytes = client.bytes_sent;
+  client.rate_start = monotonic_ms();
+}
 
-    if (client.chunk_offset < client.current_chunk.size()) {
-      if (!send_data(client_fd, client.current_chunk, client.chunk_offset,
-                     FIXED_BUFFER_SIZE,
-                     "send error (chunk) on fd " + int_to_string(client_fd) +
-                         ": ")) {
-        close(file_fd);
-        return false;
-      }
+// sends the next part of the file body, from file_offset up to file_end
+bool send_file_data(Client &client) {
+  int client_fd = client.get_socket();
+  size_t to_send = std::min(std::min(FIXED_BUFFER_SIZE, client.send_limit),
+                            (size_t)(client.file_end - client.file_offset));
+  ssize_t sent;
+
+  if (client.use_sendfile) {
+    sent = sendfile(client_fd, client.response_fd, &client.file_offset, to_send);
+    if (sent < 0 && errno == EAGAIN) {
+      client.blocked = true;
       return true;
     }
-
-    client.current_chunk.clear();
-    client.chunk_offset = 0;
-
-    if (client.final_chunk_sent) {
-      close(file_fd);
-      client.chunk = false;
-      client.final_chunk_sent = false;
-      client.clear_request();
-      if (client.error_code) {
-        client.free_client = true;
-        client.error_code = false;
+    if (sent < 0) {
+      LOG_STREAM(ERROR, "sendfile error on fd " << client_fd << ": "
+                                                << strerror(errno));
+      return false;
+    }
+    client.bytes_sent += sent;
+    // a short send means the socket buffer is full
+    if ((size_t)sent < to_send)
+      client.blocked = true;
+  } else {
+    char buffer[FIXED_BUFFER_SIZE];
+    ssize_t bytes = pread(client.response_fd, buffer, to_send, client.file_offset);
+    if (bytes < 0) {
+      LOG_STREAM(ERROR, "read error on fd " << client.response_fd << ": "
+                                            << strerror(errno));
+      return false;
+    }
+    if (bytes == 0) {
+      sent = 0;
+    } else {
+      bool more = (size_t)bytes < client.send_limit &&
+                  (client.file_offset + bytes < client.file_end ||
+                   client.range_index < client.ranges.size());
+      sent = send(client_fd, buffer, bytes,
+                  MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+      if (sent < 0 && errno == EAGAIN) {
+        client.blocked = true;
+        return true;
       }
-      return true;
+      if (sent < 0) {
+        LOG_STREAM(ERROR, "send error on fd " << client_fd << ": "
+                                              << strerror(errno));
+        return false;
+      }
+      client.file_offset += sent;
+      client.bytes_sent += sent;
+      if (sent < bytes)
+        client.blocked = true;
     }
+  }
+  // the file shrank under us, the announced Content-Length can't be honored
+  if (sent == 0) {
+    LOG_STREAM(ERROR, "File truncated while sending on fd " << client_fd);
+    return false;
+  }
+  return true;
+}
 
-    bytes = read(file_fd, buffer, sizeof(buffer));
+// compresses the next part of the file into a queued chunk, the last
+// one also carries the gzip trailer and the terminating chunk. without
+// chunks, for HTTP/1.0, the compressed bytes are queued as they are
+bool fill_gzip_chunk(Client &client) {
+  char buffer[FIXED_BUFFER_SIZE];
+  std::string data;
+
+  if (client.file_offset < client.file_end) {
+    size_t to_read = std::min(FIXED_BUFFER_SIZE,
+                              (size_t)(client.file_end - client.file_offset));
+    ssize_t bytes =
+        pread(client.response_fd, buffer, to_read, client.file_offset);
     if (bytes < 0) {
-      LOG_STREAM(ERROR,
-                 "read error on fd " << file_fd << ": " << strerror(errno));
-      close(file_fd);
+      LOG_STREAM(ERROR, "read error on fd " << client.response_fd << ": "
+                                            << strerror(errno));
       return false;
     }
-
     if (bytes == 0) {
-      client.current_chunk = std::string("0") + CRLF + CRLF;
-      client.final_chunk_sent = true;
-    } else {
-      client.current_chunk =
-          int_to_hex(bytes) + CRLF + std::string(buffer, bytes) + CRLF;
+      LOG_STREAM(ERROR, "File truncated while compressing on fd "
+                            << client.get_socket());
+      return false;
+    }
+    client.file_offset += bytes;
+    client.gzip->compress(buffer, bytes, data);
+  }
+
+  if (client.file_offset == client.file_end) {
+    client.gzip->finish(data);
+    delete client.gzip;
+    client.gzip = NULL;
+    close(client.response_fd);
+    client.response_fd = -1;
+  }
+  if (!client.chunked) {
+    client.queue_swap(data);
+    return true;
+  }
+  if (!data.empty()) {
+    client.queue(int_to_hex(data.size()) + CRLF);
+    client.queue_swap(data);
+    client.queue(CRLF);
+  }
+  if (client.response_fd == -1)
+    client.queue("0" CRLF CRLF);
+  return true;
+}
+
+// queues the next part of a directory listing as a chunk, compressed
+// when gzip applies. the last one is followed by the terminating chunk,
+// unless the body is unframed for HTTP/1.0
+bool fill_listing_chunk(Client &client) {
+  std::string html;
+  bool more = client.listing->next(html);
+
+  if (client.gzip) {
+    std::string data;
+    client.gzip->compress(html.data(), html.size(), data);
+    if (!more) {
+      client.gzip->finish(data);
+      delete client.gzip;
+      client.gzip = NULL;
     }
+    html.swap(data);
+  }
+  if (!client.chunked)
+    client.queue_swap(html);
+  else if (!html.empty()) {
+    client.queue(int_to_hex(html.size()) + CRLF);
+    client.queue_swap(html);
+    client.queue(CRLF);
+  }
+  if (!more) {
+    delete client.listing;
+    client.listing = NULL;
+    if (client.chunked)
+      client.queue("0" CRLF CRLF);
+  }
+  return true;
+}
+
+// queues the header of the next multipart/byteranges part and points the
+// file body at its range. returns false once every part has been sent
+bool next_range(Client &client) {
+  if (client.range_index >= client.ranges.size())
+    return false;
+  const RangePart &part = client.ranges[client.range_index++];
+  client.queue(part.head);
+  client.file_offset = part.start;
+  client.file_end = part.end;
+  return true;
+}
+
+bool handle_write(Client &client) {
+  if (!client.out.empty())
+    return send_segments(client);
+  // the rest of a script's response is not read yet
+  if (client.cgi.pipe_fd != -1)
     return true;
+  if (client.listing)
+    return fill_listing_chunk(client) && send_segments(client);
+
+  if (client.response_fd != -1) {
+    if (client.gzip)
+      return fill_gzip_chunk(client) && send_segments(client);
+    if (client.file_offset < client.file_end)
+      return send_file_data(client);
+    if (next_range(client))
+      return send_segments(client);
+    close(client.response_fd);
+    client.response_fd = -1;
   }
+  if (client.corked)
+    set_cork(client, false);
 
   client.clear_request();
+  client.requests++;
+  client.limit_rate = 0;
+  if (!client.keep_alive) {
+    client.free_client = true;
+  } else {
+    client.compact();
+  }
   if (client.error_code == true) {
     client.free_client = true;
     client.error_code = false;
@@ -92,23 +313,281 @@ bool handle_write(Client &client) {
   return true;
 }
 
+// whether on the fly compression is configured for a body of this type
+bool gzip_type_enabled(const LocationConfig *location,
+                       const std::string &content_type) {
+  if (!location || !location->gzip.enabled)
+    return false;
+  const std::vector<std::string> &types = location->gzip.types;
+  std::string mime = to_lower(strip(content_type.substr(
+      0, content_type.find(';'))));
+  for (size_t i = 0; i < types.size(); ++i) {
+    if (types[i] == "*" || types[i] == mime)
+      return true;
+  }
+  return false;
+}
+
+// value of a request header, "" when it is absent
+std::string get_header_value(HttpRequest *request, const std::string &key) {
+  try {
+    return request->get_header_by_key(key)->value;
+  } catch (std::exception &e) {
+    return "";
+  }
+}
+
+// whether needle (lower case) appears in str, ignoring case
+static bool contains_nocase(const std::string &str, const char *needle) {
+  size_t len = strlen(needle);
+  for (size_t i = 0; i + len <= str.size(); ++i) {
+    size_t j = 0;
+    while (j < len &&
+           std::tolower(static_cast<unsigned char>(str[i + j])) == needle[j])
+      j++;
+    if (j == len)
+      return true;
+  }
+  return false;
+}
+
+// decides whether a body of the given type and length is compressed on
+// the fly, and adds Vary to headers whenever the answer depends on the
+// request. bodies that already have a Content-Encoding are left alone
+bool use_gzip(HttpRequest *request, const std::string &content_type,
+              size_t length, std::string &headers) {
+  if (!request || !gzip_type_enabled(request->location, content_type))
+    return false;
+  if (contains_nocase(headers, "content-encoding:"))
+    return false;
+  if (!contains_nocase(headers, "accept-encoding"))
+    headers += get_vary_header("Accept-Encoding");
+  if (length < request->location->gzip.min_length)
+    return false;
+  return accepts_encoding(get_header_value(request, "accept-encoding"), "gzip");
+}
+
 bool is_redirect(int code) {
   return (code == 301 || code == 302 || code == 307 || code == 308);
 }
 
 void generate_response(Client &client, int file_fd, const std::string &file,
                        int status_code, std::string info = "",
-                       const std::string &body_content = "") {
-  std::string status_line;
-  std::string headers = get_server_header() + get_date_header();
-  std::string body;
-  std::string response;
+                       std::string body_content = "",
+                       const std::string &extra_headers = "");
+
+// the Allow or Location header some statuses carry, info holds its value
+std::string get_status_headers(int status_code, const std::string &info) {
+  if (status_code == 405)
+    return get_allow_header(info);
+  if (status_code == 201 || is_redirect(status_code))
+    return get_location_header(info);
+  return "";
+}
+
+static bool has_token(const std::string &list, const std::string &token) {
+  std::vector<std::string> items = split(list, ',');
+  for (size_t i = 0; i < items.size(); ++i) {
+    if (to_lower(strip(items[i])) == token)
+      return true;
+  }
+  return false;
+}
+
+// whether the connection is kept open once this response is sent:
+// HTTP/1.1 unless the client asked to close, HTTP/1.0 only on request,
+// and within the server's keepalive_timeout and keepalive_requests
+static bool wants_keep_alive(Client &client) {
+  HttpRequest *request = client.get_request();
+  if (!request || !request->server_conf || client.error_code)
+    return false;
+  const ServerConfig *server_conf = request->server_conf;
+  if (server_conf->getKeepaliveTimeout() == 0 ||
+      client.requests + 1 >= server_conf->getKeepaliveRequests())
+    return false;
+  std::string connection = get_header_value(request, "connection");
+  if (has_token(connection, "close"))
+    return false;
+  if (request->get_version() == HTTP10)
+    return has_token(connection, "keep-alive");
+  return true;
+}
+
+// decides whether the connection outlives the response being built and
+// returns the matching Connection header
+std::string get_connection_header(Client &client) {
+  client.keep_alive = wants_keep_alive(client);
+  if (!client.keep_alive)
+    return "Connection: close" CRLF;
+  client.keepalive_timeout =
+      client.get_request()->server_conf->getKeepaliveTimeout();
+  return "Connection: keep-alive" CRLF;
+}
+
+// frames a body whose length isn't known up front. HTTP/1.0 has no
+// chunked coding, there the body is sent as is and closing the
+// connection ends it. returns whether the body is chunked
+bool frame_unknown_length(Client &client, std::string &headers) {
+  client.chunked = client.get_request()->get_version() != HTTP10;
+  if (client.chunked) {
+    headers += get_transfer_encoding("chunked");
+    return true;
+  }
+  if (client.keep_alive) {
+    client.keep_alive = false;
+    size_t pos = headers.find("Connection: keep-alive" CRLF);
+    if (pos != std::string::npos)
+      headers.replace(pos, sizeof("Connection: keep-alive") - 1,
+                      "Connection: close");
+  }
+  return false;
+}
+
+// drops whatever body the previous response left on the client
+void reset_body(Client &client) {
+  if (client.response_fd != -1) {
+    close(client.response_fd);
+    client.response_fd = -1;
+  }
+  client.clear_output();
+  delete client.gzip;
+  client.gzip = NULL;
+  delete client.listing;
+  client.listing = NULL;
+  client.ranges.clear();
+  client.range_index = 0;
+}
+
+// the ranges a 200 file response is cut to, see parse_range_header.
+// If-Range has to name the file's current ETag or Last-Modified for them
+// to apply
+int get_ranges(HttpRequest *request, const struct stat &st,
+               const std::string &etag,
+               std::vector<std::pair<off_t, off_t> > &ranges) {
+  if (!request)
+    return 200;
+  std::string range = get_header_value(request, "range");
+  if (range.empty())
+    return 200;
+  std::string if_range = strip(get_header_value(request, "if-range"));
+  if (!if_range.empty() && if_range != etag &&
+      if_range != format_http_date(st.st_mtime))
+    return 200;
+  return parse_range_header(range, st.st_size, ranges);
+}
+
+std::string get_byteranges_boundary() {
+  static unsigned long sequence = 0;
+  return "nginy_" + long_to_string(std::time(NULL)) + "_" +
+         long_to_string(++sequence);
+}
+
+// queues the multipart/byteranges parts on the client, handle_write sends
+// each part header followed by its range of the file. returns the
+// Content-Type and Content-Length of the whole body
+std::string queue_byteranges(Client &client, const std::string &file,
+                             const std::vector<std::pair<off_t, off_t> > &ranges,
+                             off_t size) {
+  std::string boundary = get_byteranges_boundary();
+  std::string type = get_content_type(file);
+  off_t length = 0;
+
+  client.ranges.clear();
+  client.range_index = 0;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    RangePart part;
+    part.head = CRLF "--" + boundary + CRLF + type +
+                get_content_range(ranges[i].first, ranges[i].second, size) +
+                CRLF;
+    part.start = ranges[i].first;
+    part.end = ranges[i].second;
+    length += part.head.size() + (part.end - part.start);
+    client.ranges.push_back(part);
+  }
+  RangePart trailer;
+  trailer.head = CRLF "--" + boundary + "--" CRLF;
+  trailer.start = 0;
+  trailer.end = 0;
+  length += trailer.head.size();
+  client.ranges.push_back(trailer);
+
+  return "Content-Type: multipart/byteranges; boundary=" + boundary + CRLF +
+         get_content_length(length);
+}
+
+// answers with the body of an open regular file. handle_write sends it
+// straight from the file, compressed into chunks when gzip applies (the
+// compressed length isn't known yet), or cut to the requested ranges
+void generate_file_response(Client &client, int file_fd, const struct stat &st,
+                            const std::string &file, int status_code,
+                            std::string headers) {
+  HttpRequest *request = client.get_request();
+  LocationConfig *location = request ? request->location : NULL;
+  std::vector<std::pair<off_t, off_t> > ranges;
+  int range_status = 200;
+
+  bool compress = use_gzip(request, get_mime_type(file), st.st_size, headers);
+  if (status_code == 200) {
+    std::string etag = make_etag(st.st_ino, st.st_size, st.st_mtime, compress);
+    headers += get_validator_headers(etag, st.st_mtime);
+    headers += get_cache_headers(location);
+    if (!compress) {
+      headers += "Accept-Ranges: bytes" CRLF;
+      range_status = get_ranges(request, st, etag, ranges);
+    }
+  }
+  if (range_status == 416) {
+    close(file_fd);
+    generate_response(client, -1, ".html", 416, "", "",
+                      "Content-Range: bytes */" + long_to_string(st.st_size) +
+                          CRLF);
+    return;
+  }
+
+  client.response_fd = file_fd;
+  client.file_offset = 0;
+  client.file_end = st.st_size;
+  client.use_sendfile = !compress && (!location || location->sendfile);
+  if (compress) {
+    headers += get_content_type(file);
+    headers += get_content_encoding("gzip");
+    frame_unknown_length(client, headers);
+    client.gzip = new GzipStream(location->gzip.comp_level);
+  } else if (range_status == 206 && ranges.size() == 1) {
+    headers += get_content_type(file);
+    headers += get_content_range(ranges[0].first, ranges[0].second, st.st_size);
+    headers += get_content_length(ranges[0].second - ranges[0].first);
+    client.file_offset = ranges[0].first;
+    client.file_end = ranges[0].second;
+  } else if (range_status == 206) {
+    // every part, the first one included, is queued by handle_write
+    headers += queue_byteranges(client, file, ranges, st.st_size);
+    client.file_end = 0;
+  } else {
+    headers += get_content_type(file);
+    headers += get_content_length(st.st_size);
+  }
+  headers += CRLF;
+  std::string head;
+  head.reserve(HEADER_RESERVE + headers.size());
+  append_status_line(head, range_status == 206 ? 206 : status_code);
+  head += headers;
+  client.queue_swap(head);
+  if (location && location->tcp_nopush)
+    set_cork(client, true);
+}
+
+void generate_response(Client &client, int file_fd, const std::string &file,
+                       int status_code, std::string info,
+                       std::string body_content,
+                       const std::string &extra_headers) {
+  std::string headers;
   std::string content;
-  size_t content_size = 0;
 
+  reset_body(client);
   if (file_fd != -1) {
     struct stat st;
-    if (stat(file.c_str(), &st) == -1) {
+    if (fstat(file_fd, &st) == -1) {
       close(file_fd);
       throw std::runtime_error("stat failed: " + std::string(strerror(errno)));
     }
@@ -116,77 +595,228 @@ void generate_response(Client &client, int file_fd, const std::string &file,
       close(file_fd);
       throw std::runtime_error("Not a regular file");
     }
-    content_size = st.st_size;
+    headers.reserve(HEADER_RESERVE);
+    headers += get_server_header();
+    headers += get_date_header();
+    headers += get_connection_header(client);
+    headers += get_status_headers(status_code, info);
+    headers += extra_headers;
+    generate_file_response(client, file_fd, st, file, status_code, headers);
+    return;
   }
 
-  status_line = generate_status_line(status_code);
-  if (status_code == 405) {
-    headers += get_allow_header(info);
-  } else if (status_code == 201 || is_redirect(status_code)) {
-    headers += get_location_header(info);
+  headers.reserve(HEADER_RESERVE);
+  append_status_line(headers, status_code);
+  headers += get_server_header();
+  headers += get_date_header();
+  headers += get_connection_header(client);
+  headers += get_status_headers(status_code, info);
+  append_content_type(headers, file);
+  headers += extra_headers;
+  HttpRequest *request = client.get_request();
+
+  if (!body_content.empty()) {
+    content.swap(body_content);
+  } else if (status_code == 201 || status_code == 204) {
+    content = "";
+  } else {
+    content = special_response(status_code);
   }
-  headers += get_content_type(file);
 
-  if (content_size < CHUNK_THRESHOLD || file_fd == -1) {
-    if (file_fd != -1) {
-      content = read_file_to_str(file_fd, content_size);
-    } else if (!body_content.empty()) {
-      content = body_content;
+  if (use_gzip(request, get_mime_type(file), content.size(), headers)) {
+    content = gzip_string(content, request->location->gzip.comp_level);
+    headers += get_content_encoding("gzip");
+  }
+  append_header(headers, "Content-Length", content.size());
+  headers += CRLF;
+  client.queue_swap(headers);
+  client.queue_swap(content);
+}
 
-    } else if (status_code == 201 || status_code == 204) {
-      content = "";
-    } else {
-      content = special_response(status_code);
-    }
+// serves a small file from the content cache, filling it on a miss.
+// returns false when the file has to go through the regular path
+bool serve_from_content_cache(Client &client, const ServerConfig *server_conf,
+                              const std::string &path,
+                              const std::string &type_path,
+                              std::string extra_headers) {
+  FileInfo info;
+  std::string headers;
+  SharedBuffer *body;
+
+  if (!open_file_cache.stat(server_conf, path, info) || !S_ISREG(info.mode))
+    return false;
+  // the cache holds whole identity bodies, compressed and partial ones
+  // are served from the file
+  if (use_gzip(client.get_request(), get_mime_type(type_path), info.size,
+               extra_headers) ||
+      !get_header_value(client.get_request(), "range").empty())
+    return false;
+  if (!content_cache.lookup(path, type_path, extra_headers, info, headers,
+                            body)) {
+    int fd = open_file_cache.open(server_conf, path);
+    if (fd == -1)
+      return false;
+    bool stored = content_cache.store(path, type_path, extra_headers, info, fd,
+                                      headers, body);
+    close(fd);
+    if (!stored)
+      return false;
+  }
 
-    headers += get_content_length(content.size());
-    headers += CRLF;
-    body = content;
+  reset_body(client);
+  headers += get_cache_headers(client.get_request()->location);
+  headers += get_connection_header(client);
+  headers += CRLF;
+  client.queue_swap(headers);
+  client.queue_shared(body);
+  return true;
+}
 
-    response = status_line + headers + body;
+// whether a GET can be answered with 304. If-None-Match, when present,
+// takes precedence over If-Modified-Since (RFC 9110 13.2.2)
+bool is_not_modified(HttpRequest *request, const std::string &etag,
+                     time_t mtime) {
+  std::string if_none_match = get_header_value(request, "if-none-match");
+  if (!if_none_match.empty())
+    return etag_matches(if_none_match, etag);
+
+  std::string since = strip(get_header_value(request, "if-modified-since"));
+  time_t date;
+  return !since.empty() && parse_http_date(since, date) && mtime <= date;
+}
 
-    client.chunk = false;
-    client.fill_response(response);
-    close(file_fd);
-  } else {
-    headers += get_transfer_encoding("chunked");
-    headers += CRLF;
+// answers a conditional GET of a file with 304 when the client's copy is
+// still current, from the file's metadata alone
+bool send_not_modified(Client &client, const FileInfo &info,
+                       const std::string &type_path,
+                       std::string extra_headers) {
+  HttpRequest *request = client.get_request();
+  bool weak = use_gzip(request, get_mime_type(type_path), info.size,
+                       extra_headers);
+  std::string etag = make_etag(info.ino, info.size, info.mtime, weak);
+  if (!is_not_modified(request, etag, info.mtime))
+    return false;
+
+  reset_body(client);
+  std::string headers;
+  headers.reserve(HEADER_RESERVE);
+  append_status_line(headers, 304);
+  headers += get_server_header();
+  headers += get_date_header();
+  headers += get_connection_header(client);
+  headers += extra_headers;
+  headers += get_validator_headers(etag, info.mtime);
+  headers += get_cache_headers(request->location);
+  headers += CRLF;
+  client.queue_swap(headers);
+  return true;
+}
 
-    response = status_line + headers;
-    client.fill_response(response);
+std::string get_status_page() {
+  return get_connections_status() + content_cache.status() +
+         dir_listing_cache.status() + cgi_cache.status() +
+         fastcgi_pool.status();
+}
 
-    client.chunk = true;
-    client.response_fd = file_fd;
-    client.chunk_offset = 0;
-    client.current_chunk.clear();
-    client.final_chunk_sent = false;
+// picks a precompressed sibling of path (path.br, path.gz) that the
+// client accepts. returns its path and sets encoding, or "" when none fits
+std::string get_precompressed(HttpRequest *request,
+                              const ServerConfig *server_conf,
+                              const LocationConfig *location,
+                              const std::string &path, std::string &encoding) {
+  std::string accept = get_header_value(request, "accept-encoding");
+  FileInfo info;
+
+  if (location->brotli_static && accepts_encoding(accept, "br") &&
+      open_file_cache.stat(server_conf, path + ".br", info) &&
+      S_ISREG(info.mode)) {
+    encoding = "br";
+    return path + ".br";
+  }
+  if (location->gzip_static && accepts_encoding(accept, "gzip") &&
+      open_file_cache.stat(server_conf, path + ".gz", info) &&
+      S_ISREG(info.mode)) {
+    encoding = "gzip";
+    return path + ".gz";
+  }
+  return "";
+}
+
+// answers with a page rendered at startup, only the header block is built
+void send_error_page(Client &client, ErrorPage &page, int status_code,
+                     const std::string &info) {
+  std::string headers;
+  headers.reserve(HEADER_RESERVE);
+  append_status_line(headers, status_code);
+  headers += get_server_header();
+  headers += get_date_header();
+  headers += get_connection_header(client);
+  headers += get_status_headers(status_code, info);
+  append_content_type(headers,
+                      page.file.empty() || page.missing ? ".html" : page.file);
+  SharedBuffer *body = page.body;
+
+  HttpRequest *request = client.get_request();
+  if (use_gzip(request, page.mime, body->data.size(), headers)) {
+    int level = request->location->gzip.comp_level;
+    SharedBuffer *&gzipped = page.gzip_bodies[level];
+    if (!gzipped)
+      gzipped = new_shared_buffer(gzip_string(body->data, level));
+    body = gzipped;
+    headers += get_content_encoding("gzip");
   }
+  append_header(headers, "Content-Length", body->data.size());
+  headers += CRLF;
+
+  reset_body(client);
+  client.queue_swap(headers);
+  client.queue_shared(retain_buffer(body));
 }
 
 void send_special_response(Client &client, int status_code, std::string info) {
-  if (!client.get_request()) {
-    generate_response(client, -1, ".html", status_code, info);
+  HttpRequest *request = client.get_request();
+  ErrorPage *page = error_responses.find(request ? request->server_conf : NULL,
+                                         status_code);
+  if (page) {
+    send_error_page(client, *page, status_code, info);
     return;
   }
-  std::map<int, std::string> error_pages =
-      client.get_request()->server_conf->getErrorPages();
-  std::map<int, std::string>::const_iterator it = error_pages.find(status_code);
-  if (it != error_pages.end()) {
-    int fd = open(it->second.c_str(), O_RDONLY);
-    if (fd < 0) {
-      LOG_STREAM(ERROR, "Error opening error page: " << strerror(errno));
-      if (status_code != 500)
-        send_special_response(client, 500);
-      else
-        generate_response(client, -1, ".html", 500);
-      return;
-    }
-    generate_response(client, fd, it->second, status_code, info);
+
+  // no rendered page, a custom one is missing without a built-in one
+  if (request && request->server_conf->getErrorPages().count(status_code) &&
+      status_code != 500) {
+    send_special_response(client, 500);
     return;
   }
   generate_response(client, -1, ".html", status_code, info);
 }
 
+// ends the multipart body parsed while it was received
+// returns the path of the first stored file
+static std::string handle_multipart_upload(Client &client) {
+  MultipartParser *parser = client.get_request()->multipart;
+  try {
+    parser->finish();
+  } catch (ParsingError &e) {
+    LOG_STREAM(WARNING, e.what());
+    parser->discard();
+    send_special_response(client, 400);
+    return "";
+  } catch (std::exception &e) {
+    LOG_STREAM(ERROR, e.what());
+    parser->discard();
+    send_special_response(client, 500);
+    return "";
+  }
+
+  if (parser->files().empty()) {
+    LOG_STREAM(WARNING, "No file part in multipart body");
+    send_special_response(client, 400);
+    return "";
+  }
+  return parser->files()[0];
+}
+
 std::string handle_file_upload(Client &client, std::string upload_store) {
   if (!client.get_request() || client.get_request()->body.empty() ||
       !client.get_request()->body_created) {
@@ -194,6 +824,8 @@ std::string handle_file_upload(Client &client, std::string upload_store) {
     send_special_response(client, 400);
     return "";
   }
+  if (client.get_request()->multipart)
+    return handle_multipart_upload(client);
 
   std::string filename;
   try {
@@ -277,17 +909,23 @@ std::string handle_file_upload(Client &client, std::string upload_store) {
   return path;
 }
 
-std::string get_default_file(const std::vector<std::string> &index,
+bool is_cached_dir(const ServerConfig *server_conf, const std::string &path) {
+  FileInfo info;
+  return open_file_cache.stat(server_conf, path, info) && S_ISDIR(info.mode);
+}
+
+std::string get_default_file(const ServerConfig *server_conf,
+                             const std::vector<std::string> &index,
                              std::string file_path) {
   if (file_path[file_path.size() - 1] != '/')
     file_path += "/";
   if (!index.empty()) {
-    struct stat buf;
+    FileInfo info;
     std::string::size_type base_len = file_path.length();
     for (std::vector<std::string>::const_iterator it = index.begin();
          it != index.end(); ++it) {
       file_path += *it;
-      if (stat(file_path.c_str(), &buf) == 0)
+      if (open_file_cache.stat(server_conf, file_path, info))
         return file_path;
       file_path.resize(base_len);
     }
@@ -342,81 +980,73 @@ std::string replace_root(const std::string &root, const std::string &path) {
   return new_path;
 }
 
-std::string format_time(const std::time_t &t) {
-  std::tm *tm_info = std::localtime(&t);
-  if (!tm_info)
-    return "-";
-
-  std::string day = int_to_string(tm_info->tm_mday);
-  std::string month = MONTH_NAMES[tm_info->tm_mon];
-  std::string year = int_to_string(tm_info->tm_year + 1900);
-
-  std::string hour =
-      (tm_info->tm_hour < 10 ? "0" : "") + int_to_string(tm_info->tm_hour);
-  std::string min =
-      (tm_info->tm_min < 10 ? "0" : "") + int_to_string(tm_info->tm_min);
-
-  return day + "-" + month + "-" + year + " " + hour + ":" + min;
-}
-
-std::string format_size(off_t size) {
-  if (size < 0)
-    return "-";
-
-  if (size > 1024) {
-    double kb = size / 1024.0;
-    std::ostringstream oss;
-    oss.precision(1);
-    oss.setf(std::ios::fixed);
-    oss << kb << "K";
-    return oss.str();
-  } else {
-    return long_to_string(size);
-  }
-}
+// answers with the index of a directory, from the listing cache when
+// the directory is unchanged, otherwise streamed as it is read
+void send_dir_listing(Client &client, const std::string &path,
+                      const std::string &title) {
+  HttpRequest *request = client.get_request();
+  int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  struct stat st;
 
-std::string get_dir_listing(const std::string &root, const std::string &path) {
-  std::string html = "<html><head><title>Index of " + replace_root(root, path) +
-                     "</title></head><body><h1>Index of " +
-                     replace_root(root, path) + "</h1><pre>\n";
-  DIR *dir = opendir(path.c_str());
-  if (!dir) {
+  if (dir_fd == -1 || fstat(dir_fd, &st) == -1) {
     LOG_STREAM(ERROR, "Fail to open " << path << ": " << strerror(errno));
-    return "";
+    if (dir_fd != -1)
+      close(dir_fd);
+    send_special_response(client, 500);
+    return;
   }
-
-  html += "<a href=\"../\">../</a>\n";
-  struct dirent *entry;
-  std::string size_str;
-  struct stat st;
-  int pad_spaces;
-  while ((entry = readdir(dir))) {
-    std::string name = entry->d_name;
-    if (name == "." || name == "..")
-      continue;
-
-    if (stat(join_paths(path, name).c_str(), &st) != 0) {
-      LOG_STREAM(WARNING, "stat failed in dir listing: " << strerror(errno));
-      continue;
-    }
-
-    size_str = "-";
-    if (!S_ISDIR(st.st_mode)) {
-      size_str = format_size(st.st_size);
+  FileInfo info;
+  memset(&info, 0, sizeof(info));
+  info.mode = st.st_mode;
+  info.mtime = st.st_mtime;
+  info.mtime_nsec = st.st_mtim.tv_nsec;
+  info.ino = st.st_ino;
+
+  ListingOptions options =
+      parse_listing_options(request->get_path().get_queries());
+  std::string key = listing_cache_key(path, options);
+  std::string headers;
+  headers.reserve(HEADER_RESERVE);
+  append_status_line(headers, 200);
+  headers += get_server_header();
+  headers += get_date_header();
+  headers += get_connection_header(client);
+  append_content_type(headers, ".html");
+
+  SharedBuffer *body;
+  reset_body(client);
+  if (dir_listing_cache.lookup(key, info, body)) {
+    close(dir_fd);
+    if (use_gzip(request, "text/html", body->data.size(), headers)) {
+      std::string content =
+          gzip_string(body->data, request->location->gzip.comp_level);
+      release_buffer(body);
+      headers += get_content_encoding("gzip");
+      append_header(headers, "Content-Length", content.size());
+      headers += CRLF;
+      client.queue_swap(headers);
+      client.queue_swap(content);
+      return;
     }
+    append_header(headers, "Content-Length", body->data.size());
+    headers += CRLF;
+    client.queue_swap(headers);
+    client.queue_shared(body);
+    return;
+  }
 
-    html += "<a href=\"" + name + (S_ISDIR(st.st_mode) ? "/" : "") + "\">" +
-            name + (S_ISDIR(st.st_mode) ? "/" : "") + "</a>";
-
-    pad_spaces = 40 - (int)name.length();
-    if (pad_spaces < 1)
-      pad_spaces = 1;
-    html += std::string(pad_spaces, ' ') + size_str + "  " +
-            format_time(st.st_mtime) + "\n";
+  // the length isn't known up front, min_length can't be honored
+  if (use_gzip(request, "text/html", std::numeric_limits<size_t>::max(),
+               headers)) {
+    headers += get_content_encoding("gzip");
+    client.gzip = new GzipStream(request->location->gzip.comp_level);
   }
-  html += "</pre></body></html>";
-  closedir(dir);
-  return html;
+  frame_unknown_length(client, headers);
+  headers += CRLF;
+  client.queue_swap(headers);
+  client.listing = new DirListing(dir_fd, title, options, key, info);
+  if (request->location->tcp_nopush)
+    set_cork(client, true);
 }
 
 bool is_method_allowed(const std::vector<HTTP_METHOD> &a, HTTP_METHOD b,
@@ -456,6 +1086,227 @@ int can_delete_file(const std::string &filepath) {
   }
 }
 
+// answers a GET of a regular file: a precompressed sibling, 304, the
+// content cache, or the file itself with its ranges
+static void serve_static_file(Client &client, ServerConfig *server_conf,
+                              LocationConfig *location,
+                              const std::string &path,
+                              std::string extra_headers) {
+  HttpRequest *request = client.get_request();
+  std::string file_path = path;
+  if (location->gzip_static || location->brotli_static) {
+    std::string encoding;
+    std::string sidecar =
+        get_precompressed(request, server_conf, location, path, encoding);
+    extra_headers += get_vary_header("Accept-Encoding");
+    if (!sidecar.empty()) {
+      file_path = sidecar;
+      extra_headers = get_content_encoding(encoding) + extra_headers;
+    }
+  }
+  FileInfo info;
+  if (open_file_cache.stat(server_conf, file_path, info) &&
+      S_ISREG(info.mode) &&
+      send_not_modified(client, info, path, extra_headers))
+    return;
+  if (location->content_cache &&
+      serve_from_content_cache(client, server_conf, file_path, path,
+                               extra_headers))
+    return;
+  int fd = open_file_cache.open(server_conf, file_path);
+  int error_code;
+  if (fd == -1) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      error_code = 404;
+    else if (errno == EMFILE)
+      error_code = 503;
+    else
+      error_code = 500;
+    LOG_STREAM(ERROR, "Open: " << strerror(errno));
+    send_special_response(client, error_code);
+  } else {
+    generate_response(client, fd, path, 200, "", "", extra_headers);
+  }
+}
+
+// whether requests to the location run a script, through fastcgi_pass or
+// a CGI extension
+static bool runs_scripts(const LocationConfig *location) {
+  return !location->fastcgi_pass.empty() || !location->cgi_ext.empty();
+}
+
+// hands the request to the location's FastCGI application, or to a CGI
+// process, unless cgi_cache has its response. returns 0 once started or
+// answered, an error status otherwise
+static int start_script(int epoll_fd, ServerConfig &server_conf,
+                        const std::string &path, LocationConfig *location,
+                        Client &client) {
+  if (cgi_cache.lookup(client, location))
+    return 0;
+  int r;
+  if (!location->fastcgi_pass.empty())
+    r = fastcgi_pool.start(client, server_conf, location, path);
+  else
+    r = executeCGI(epoll_fd, server_conf, path, location, &client);
+  // nothing to store, requests waiting on it run their own
+  if (r)
+    cgi_cache.drop(client);
+  return r;
+}
+
+// answers a request whose head already decides the response: no
+// location, a method the location doesn't allow or a return redirect.
+// returns whether it did, the body is then not wanted
+bool answer_from_head(Client &client) {
+  HttpRequest *request = client.get_request();
+  LocationConfig *location = request->location;
+
+  if (!location || location->internal) {
+    send_special_response(client, 404);
+    return true;
+  }
+  if (!is_method_allowed(location->allowed_methods2, request->get_method(),
+                         client, location->allowed_methods))
+    return true;
+  if (is_redirect(location->redirect_code)) {
+    send_special_response(client, location->redirect_code,
+                          location->redirect_url);
+    return true;
+  }
+  return false;
+}
+
+// a CGI script is started as soon as the head of a request with a body
+// is routed, the body is piped to it while it is received. any other
+// answer goes out right away and the connection is closed, the body unread
+void start_script_early(int epoll_fd, Client &client) {
+  HttpRequest *request = client.get_request();
+  const LocationConfig *location = request->location;
+
+  if (client.error_code || !client.connected || request->request_is_ready() ||
+      !location || location->cgi_ext.empty() || !location->fastcgi_pass.empty())
+    return;
+  process_request(epoll_fd, client);
+  if (!request->body_sink)
+    client.error_code = true;
+}
+
+// a multipart/form-data upload is parsed as its body is received, the
+// file parts written to the location's upload_store without spooling the
+// body first. only for requests process_request would store
+void start_upload_early(Client &client) {
+  HttpRequest *request = client.get_request();
+  const LocationConfig *location = request->location;
+
+  if (client.error_code || request->request_is_ready() ||
+      request->get_method() != POST || !location || location->internal || runs_scripts(location) ||
+      location->upload_store.empty() || is_redirect(location->redirect_code) ||
+      find_in_vec(location->allowed_methods2, POST) == -1)
+    return;
+  std::string boundary;
+  try {
+    const std::string &type = request->get_header_by_key("content-type")->value;
+    boundary = get_multipart_boundary(type);
+  } catch (std::exception &e) {
+  }
+  if (!boundary.empty())
+    request->multipart = new MultipartParser(boundary, location->upload_store);
+}
+
+// the target of a script's X-Accel-Redirect (a URI) or X-Sendfile (a
+// file path) header, with the script's headers the file's response keeps
+static bool find_internal_redirect(const std::string &cgi_headers,
+                                   std::string &target, bool &is_file_path,
+                                   std::string &kept) {
+  std::istringstream lines(cgi_headers);
+  std::string line;
+  bool found = false;
+
+  while (std::getline(lines, line)) {
+    std::string::size_type colon = line.find(':');
+    if (colon == std::string::npos)
+      continue;
+    std::string key = to_lower(line.substr(0, colon));
+    if (key == "x-accel-redirect" || key == "x-sendfile") {
+      target = strip(line.substr(colon + 1));
+      is_file_path = key == "x-sendfile";
+      found = true;
+    } else if (key == "content-disposition" || key == "set-cookie") {
+      kept += strip(line) + CRLF;
+    }
+  }
+  return found;
+}
+
+// the internal location whose directory holds the file at path
+static LocationConfig *find_internal_location(ServerConfig *server_conf,
+                                              const std::string &path) {
+  std::vector<LocationConfig> &locations = server_conf->getLocations();
+
+  for (size_t i = 0; i < locations.size(); ++i) {
+    LocationConfig &location = locations[i];
+    if (!location.internal)
+      continue;
+    std::string dir = location.alias.empty()
+                          ? join_paths(location.root, location.path)
+                          : location.alias;
+    if (!dir.empty() && path.size() > dir.size() &&
+        path.compare(0, dir.size(), dir) == 0 &&
+        (dir[dir.size() - 1] == '/' || path[dir.size()] == '/'))
+      return &location;
+  }
+  return NULL;
+}
+
+// serves the file a script names in X-Accel-Redirect or X-Sendfile in
+// place of its own body, like a GET of it: sendfile, ranges and
+// conditional requests apply. the file has to be under an internal
+// location. returns -1 when the headers name no file, 0 once the
+// response is queued, or the status of an error response
+int serve_internal_redirect(Client &client, const std::string &cgi_headers) {
+  std::string target;
+  bool is_file_path = false;
+  std::string kept;
+
+  if (!find_internal_redirect(cgi_headers, target, is_file_path, kept))
+    return -1;
+  HttpRequest *request = client.get_request();
+  ServerConfig *server_conf = request->server_conf;
+  if (!is_file_path)
+    target = target.substr(0, target.find('?'));
+  if (target.empty() || target[0] != '/' ||
+      target.find("..") != std::string::npos) {
+    LOG_STREAM(ERROR, "CGI: Invalid internal redirect: " << target);
+    return 502;
+  }
+
+  LocationConfig *location;
+  std::string path = target;
+  if (is_file_path) {
+    location = find_internal_location(server_conf, path);
+  } else {
+    location = get_location(server_conf->getLocations(), target);
+    if (location && location->alias.empty()) {
+      path = join_paths(location->root, target);
+    } else if (location) {
+      path = join_paths(location->alias, target.substr(location->path.size()));
+    }
+  }
+  if (!location || !location->internal || runs_scripts(location)) {
+    LOG_STREAM(ERROR, "CGI: Internal redirect outside an internal location: "
+                          << target);
+    return 502;
+  }
+  if (is_cached_dir(server_conf, path))
+    return 404;
+
+  request->location = location;
+  set_nodelay(client, location->tcp_nodelay);
+  start_rate_limit(client, location);
+  serve_static_file(client, server_conf, location, path, kept);
+  return 0;
+}
+
 void process_request(int epoll_fd, Client &client) {
   HttpRequest *request = client.get_request();
   if (!request) {
@@ -468,13 +1319,16 @@ void process_request(int epoll_fd, Client &client) {
 
   LocationConfig *location =
       get_location(server_conf->getLocations(), request_path);
-  if (!location) {
+  // internal locations are only served for a script's internal redirect
+  if (!location || location->internal) {
     send_special_response(client, 404);
     return;
   }
 
+  set_nodelay(client, location->tcp_nodelay);
+  start_rate_limit(client, location);
   std::string path = join_paths(location->root, request_path);
-  if (path[path.size() - 1] != '/' && is_dir(path)) {
+  if (path[path.size() - 1] != '/' && is_cached_dir(server_conf, path)) {
     send_special_response(client, 301, request_path + "/");
     return;
   }
@@ -489,6 +1343,11 @@ void process_request(int epoll_fd, Client &client) {
     return;
   }
 
+  if (location->stub_status && method == GET) {
+    generate_response(client, -1, ".txt", 200, "", get_status_page());
+    return;
+  }
+
   if (!location->alias.empty()) {
     std::string tmp = request_path;
     tmp.erase(tmp.find(location->path), location->path.length());
@@ -496,46 +1355,31 @@ void process_request(int epoll_fd, Client &client) {
   }
 
   if (method == GET) {
-    if (is_dir(path)) {
-      std::string new_path = get_default_file(location->index, path);
+    if (is_cached_dir(server_conf, path)) {
+      std::string new_path =
+          get_default_file(server_conf, location->index, path);
       if (new_path.empty()) {
         if (location->autoindex && (request_path == location->path ||
                                     request_path == location->path + "/")) {
-          std::string dir_listing = get_dir_listing(location->root, path);
-
-          if (dir_listing.empty())
-            send_special_response(client, 500);
-          generate_response(client, -1, ".html", 200, "", dir_listing);
+          send_dir_listing(client, path, replace_root(location->root, path));
         } else
           send_special_response(client, 403);
         return;
       }
       path = new_path;
     }
-    if (!location->cgi_ext.empty()) {
-      int r = executeCGI(epoll_fd, *server_conf, path, location, &client);
+    if (runs_scripts(location)) {
+      int r = start_script(epoll_fd, *server_conf, path, location, client);
       if (r)
         send_special_response(client, r);
       return;
     }
-    int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
-    int error_code;
-    if (fd == -1) {
-      if (errno == ENOENT || errno == ENOTDIR)
-        error_code = 404;
-      else if (errno == EMFILE)
-        error_code = 503;
-      else
-        error_code = 500;
-      LOG_STREAM(ERROR, "Open: " << strerror(errno));
-      send_special_response(client, error_code);
-    } else {
-      generate_response(client, fd, path, 200);
-    }
+    serve_static_file(client, server_conf, location, path, "");
   } else if (method == POST) {
-    if (!location->cgi_ext.empty()) {
-      if (is_dir(path)) {
-        std::string new_path = get_default_file(location->index, path);
+    if (runs_scripts(location)) {
+      if (is_cached_dir(server_conf, path)) {
+        std::string new_path =
+          get_default_file(server_conf, location->index, path);
         if (!new_path.empty()) {
           path = new_path;
         } else {
@@ -543,7 +1387,7 @@ void process_request(int epoll_fd, Client &client) {
           return;
         }
       }
-      int r = executeCGI(epoll_fd, *server_conf, path, location, &client);
+      int r = start_script(epoll_fd, *server_conf, path, location, client);
       if (r)
         send_special_response(client, r);
       return;
@@ -557,9 +1401,10 @@ void process_request(int epoll_fd, Client &client) {
       send_special_response(client, 405, join_vec(location->allowed_methods));
 
   } else if (method == DELETE) {
-    if (!location->cgi_ext.empty()) {
-      if (is_dir(path)) {
-        std::string new_path = get_default_file(location->index, path);
+    if (runs_scripts(location)) {
+      if (is_cached_dir(server_conf, path)) {
+        std::string new_path =
+          get_default_file(server_conf, location->index, path);
         if (!new_path.empty()) {
           path = new_path;
         } else {
@@ -567,7 +1412,7 @@ void process_request(int epoll_fd, Client &client) {
           return;
         }
       }
-      int r = executeCGI(epoll_fd, *server_conf, path, location, &client);
+      int r = start_script(epoll_fd, *server_conf, path, location, client);
       if (r)
         send_special_response(client, r);
       return;
@@ -583,6 +1428,7 @@ void process_request(int epoll_fd, Client &client) {
       send_special_response(client, 500);
       return;
     }
+    open_file_cache.invalidate(path);
     send_special_response(client, 204);
   } else {
     send_special_response(client, 405, join_vec(location->allowed_methods));
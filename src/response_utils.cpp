@@ -1,144 +1,8 @@
 #include "../include/webserv.hpp"
-
-#define HTTP_VERSION "HTTP/1.1"
+#include <limits>
 
 #define DEFAULT "index.html"
 
-const std::string &get_status_code_phrase(int code) {
-  static std::map<int, std::string> codes;
-  static std::string unknown = "Unknown";
-
-  if (codes.empty()) {
-    // 1xx (Informational): The request was received, continuing process
-    codes[100] = "Continue";
-    codes[101] = "Switching Protocols";
-    codes[102] = "Processing";
-    codes[103] = "Early Hints";
-
-    // 2xx (Successful): The request was successfully received, understood, and
-    // accepted
-    codes[200] = "OK";
-    codes[201] = "Created";
-    codes[202] = "Accepted";
-    codes[203] = "Non-Authoritative Information";
-    codes[204] = "No Content";
-    codes[205] = "Reset Content";
-    codes[206] = "Partial Content";
-    codes[207] = "Multi-Status";
-    codes[208] = "Already Reported";
-    codes[226] = "IM Used";
-
-    // 3xx (Redirection): Further action needs to be taken in order to complete
-    // the request
-    codes[300] = "Multiple Choices";
-    codes[301] = "Moved Permanently";
-    codes[302] = "Found";
-    codes[303] = "See Other";
-    codes[304] = "Not Modified";
-    codes[305] = "Use Proxy";
-    codes[307] = "Temporary Redirect";
-    codes[308] = "Permanent Redirect";
-
-    // 4xx (Client Error): The request contains bad syntax or cannot be
-    // fulfilled
-    codes[400] = "Bad Request";
-    codes[401] = "Unauthorized";
-    codes[403] = "Forbidden";
-    codes[404] = "Not Found";
-    codes[405] = "Method Not Allowed";
-    codes[406] = "Not Acceptable";
-    codes[407] = "Proxy Authentication Required";
-    codes[408] = "Request Timeout";
-    codes[409] = "Conflict";
-    codes[410] = "Gone";
-    codes[411] = "Length Required";
-    codes[412] = "Precondition Failed";
-    codes[413] = "Payload Too Large";
-    codes[414] = "URI Too Long";
-    codes[415] = "Unsupported Media Type";
-    codes[416] = "Range Not Satisfiable";
-    codes[417] = "Expectation Failed";
-    codes[418] = "I'm a teapot";
-    codes[421] = "Misdirected Request";
-    codes[422] = "Unprocessable Entity";
-    codes[423] = "Locked";
-    codes[424] = "Failed Dependency";
-    codes[425] = "Too Early";
-    codes[426] = "Upgrade Required";
-    codes[428] = "Precondition Required";
-    codes[429] = "Too Many Requests";
-    codes[431] = "Request Header Fields Too Large";
-    codes[451] = "Unavailable For Legal Reasons";
-
-    // 5xx (Server Error): The server failed to fulfill an apparently valid
-    // request
-    codes[500] = "Internal Server Error";
-    codes[501] = "Not Implemented";
-    codes[502] = "Bad Gateway";
-    codes[503] = "Service Unavailable";
-    codes[504] = "Gateway Timeout";
-    codes[505] = "HTTP Version Not Supported";
-    codes[506] = "Variant Also Negotiates";
-    codes[507] = "Insufficient Storage";
-    codes[508] = "Loop Detected";
-    codes[510] = "Not Extended";
-    codes[511] = "Network Authentication Required";
-  }
-
-  std::map<int, std::string>::iterator it = codes.find(code);
-  if (it != codes.end()) {
-    return it->second;
-  }
-
-  return unknown;
-}
-
-std::map<std::string, std::string> make_mime_map() {
-  std::map<std::string, std::string> m;
-  m["html"] = "text/html";
-  m["htm"] = "text/html";
-  m["txt"] = "text/plain";
-  m["csv"] = "text/csv";
-  m["md"] = "text/markdown";
-  m["jpg"] = "image/jpeg";
-  m["jpeg"] = "image/jpeg";
-  m["png"] = "image/png";
-  m["gif"] = "image/gif";
-  m["bmp"] = "image/bmp";
-  m["svg"] = "image/svg+xml";
-  m["webp"] = "image/webp";
-  m["mp4"] = "video/mp4";
-  m["webm"] = "video/webm";
-  m["ogg"] = "video/ogg";
-  m["mp3"] = "audio/mpeg";
-  m["wav"] = "audio/wav";
-  m["ogg"] = "audio/ogg";
-  m["pdf"] = "application/pdf";
-  m["doc"] = "application/msword";
-  m["docx"] =
-      "application/vnd.openxmlformats-officedocument.wordprocessingml.document";
-  m["xls"] = "application/vnd.ms-excel";
-  m["xlsx"] =
-      "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet";
-  m["ppt"] = "application/vnd.ms-powerpoint";
-  m["pptx"] = "application/"
-              "vnd.openxmlformats-officedocument.presentationml.presentation";
-  m["zip"] = "application/zip";
-  m["tar"] = "application/x-tar";
-  m["gz"] = "application/gzip";
-  m["rar"] = "application/vnd.rar";
-  m["7z"] = "application/x-7z-compressed";
-  m["json"] = "application/json";
-  m["xml"] = "application/xml";
-  m["woff"] = "font/woff";
-  m["woff2"] = "font/woff2";
-  m["ttf"] = "font/ttf";
-  m["otf"] = "font/otf";
-  m["css"] = "text/css";
-  m["js"] = "application/javascript";
-  return m;
-}
-
 std::string get_file_path(const std::string &root,
                           const std::vector<std::string> &index,
                           const std::string &path) {
@@ -163,31 +27,98 @@ std::string get_file_path(const std::string &root,
   }
 }
 
-std::string generate_status_line(int status_code) {
-  std::string status_code_phrase = get_status_code_phrase(status_code);
-  if (status_code_phrase == "Unknown") {
-    LOG(WARNING, "Unknown status code");
-  }
-  return std::string(HTTP_VERSION) + SPACE + int_to_string(status_code) +
-         SPACE + status_code_phrase + CRLF;
+// status lines are served from a table built once, only unknown codes
+// are formatted
+void append_status_line(std::string &out, int status_code) {
+  const std::string &line = get_status_line(status_code);
+  if (!line.empty())
+    out += line;
+  else
+    out += generate_status_line(status_code);
 }
 
-std::string get_date_header() {
-  time_t now = time(0);
+std::string generate_status_line(int status_code) {
+  const std::string &line = get_status_line(status_code);
+  if (!line.empty())
+    return line;
+  LOG(WARNING, "Unknown status code");
+  return "HTTP/1.1" SPACE + int_to_string(status_code) + SPACE "Unknown" CRLF;
+}
 
-  tm *utc_time = gmtime(&now);
+std::string format_http_date(time_t t) {
+  tm *utc_time = gmtime(&t);
 
   if (!utc_time) {
     throw std::runtime_error("gmtime failed");
   }
   char buffer[50];
   strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", utc_time);
+  return buffer;
+}
 
-  return "Date: " + std::string(buffer) + CRLF;
+bool parse_http_date(const std::string &str, time_t &t) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (!end || *end)
+    return false;
+  t = timegm(&tm);
+  return t != -1;
 }
 
-std::string get_server_header() {
-  return "Server: " + std::string(SERVER_SOFTWARE) + std::string(" (Linux)") + CRLF;
+// formatted at most once per second
+const std::string &get_date_header() {
+  static std::string header;
+  static time_t header_time = -1;
+  time_t now = time(0);
+
+  if (now != header_time) {
+    header = "Date: " + format_http_date(now) + CRLF;
+    header_time = now;
+  }
+  return header;
+}
+
+const std::string &get_server_header() {
+  static const std::string header =
+      "Server: " SERVER_SOFTWARE " (Linux)" CRLF;
+  return header;
+}
+
+// writes value in the given base (at most 16) backwards from end, returns
+// where the digits start
+char *format_number(char *end, unsigned long value, unsigned base,
+                    bool upper) {
+  const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  char *p = end;
+  do {
+    *--p = digits[value % base];
+    value /= base;
+  } while (value);
+  return p;
+}
+
+void append_number(std::string &out, unsigned long value, unsigned base,
+                   bool upper) {
+  char buffer[NUMBER_BUFFER_SIZE];
+  char *end = buffer + sizeof(buffer);
+  char *start = format_number(end, value, base, upper);
+  out.append(start, end - start);
+}
+
+void append_header(std::string &out, const char *name,
+                   const std::string &value) {
+  out += name;
+  out += ": ";
+  out += value;
+  out += CRLF;
+}
+
+void append_header(std::string &out, const char *name, unsigned long value) {
+  out += name;
+  out += ": ";
+  append_number(out, value);
+  out += CRLF;
 }
 
 std::string get_allow_header(std::string allowed_methods) {
@@ -198,38 +129,208 @@ std::string get_location_header(std::string location) {
   return "Location: " + location + CRLF;
 }
 
-std::string get_mime_type(const std::string &filepath) {
-  static const std::map<std::string, std::string> mime_types = make_mime_map();
-
-  size_t dot_pos = filepath.find_last_of('.');
-  if (dot_pos != std::string::npos) {
-    std::string ext = filepath.substr(dot_pos + 1);
-    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-    std::map<std::string, std::string>::const_iterator it =
-        mime_types.find(ext);
-    if (it != mime_types.end()) {
-      return it->second;
+std::string get_content_encoding(const std::string &encoding) {
+  return "Content-Encoding: " + encoding + CRLF;
+}
+
+std::string get_vary_header(const std::string &value) {
+  return "Vary: " + value + CRLF;
+}
+
+// whether an Accept-Encoding value allows coding, honoring q=0 and "*".
+// an explicit entry for the coding takes precedence over "*"
+bool accepts_encoding(const std::string &accept_encoding,
+                      const std::string &coding) {
+  std::vector<std::string> items = split(accept_encoding, ',');
+  int wildcard = -1;
+
+  for (size_t i = 0; i < items.size(); ++i) {
+    std::vector<std::string> params = split(items[i], ';');
+    if (params.empty())
+      continue;
+    std::string name = to_lower(strip(params[0]));
+    bool allowed = true;
+    for (size_t j = 1; j < params.size(); ++j) {
+      std::string param = strip(params[j]);
+      if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') &&
+          param[1] == '=')
+        allowed = std::strtod(param.c_str() + 2, NULL) > 0;
     }
+    if (name == coding)
+      return allowed;
+    if (name == "*")
+      wildcard = allowed;
   }
-  return "application/octet-stream";
+  return wildcard == 1;
+}
+
+std::string get_mime_type(const std::string &filepath) {
+  const char *type = find_mime_type(filepath);
+  return type ? type : "application/octet-stream";
 }
 
-std::string get_content_type(std::string file) {
-  return "Content-Type: " + get_mime_type(file) + CRLF;
+std::string get_content_type(const std::string &file) {
+  std::string header;
+  append_content_type(header, file);
+  return header;
 }
 
-std::string get_content_length(int size) {
-  return "Content-Length: " + int_to_string(size) + CRLF;
+void append_content_type(std::string &out, const std::string &file) {
+  const char *type = find_mime_type(file);
+  out += "Content-Type: ";
+  out += type ? type : "application/octet-stream";
+  out += CRLF;
+}
+
+std::string get_content_length(size_t size) {
+  std::string header;
+  append_header(header, "Content-Length", size);
+  return header;
 }
 
 std::string get_transfer_encoding(const std::string &encoding) {
   return "Transfer-Encoding: " + encoding + CRLF;
 }
 
+// end is exclusive
+std::string get_content_range(off_t start, off_t end, off_t size) {
+  std::string header = "Content-Range: bytes ";
+  append_number(header, start);
+  header += '-';
+  append_number(header, end - 1);
+  header += '/';
+  append_number(header, size);
+  header += CRLF;
+  return header;
+}
+
+// strong unless the body is transformed (compressed) on the fly
+std::string make_etag(ino_t ino, off_t size, time_t mtime, bool weak) {
+  std::string etag = weak ? "W/\"" : "\"";
+  append_number(etag, ino, 16);
+  etag += '-';
+  append_number(etag, size, 16);
+  etag += '-';
+  append_number(etag, mtime, 16);
+  etag += '"';
+  return etag;
+}
+
+std::string get_validator_headers(const std::string &etag, time_t mtime) {
+  return "ETag: " + etag + CRLF + "Last-Modified: " + format_http_date(mtime) +
+         CRLF;
+}
+
+// Expires and Cache-Control of the location, cache_control overrides the
+// Cache-Control implied by expires
+std::string get_cache_headers(const LocationConfig *location) {
+  if (!location)
+    return "";
+  std::string headers;
+  std::string cache_control;
+
+  if (location->expires == EXPIRES_EPOCH) {
+    headers += "Expires: Thu, 01 Jan 1970 00:00:01 GMT" CRLF;
+    cache_control = "no-cache";
+  } else if (location->expires == EXPIRES_MAX) {
+    headers += "Expires: Thu, 31 Dec 2037 23:55:55 GMT" CRLF;
+    cache_control = "max-age=315360000";
+  } else if (location->expires >= 0) {
+    headers += "Expires: " + format_http_date(time(0) + location->expires) +
+               CRLF;
+    cache_control = "max-age=" + long_to_string(location->expires);
+  }
+  if (!location->cache_control.empty())
+    cache_control = location->cache_control;
+  if (!cache_control.empty())
+    headers += "Cache-Control: " + cache_control + CRLF;
+  return headers;
+}
+
+// weak comparison of etag against an If-None-Match list
+bool etag_matches(const std::string &list, const std::string &etag) {
+  std::string opaque = etag.compare(0, 2, "W/") ? etag : etag.substr(2);
+  std::vector<std::string> items = split(list, ',');
+
+  for (size_t i = 0; i < items.size(); ++i) {
+    std::string item = strip(items[i]);
+    if (item == "*")
+      return true;
+    if (!item.compare(0, 2, "W/"))
+      item = item.substr(2);
+    if (item == opaque)
+      return true;
+  }
+  return false;
+}
+
+static bool parse_offset(const std::string &str, off_t &value) {
+  if (str.empty())
+    return false;
+  value = 0;
+  for (size_t i = 0; i < str.size(); ++i) {
+    if (!std::isdigit(static_cast<unsigned char>(str[i])))
+      return false;
+    off_t digit = str[i] - '0';
+    if (value > (std::numeric_limits<off_t>::max() - digit) / 10)
+      return false;
+    value = value * 10 + digit;
+  }
+  return true;
+}
+
+// parses a Range value against a body of the given size into [start, end)
+// pairs. returns 206 when some range is satisfiable, 416 when none is, and
+// 200 when the header has to be ignored (bad syntax, other unit, too many)
+int parse_range_header(const std::string &value, off_t size,
+                       std::vector<std::pair<off_t, off_t> > &ranges) {
+  std::string spec = strip(value);
+  if (spec.size() < 6 || to_lower(spec.substr(0, 6)) != "bytes=")
+    return 200;
+  std::vector<std::string> items = split(spec.substr(6), ',');
+  if (items.size() > MAX_RANGES)
+    return 200;
+
+  for (size_t i = 0; i < items.size(); ++i) {
+    std::string item = strip(items[i]);
+    if (item.empty())
+      continue;
+    std::string::size_type dash = item.find('-');
+    if (dash == std::string::npos)
+      return 200;
+    std::string first = strip(item.substr(0, dash));
+    std::string last = strip(item.substr(dash + 1));
+    off_t start, end;
+
+    if (first.empty()) {
+      // suffix range, the last n bytes
+      off_t n;
+      if (!parse_offset(last, n))
+        return 200;
+      start = n < size ? size - n : 0;
+      end = size;
+    } else {
+      if (!parse_offset(first, start))
+        return 200;
+      if (last.empty())
+        end = size;
+      else if (!parse_offset(last, end) || end < start)
+        return 200;
+      else
+        end = end < size ? end + 1 : size;
+    }
+    if (start < end)
+      ranges.push_back(std::make_pair(start, end));
+  }
+  if (ranges.empty())
+    return 416;
+  return 206;
+}
+
 std::string int_to_hex(int value) {
-  std::stringstream ss;
-  ss << std::hex << std::uppercase << value;
-  return ss.str();
+  std::string hex;
+  append_number(hex, static_cast<unsigned int>(value), 16, true);
+  return hex;
 }
 
 std::string join_paths(const std::string &path1, const std::string &path2) {
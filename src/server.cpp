@@ -1,8 +1,24 @@
+#include "../include/CgiCache.hpp"
 #include "../include/ClientPool.hpp"
+#include "../include/ContentCache.hpp"
+#include "../include/ErrorResponses.hpp"
+#include "../include/FastCGI.hpp"
 #include "../include/errors.hpp"
 #include "../include/helpers.hpp"
 #include "../include/parser.hpp"
 #include "../include/webserv.hpp"
+#include <limits>
+#include <set>
+
+// limit_rate is enforced in sends of at least this much, or of an eighth
+// of a second worth of the rate when that is less
+#define RATE_LIMIT_CHUNK (16 * 1024L)
+
+// the open connections, for the status page
+static std::map<int, Client *> *connections = NULL;
+// connections held back by limit_rate, by the time they may send again.
+// their socket is out of epoll until then
+static std::set<std::pair<long, int> > throttled;
 
 void free_client(int epoll_fd, Client *client,
                  std::map<int, Client *> *fd_to_client, ClientPool *pool) {
@@ -11,6 +27,8 @@ void free_client(int epoll_fd, Client *client,
   LOG_STREAM(INFO, "Client: " << fd << " on port " << client->port
                               << " has been freed.");
   fd_to_client->erase(fd);
+  if (client->cgi.pipe_fd != -1 || client->cgi.in_pipe_fd != -1)
+    stop_cgi(epoll_fd, client);
 
   discard_socket_buffer(client->get_socket());
   if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1)
@@ -30,6 +48,48 @@ void print_request_log(HttpRequest *request) {
                                  << "\"");
 }
 
+// sends the interim response a client asked for with "Expect: 100-continue".
+// part of the line would corrupt the response stream, the connection is
+// dropped when it isn't sent whole
+void send_continue(Client &client) {
+  std::string line = generate_status_line(100) + CRLF;
+  ssize_t sent =
+      send(client.get_socket(), line.c_str(), line.size(), MSG_NOSIGNAL);
+  if (sent != (ssize_t)line.size()) {
+    LOG_STREAM(WARNING, "Failed to send 100 Continue on fd "
+                            << client.get_socket());
+    client.connected = false;
+  }
+}
+
+// routes a freshly parsed head and validates the announced body,
+// so a rejected body is answered before any of it is read
+void setup_parsed_head(Client &client, std::vector<ServerConfig> &servers_conf) {
+  HttpRequest *req = client.get_request();
+
+  print_request_log(req);
+  req->setup_serverconf(servers_conf, client.port);
+  req->setup_body_limit();
+
+  std::string expect;
+  try {
+    expect = to_lower(strip(req->get_header_by_key("expect")->value));
+  } catch (std::exception &e) {
+    return;
+  }
+  if (expect != "100-continue")
+    throw ParsingError(EXPECTATION_FAILED, "Unsupported expectation: " + expect);
+  // nothing to wait for, or the client already started sending the body
+  if (req->request_is_ready() || !client.remaining_from_last_request.empty())
+    return;
+  // the final status instead of a body that would be thrown away
+  if (answer_from_head(client)) {
+    client.error_code = true;
+    return;
+  }
+  send_continue(client);
+}
+
 bool handle_client(int epoll_fd, Client &client, uint32_t actions,
                    std::vector<ServerConfig> &servers_conf) {
   int status_code = 0;
@@ -38,19 +98,23 @@ bool handle_client(int epoll_fd, Client &client, uint32_t actions,
   if (actions & EPOLLIN) {
     // Read data from client and process request, then prepare a response:
     try {
-      if (client.parse_loop(1)) {
+      if (can_splice_cgi_input(&client)) {
+        splice_cgi_input(epoll_fd, &client);
+      } else if (client.parse_loop(1)) {
         req = client.get_request();
         if (req && !(req->server_conf) && req->head_parsed) {
-          print_request_log(req);
-          req->setup_serverconf(servers_conf, client.port);
+          setup_parsed_head(client, servers_conf);
+          start_script_early(epoll_fd, client);
+          start_upload_early(client);
         }
-        if (!client.remaining_from_last_request.empty()) {
+        if (!client.remaining_from_last_request.empty() && !client.error_code) {
           if (client.parse_loop(0)) {
             // setup the server_conf if head is parsed
             req = client.get_request();
             if (req && !(req->server_conf) && req->head_parsed) {
-              print_request_log(req);
-              req->setup_serverconf(servers_conf, client.port);
+              setup_parsed_head(client, servers_conf);
+              start_script_early(epoll_fd, client);
+              start_upload_early(client);
             }
           }
         }
@@ -60,9 +124,11 @@ bool handle_client(int epoll_fd, Client &client, uint32_t actions,
         return false;
 
       req = client.get_request();
-      if (!req) {
+      if (!req || client.error_code) {
         return true;
       }
+      if (req->body_sink && !write_cgi_input(epoll_fd, &client))
+        throw std::runtime_error("CGI: Writing the request body failed");
 
       if (client.connected && !req->request_is_ready()) { // don't block
         return true;
@@ -81,24 +147,26 @@ bool handle_client(int epoll_fd, Client &client, uint32_t actions,
     try {
       client.remaining_from_last_request.clear();
       if (status_code) {
+        // the script's response already started and can't be replaced,
+        // the connection is closed (and the script stopped) instead
+        if (client.cgi.streaming || !client.out.empty())
+          return false;
+        // a script started early doesn't get the rest of the body
+        if (client.cgi.pid != -1) {
+          stop_cgi(epoll_fd, &client);
+          client.clear_cgi();
+        }
         client.error_code = true;
         send_special_response(client, status_code);
-      } else
+      } else if (!req->body_sink) {
         process_request(epoll_fd, client);
+      }
     } catch (std::exception &e) {
       LOG_STREAM(ERROR, "Generating response failed: " << e.what());
       send_special_response(client, 500);
     }
   }
 
-  if (actions & EPOLLOUT) {
-    if (client.error_code ||
-        (client.get_request() && client.get_request()->request_is_ready())) {
-      if (!handle_write(client))
-        return false;
-    }
-  }
-
   if (actions & (EPOLLHUP | EPOLLERR)) {
     LOG(WARNING, "Client disconnected or error");
     return false;
@@ -109,6 +177,194 @@ bool handle_client(int epoll_fd, Client &client, uint32_t actions,
   return true;
 }
 
+// bytes limit_rate lets the response send now: the rate since the
+// response started plus a second of burst, on top of limit_rate_after.
+// when that is less than a chunk, 0 is returned and throttled_until is
+// set to when a chunk will be allowed
+static size_t rate_allowance(Client &client, long now) {
+  if (!client.limit_rate || !client.pending_bytes())
+    return std::numeric_limits<size_t>::max();
+  long rate = client.limit_rate;
+  long allowed = rate * (now - client.rate_start + 1000) / 1000 +
+                 static_cast<long>(client.limit_rate_after) -
+                 static_cast<long>(client.bytes_sent - client.rate_start_bytes);
+  long chunk = std::min(RATE_LIMIT_CHUNK, rate / 8 + 1);
+  if (allowed >= chunk)
+    return allowed;
+  client.throttled_until = now + (chunk - allowed) * 1000 / rate + 1;
+  return 0;
+}
+
+// sends the client's response until its write quantum for this pass or
+// its limit_rate allowance is used, the socket is full or the response is
+// complete. returns false when the connection has to be closed
+bool write_client(Client &client, long now) {
+  HttpRequest *request = client.get_request();
+  size_t quantum = request && request->server_conf
+                       ? request->server_conf->getWriteQuantum()
+                       : DEFAULT_WRITE_QUANTUM;
+  size_t start = client.bytes_sent;
+
+  client.blocked = false;
+  client.throttled_until = 0;
+  quantum = std::min(quantum, rate_allowance(client, now));
+  if (!quantum)
+    return true;
+  // a script's output is sent while its body is received, all but its
+  // last segment until the body is complete
+  while (client.error_code ||
+         (client.get_request() &&
+          (client.get_request()->request_is_ready() || !client.out.empty()))) {
+    size_t before = client.bytes_sent;
+    client.send_limit = quantum - (client.bytes_sent - start);
+    if (receiving_script_body(&client)) {
+      size_t sendable = sendable_output(&client);
+      if (!sendable)
+        break;
+      client.send_limit = std::min(client.send_limit, sendable);
+    }
+    bool ok = handle_write(client);
+    client.send_limit = std::numeric_limits<size_t>::max();
+    if (!ok)
+      return false;
+    if (client.free_client || client.blocked || client.bytes_sent == before ||
+        client.bytes_sent - start >= quantum)
+      break;
+  }
+  // allowance used up, wait for the timer rather than the next EPOLLOUT
+  if (client.limit_rate && !client.blocked && !client.free_client)
+    rate_allowance(client, monotonic_ms());
+  return !client.free_client;
+}
+
+// puts the throttled connections whose wait is over back in epoll and in
+// this pass's writes
+void wake_throttled(int epoll_fd, std::vector<int> &writable,
+                    struct epoll_event *ev,
+                    std::map<int, Client *> *fd_to_client) {
+  long now = monotonic_ms();
+
+  while (!throttled.empty() && throttled.begin()->first <= now) {
+    std::pair<long, int> timer = *throttled.begin();
+    throttled.erase(throttled.begin());
+    // the connection may be gone, its fd reused by another one
+    std::map<int, Client *>::iterator it = fd_to_client->find(timer.second);
+    if (it == fd_to_client->end() ||
+        it->second->throttled_until != timer.first)
+      continue;
+    it->second->throttled_until = 0;
+    it->second->last_time = std::time(NULL);
+    ev->events = EPOLLOUT;
+    ev->data.fd = timer.second;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, timer.second, ev))
+      LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
+    writable.push_back(timer.second);
+  }
+}
+
+// the clients a FastCGI application or an identical request answered in
+// this pass are written right away. those whose identical request failed
+// or took too long run their own script
+void wake_waiting_clients(int epoll_fd, std::vector<int> &writable,
+                          struct epoll_event *ev,
+                          std::map<int, Client *> *fd_to_client) {
+  std::vector<int> fds;
+  std::vector<int> retries;
+
+  cgi_cache.take_retries(retries);
+  for (size_t i = 0; i < retries.size(); ++i) {
+    std::map<int, Client *>::iterator it = fd_to_client->find(retries[i]);
+    if (it == fd_to_client->end())
+      continue;
+    Client *client = it->second;
+    try {
+      process_request(epoll_fd, *client);
+    } catch (std::exception &e) {
+      LOG_STREAM(ERROR, "Generating response failed: " << e.what());
+      send_special_response(*client, 500);
+    }
+    // answered right away, from the cache or with an error
+    if (client->cgi.pipe_fd == -1 && !client->fastcgi &&
+        !client->cache_flight)
+      fds.push_back(retries[i]);
+  }
+  fastcgi_pool.take_finished(fds);
+  cgi_cache.take_finished(fds);
+  for (size_t i = 0; i < fds.size(); ++i) {
+    if (fd_to_client->find(fds[i]) == fd_to_client->end())
+      continue;
+    ev->events = EPOLLOUT;
+    ev->data.fd = fds[i];
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fds[i], ev))
+      LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
+    writable.push_back(fds[i]);
+  }
+}
+
+// epoll_wait timeout, shortened when a throttled connection is due sooner
+int next_timeout() {
+  if (throttled.empty())
+    return CGI_TIMEOUT;
+  long wait = throttled.begin()->first - monotonic_ms();
+  return std::max(0L, std::min(static_cast<long>(CGI_TIMEOUT), wait));
+}
+
+// serves the connections found writable in this pass, the ones with the
+// least left to send first so small responses aren't held up by bulk ones
+void schedule_writes(int epoll_fd, std::vector<int> &writable,
+                     struct epoll_event *ev,
+                     std::map<int, Client *> *fd_to_client, ClientPool *pool) {
+  std::vector<std::pair<size_t, int> > order;
+  std::map<int, Client *>::iterator it;
+  long now = monotonic_ms();
+
+  for (size_t i = 0; i < writable.size(); ++i) {
+    it = fd_to_client->find(writable[i]);
+    if (it != fd_to_client->end())
+      order.push_back(std::make_pair(it->second->pending_bytes(), it->first));
+  }
+  writable.clear();
+  std::sort(order.begin(), order.end());
+
+  for (size_t i = 0; i < order.size(); ++i) {
+    it = fd_to_client->find(order[i].second);
+    if (it == fd_to_client->end())
+      continue;
+    Client *client = it->second;
+    size_t requests = client->requests;
+    if (!write_client(*client, now)) {
+      free_client(epoll_fd, client, fd_to_client, pool);
+      continue;
+    }
+    if (client->throttled_until) {
+      throttled.insert(
+          std::make_pair(client->throttled_until, client->get_socket()));
+      ev->events = 0;
+      ev->data.fd = client->get_socket();
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->get_socket(), ev))
+        LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
+      continue;
+    }
+    if (client->cgi.streaming || receiving_script_body(client)) {
+      if (client->cgi.paused &&
+          client->pending_bytes() < CGI_OUTPUT_BUFFERED / 2)
+        resume_cgi(epoll_fd, client);
+      // all of the script's output so far is sent, or all of it that
+      // can be before the end of the body: wait for more of either
+      if (client->out.empty() || receiving_script_body(client))
+        watch_script_client(epoll_fd, client);
+      continue;
+    }
+    // response complete, wait for the next request
+    if (client->requests != requests && !client->get_request()) {
+      ev->events = EPOLLIN;
+      ev->data.fd = client->get_socket();
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->get_socket(), ev))
+        LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
+    }
+  }
+}
+
 int get_server_fd(const std::string &port, const std::string &ip) {
   int status;
   struct addrinfo hints, *servinfo;
@@ -204,7 +460,11 @@ void free_unused_clients(int epoll_fd, std::map<int, Client *> *fd_to_client,
   while (it != end) {
     std::time_t current_time = std::time(NULL);
     double elapsed = std::difftime(current_time, it->second->last_time);
-    if (elapsed >= CLIENT_TIMEOUT) {
+    // keep-alive connections waiting for their next request get the
+    // server's keepalive_timeout instead
+    double timeout = it->second->is_idle() ? it->second->keepalive_timeout
+                                           : CLIENT_TIMEOUT;
+    if (elapsed >= timeout) {
       LOG_STREAM(INFO, "Timeout: " << elapsed);
       free_client(epoll_fd, it->second, fd_to_client, pool);
       it = fd_to_client->begin();
@@ -214,12 +474,42 @@ void free_unused_clients(int epoll_fd, std::map<int, Client *> *fd_to_client,
   }
 }
 
+std::string get_connections_status() {
+  size_t active = 0;
+  size_t idle = 0;
+  size_t active_bytes = 0;
+  size_t idle_bytes = 0;
+
+  if (connections) {
+    for (std::map<int, Client *>::iterator it = connections->begin();
+         it != connections->end(); ++it) {
+      if (it->second->is_idle()) {
+        idle++;
+        idle_bytes += it->second->memory_usage();
+      } else {
+        active++;
+        active_bytes += it->second->memory_usage();
+      }
+    }
+  }
+  return "connections: active " + long_to_string(active) + " bytes " +
+         long_to_string(active_bytes) + " idle " + long_to_string(idle) +
+         " bytes " + long_to_string(idle_bytes) + " per idle " +
+         long_to_string(idle ? idle_bytes / idle : 0) + "\n";
+}
+
 std::vector<Client *> cgi_timeout() {
   std::vector<Client *> cgi_timedout;
   std::map<int, Client *>::iterator it = cgi_to_client.begin();
   std::map<int, Client *>::iterator end = cgi_to_client.end();
   while (it != end) {
-    if (it->second->cgi.start != -1) {
+    // a paused script waits on its client, not the other way around, as
+    // does one still reading the request body. a script has two pipes,
+    // it is looked at through its output
+    Client *client = it->second;
+    if (it->first == client->cgi.pipe_fd && client->cgi.start != -1 &&
+        !client->cgi.paused && client->get_request() &&
+        client->get_request()->request_is_ready()) {
       std::time_t current_time = std::time(NULL);
       double elapsed = std::difftime(current_time, it->second->cgi.start);
       if (elapsed >= CGI_TIMEOUT) {
@@ -245,24 +535,31 @@ void server(std::vector<ServerConfig> &servers_conf, int epoll_fd,
   std::map<int, std::string>::iterator it;
   std::map<int, Client *>::iterator fd_client_it;
   std::vector<Client *> clients_vec;
+  std::vector<int> writable;
   bool result;
   int r;
 
   for (;;) {
     // Wait for events on monitored file descriptors
-    nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, CGI_TIMEOUT);
+    nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, next_timeout());
     if (nfds == -1) {
       LOG_STREAM(ERROR, "epoll_wait: " << strerror(errno));
       continue;
     }
+    wake_throttled(epoll_fd, writable, ev, fd_to_client);
+    open_file_cache.expire();
+    fastcgi_pool.expire();
+    cgi_cache.expire();
     if (nfds == 0) {
       clients_vec = cgi_timeout();
       for (std::vector<Client *>::iterator it = clients_vec.begin();
            it != clients_vec.end(); ++it) {
         client = *it;
-        send_special_response(*client, 504);
-        kill(client->cgi.pid, SIGTERM);
-        cgi_cleanup(epoll_fd, client);
+        stop_cgi(epoll_fd, client);
+        if (client->cgi.streaming)
+          cut_cgi_response(client);
+        else
+          send_special_response(*client, 504);
         client->clear_cgi();
         ev->events = EPOLLOUT;
         ev->data.fd = client->get_socket();
@@ -270,11 +567,21 @@ void server(std::vector<ServerConfig> &servers_conf, int epoll_fd,
           LOG_STREAM(ERROR, "epoll_ctl: " << strerror(errno));
       }
       wait_for_child();
+      wake_waiting_clients(epoll_fd, writable, ev, fd_to_client);
+      schedule_writes(epoll_fd, writable, ev, fd_to_client, pool);
       free_unused_clients(epoll_fd, fd_to_client, pool);
       continue;
     }
 
     for (int i = 0; i < nfds; i++) {
+      if (events[i].data.fd == open_file_cache.get_fd()) {
+        open_file_cache.handle_events();
+        continue;
+      }
+      if (fastcgi_pool.owns(events[i].data.fd)) {
+        fastcgi_pool.handle_event(events[i].data.fd, events[i].events);
+        continue;
+      }
       it = fd_to_port.find(events[i].data.fd);
       if (it != fd_to_port.end()) {
         addr_size = sizeof client_addr;
@@ -319,13 +626,26 @@ void server(std::vector<ServerConfig> &servers_conf, int epoll_fd,
         fd_client_it = cgi_to_client.find(client_fd);
         if (fd_client_it != cgi_to_client.end()) {
           client = fd_client_it->second;
-          r = handle_cgi(epoll_fd, client, events[i].events);
+          r = handle_cgi(epoll_fd, client, client_fd, events[i].events);
           if (r == -1)
             continue;
           if (r > 0) {
             client->clear_cgi();
             send_special_response(*client, r);
+            // sent before the rest of the body, which is not read
+            if (!client->get_request()->request_is_ready())
+              client->error_code = true;
+          }
+          // the output is sent while the rest of the body is read
+          if (!client->error_code &&
+              !client->get_request()->request_is_ready()) {
+            watch_script_client(epoll_fd, client);
+            if (!client->out.empty())
+              writable.push_back(client->get_socket());
+            continue;
           }
+          // the script's output is forwarded as soon as it is read
+          writable.push_back(client->get_socket());
           ev->events = EPOLLOUT;
           ev->data.fd = client->get_socket();
           if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->get_socket(), ev))
@@ -342,12 +662,22 @@ void server(std::vector<ServerConfig> &servers_conf, int epoll_fd,
           if (!result) {
             free_client(epoll_fd, client, fd_to_client, pool);
           } else {
-            if (client->cgi.pipe_fd != -1) {
+            if (client->cgi.pipe_fd != -1 || client->fastcgi ||
+                client->cache_flight || receiving_script_body(client)) {
+              // output the script wrote while its body is received
+              if (!(events[i].events & EPOLLOUT) && !client->out.empty()) {
+                watch_script_client(epoll_fd, client);
+                writable.push_back(client_fd);
+              } else if (events[i].events & EPOLLOUT)
+                writable.push_back(client_fd);
               continue;
             } else if (client->connected &&
                        ((client->get_request() &&
                          client->get_request()->request_is_ready()) ||
                         client->error_code)) {
+              // a response generated in this pass is written right away,
+              // the socket is writable more often than not
+              writable.push_back(client_fd);
               if (!(events[i].events & (EPOLLOUT))) {
                 ev->events = EPOLLOUT;
                 ev->data.fd = client_fd;
@@ -370,6 +700,8 @@ void server(std::vector<ServerConfig> &servers_conf, int epoll_fd,
         }
       }
     }
+    wake_waiting_clients(epoll_fd, writable, ev, fd_to_client);
+    schedule_writes(epoll_fd, writable, ev, fd_to_client, pool);
   }
 }
 
@@ -427,6 +759,13 @@ int start_server(std::vector<ServerConfig> &servers_conf) {
     }
   }
 
+  open_file_cache.configure(servers_conf);
+  open_file_cache.init(epoll_fd);
+  fastcgi_pool.init(epoll_fd);
+  content_cache.configure(servers_conf);
+  cgi_cache.configure(servers_conf);
+  error_responses.configure(servers_conf);
+
   ClientPool *pool;
   std::map<int, Client *> *fd_to_client;
   try {
@@ -438,6 +777,7 @@ int start_server(std::vector<ServerConfig> &servers_conf) {
     return 1;
   }
 
+  connections = fd_to_client;
   LOG(INFO, "Server started");
   server(servers_conf, epoll_fd, &ev, pool, fd_to_client, fd_to_port);
 
@@ -447,6 +787,7 @@ int start_server(std::vector<ServerConfig> &servers_conf) {
   }
   delete pool;
   delete fd_to_client;
+  connections = NULL;
   close(epoll_fd);
   return 0;
 }
@@ -91,6 +91,10 @@ static char http_error_416_page[] =
     "<body>" CRLF
     "<center><h1>416 Requested Range Not Satisfiable</h1></center>" CRLF;
 
+static char http_error_417_page[] =
+    "<html>" CRLF "<head><title>417 Expectation Failed</title></head>" CRLF
+    "<body>" CRLF "<center><h1>417 Expectation Failed</h1></center>" CRLF;
+
 static char http_error_421_page[] =
     "<html>" CRLF "<head><title>421 Misdirected Request</title></head>" CRLF
     "<body>" CRLF "<center><h1>421 Misdirected Request</h1></center>" CRLF;
@@ -227,6 +231,9 @@ std::string special_response(int status_code) {
   case 416:
     head = http_error_416_page;
     break;
+  case 417:
+    head = http_error_417_page;
+    break;
   case 421:
     head = http_error_421_page;
     break;
@@ -276,3 +283,14 @@ std::string special_response(int status_code) {
   }
   return std::string(head) + std::string(http_error_tail);
 }
+
+// the status codes special_response() has a page for
+const std::vector<int> &special_response_codes() {
+  static const int codes[] = {301, 302, 303, 307, 308, 400, 401, 402, 403,
+                              404, 405, 406, 408, 409, 410, 411, 412, 413,
+                              414, 415, 416, 417, 421, 429, 431, 494, 495,
+                              496, 497, 500, 501, 502, 503, 504, 505, 507};
+  static const std::vector<int> list(codes,
+                                     codes + sizeof(codes) / sizeof(codes[0]));
+  return list;
+}
@@ -6,9 +6,7 @@
 
 
 std::string URL::normalize_url(std::string url) {
-    std::string decoded = decode_url(url);
-    decoded = clean_path(decoded);
-    return decoded;
+    return normalize_path(url);
 }
 
 // parse the url
@@ -253,6 +253,13 @@ void discard_socket_buffer(int client_fd) {
   }
 }
 
+// milliseconds on a clock that doesn't jump with the wall time
+long monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
 bool is_dir(const std::string &path) {
   struct stat info;
   if (stat(path.c_str(), &info) != 0) {
@@ -0,0 +1,129 @@
+#include "../include/helpers.hpp"
+#include <cstdio>
+
+// checks normalize_path() against the decode_url() + clean_path() pair it
+// replaced, against a plain segment based reference, and on fixed cases
+
+static int failures = 0;
+
+static void check(const std::string &input, const std::string &got,
+                  const std::string &expected, const char *what) {
+  if (got == expected)
+    return;
+  if (failures++ < 20)
+    std::printf("%s: \"%s\" -> \"%s\", expected \"%s\"\n", what,
+                input.c_str(), got.c_str(), expected.c_str());
+}
+
+// the old implementation, kept here as the reference for equivalence
+static std::string replace_first(const std::string &str,
+                                 const std::string &old_sub,
+                                 const std::string &new_sub) {
+  size_t pos = str.find(old_sub);
+  if (pos == std::string::npos)
+    return str;
+  return str.substr(0, pos) + new_sub + str.substr(pos + old_sub.size());
+}
+
+static std::string old_clean_path(const std::string &url) {
+  std::string clean = url;
+  while (clean != replace_first(clean, "//", "/"))
+    clean = replace_first(clean, "//", "/");
+
+  std::vector<std::string> parts = split(clean, '/');
+  std::vector<std::string> clean_parts;
+  for (size_t i = 0; i < parts.size(); i++) {
+    if (parts[i] == "..") {
+      if (!clean_parts.empty())
+        clean_parts.pop_back();
+    } else {
+      clean_parts.push_back(parts[i]);
+    }
+  }
+  clean = join(clean_parts, "/");
+
+  while (clean != replace_first(clean, "./", ""))
+    clean = replace_first(clean, "./", "");
+  if (clean[0] != '/')
+    clean = "/" + clean;
+  return clean;
+}
+
+// RFC 3986 dot segment removal on the decoded path
+static std::string reference(const std::string &raw) {
+  std::string decoded = decode_url(raw);
+  std::vector<std::string> segments;
+  size_t start = 0;
+  while (start <= decoded.size()) {
+    size_t end = decoded.find('/', start);
+    if (end == std::string::npos)
+      end = decoded.size();
+    std::string segment = decoded.substr(start, end - start);
+    if (segment == "..") {
+      if (!segments.empty())
+        segments.pop_back();
+    } else if (!segment.empty() && segment != ".") {
+      segments.push_back(segment);
+    }
+    start = end + 1;
+  }
+
+  std::string path;
+  for (size_t i = 0; i < segments.size(); i++)
+    path += "/" + segments[i];
+  if (path.empty())
+    return "/";
+  if (decoded[decoded.size() - 1] == '/')
+    path += '/';
+  return path;
+}
+
+static std::string random_path(const char **alphabet, size_t count) {
+  std::string path = "/";
+  int segments = std::rand() % 10;
+  for (int k = 0; k < segments; k++) {
+    path += alphabet[std::rand() % count];
+    if (k + 1 < segments || std::rand() % 2)
+      path += std::rand() % 3 ? "/" : "%2F";
+  }
+  return path;
+}
+
+int main() {
+  const char *fixed[][2] = {
+      {"", "/"},
+      {"/", "/"},
+      {"////", "/"},
+      {"/a//b///c", "/a/b/c"},
+      {"/a/b/", "/a/b/"},
+      {"/a/../b", "/b"},
+      {"/../../a", "/a"},
+      {"/a/b/..", "/a"},
+      {"/a/%2e%2e/b", "/b"},
+      {"/a%2Fb", "/a/b"},
+      {"/%41%42", "/AB"},
+      {"/a%2", "/a%2"},
+      // quirks of the old code that were fixed
+      {"/a./b", "/a./b"},
+      {"/a/./../b", "/b"},
+      {"/a/.", "/a"},
+  };
+  for (size_t i = 0; i < sizeof(fixed) / sizeof(*fixed); i++)
+    check(fixed[i][0], normalize_path(fixed[i][0]), fixed[i][1], "fixed");
+
+  // names containing '.' hit the quirks, so the old code only sees ".."
+  const char *plain[] = {"..", "%2e%2e", "a", "b", "", "x%41"};
+  const char *dotted[] = {".", "..", "a", "b", "", "%2e", "%2e%2e", "a.", "x"};
+  std::srand(1);
+  for (int i = 0; i < 200000; i++) {
+    std::string path = random_path(plain, sizeof(plain) / sizeof(*plain));
+    std::string expected = old_clean_path(decode_url(path));
+    check(path, normalize_path(path), expected, "old");
+
+    path = random_path(dotted, sizeof(dotted) / sizeof(*dotted));
+    check(path, normalize_path(path), reference(path), "reference");
+  }
+
+  std::printf("normalize_path: %s\n", failures ? "FAILED" : "ok");
+  return failures != 0;
+}